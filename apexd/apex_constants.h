@@ -29,6 +29,10 @@ static constexpr const char* kApexBackupDir = "/data/apex/backup";
 static constexpr const char* kApexHashTreeDir = "/data/apex/hashtree";
 static constexpr const char* kApexDecompressedDir = "/data/apex/decompressed";
 static constexpr const char* kOtaReservedDir = "/data/apex/ota_reserved";
+static constexpr const char* kApexPrefetchDir = "/data/apex/prefetch";
+static constexpr const char* kActivationPlanFile = "/data/apex/activation_plan";
+static constexpr const char* kOtaSourceBuildFile =
+    "/data/apex/ota_source_build";
 static constexpr const char* kApexPackageSystemDir = "/system/apex";
 static constexpr const char* kApexPackageSystemExtDir = "/system_ext/apex";
 static constexpr const char* kApexPackageVendorDir = "/vendor/apex";
@@ -55,6 +59,11 @@ static constexpr const char* kCompressedApexPackageSuffix = ".capex";
 static constexpr const char* kDecompressedApexPackageSuffix =
     ".decompressed.apex";
 static constexpr const char* kOtaApexPackageSuffix = ".ota.apex";
+// Written to the decompression dir while CAPEXes are decompressed for an OTA,
+// as "<bytes written> <bytes total>", for the OTA client to report progress.
+// otapreopt_chroot removes it once decompression is done.
+static constexpr const char* kOtaDecompressionProgressFilename =
+    "ota_decompression_progress";
 
 static constexpr const char* kManifestFilenameJson = "apex_manifest.json";
 static constexpr const char* kManifestFilenamePb = "apex_manifest.pb";
@@ -27,6 +27,8 @@
 #include <android-base/result.h>
 #include <android-base/thread_annotations.h>
 
+#include "apexd_lock_stats.h"
+
 namespace android {
 namespace apex {
 
@@ -46,6 +48,10 @@ class MountedApexDatabase {
     bool deleted;
     // Whether the mount is a temp mount or not.
     bool is_temp_mount;
+    // Whether the loop device reads the APEX file with direct I/O, and if not,
+    // why. Only known for APEXes mounted by this process.
+    bool loop_direct_io = false;
+    std::string loop_buffered_reason;
 
     MountedApexData() {}
     MountedApexData(const std::string& loop_name, const std::string& full_path,
@@ -230,13 +236,7 @@ class MountedApexDatabase {
   std::map<std::string, std::map<MountedApexData, bool>> mounted_apexes_
       GUARDED_BY(mounted_apexes_mutex_);
 
-  // To fix thread safety negative capability warning
-  class Mutex : public std::mutex {
-   public:
-    // for negative capabilities
-    const Mutex& operator!() const { return *this; }
-  };
-  mutable Mutex mounted_apexes_mutex_;
+  mutable InstrumentedMutex mounted_apexes_mutex_{"mounted_apexes"};
 
   inline void CheckAtMostOneLatest() REQUIRES(mounted_apexes_mutex_) {
     for (const auto& apex_set : mounted_apexes_) {
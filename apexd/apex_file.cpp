@@ -31,6 +31,7 @@
 #include <filesystem>
 #include <fstream>
 #include <span>
+#include <sstream>
 
 #include "apex_constants.h"
 #include "apexd_utils.h"
@@ -63,6 +64,12 @@ constexpr const FsMagic kFsType[] = {{"f2fs", 1024, 4, "\x10\x20\xf5\xf2"},
                                      {"ext4", 1024 + 0x38, 2, "\123\357"},
                                      {"erofs", 1024, 4, "\xe2\xe1\xf5\xe0"}};
 
+// Offset of feature_incompat in the erofs superblock, and the features
+// mkfs.erofs sets when it compresses files.
+constexpr int32_t kErofsFeatureIncompatOffset = 1024 + 80;
+constexpr uint32_t kErofsFeatureIncompatZeroPadding = 0x1;
+constexpr uint32_t kErofsFeatureIncompatComprCfgs = 0x2;
+
 Result<std::string> RetrieveFsType(borrowed_fd fd, uint32_t image_offset) {
   for (const auto& fs : kFsType) {
     char buf[fs.len];
@@ -76,11 +83,24 @@ Result<std::string> RetrieveFsType(borrowed_fd fd, uint32_t image_offset) {
   return Error() << "Couldn't find filesystem magic";
 }
 
+Result<bool> HasCompressedFiles(borrowed_fd fd, uint32_t image_offset) {
+  uint8_t buf[4];
+  if (!ReadFullyAtOffset(fd, buf, sizeof(buf),
+                         image_offset + kErofsFeatureIncompatOffset)) {
+    return ErrnoError() << "Couldn't read erofs features";
+  }
+  const uint32_t features =
+      buf[0] | (buf[1] << 8) | (buf[2] << 16) | (uint32_t(buf[3]) << 24);
+  return (features & (kErofsFeatureIncompatZeroPadding |
+                      kErofsFeatureIncompatComprCfgs)) != 0;
+}
+
 }  // namespace
 
 Result<ApexFile> ApexFile::Open(const std::string& path) {
   std::optional<uint32_t> image_offset;
   std::optional<size_t> image_size;
+  std::optional<size_t> decompressed_size;
   std::string manifest_content;
   std::string pubkey;
   std::optional<std::string> fs_type;
@@ -106,6 +126,8 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
   ret = FindEntry(handle, kCompressedApexFilename, &entry);
   if (ret < 0) {
     is_compressed = false;
+  } else {
+    decompressed_size = entry.uncompressed_length;
   }
 
   if (!is_compressed) {
@@ -128,6 +150,28 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
     fs_type = std::move(*fs_type_result);
   }
 
+  // A CAPEX can hold the mountable image itself instead of original_apex, if
+  // the image is an erofs filesystem with compressed files.
+  bool is_natively_compressed = false;
+  if (!is_compressed &&
+      android::base::EndsWith(path, kCompressedApexPackageSuffix)) {
+    Result<bool> has_compressed_files =
+        fs_type == "erofs" ? HasCompressedFiles(fd, image_offset.value())
+                           : Result<bool>(false);
+    if (!has_compressed_files.ok()) {
+      return Error() << "Failed to open " << path << ": "
+                     << has_compressed_files.error();
+    }
+    if (!*has_compressed_files) {
+      return Error() << "Compressed APEX " << path << " has neither \""
+                     << kCompressedApexFilename
+                     << "\" nor an erofs payload with compressed files";
+    }
+    is_natively_compressed = true;
+    // Nothing to decompress.
+    decompressed_size = 0;
+  }
+
   ret = FindEntry(handle, kManifestFilenamePb, &entry);
   if (ret < 0) {
     return Error() << "Could not find entry \"" << kManifestFilenamePb
@@ -161,7 +205,8 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
     return manifest.error();
   }
 
-  if (is_compressed && manifest->providesharedapexlibs()) {
+  if ((is_compressed || is_natively_compressed) &&
+      manifest->providesharedapexlibs()) {
     return Error() << "Apex providing sharedlibs shouldn't be compressed";
   }
 
@@ -174,7 +219,8 @@ Result<ApexFile> ApexFile::Open(const std::string& path) {
   }
 
   return ApexFile(realpath, image_offset, image_size, std::move(*manifest),
-                  pubkey, fs_type, is_compressed);
+                  pubkey, fs_type, is_compressed, is_natively_compressed,
+                  decompressed_size);
 }
 
 // AVB-related code.
@@ -393,7 +439,129 @@ Result<ApexVerityData> ApexFile::VerifyApexVerity(
   return verity_data;
 }
 
+std::string GetDecompressionCheckpointPath(const std::string& output_path) {
+  return output_path + ".checkpoint";
+}
+
+namespace {
+
+// Bytes written between two checkpoints of a resumable decompression.
+constexpr uint64_t kDecompressionCheckpointInterval = 4 * 1024 * 1024;
+
+// A checkpoint is only valid for the entry it was taken for.
+struct DecompressionCheckpoint {
+  uint32_t crc32;
+  uint64_t total;
+  uint64_t offset;
+};
+
+Result<void> WriteDecompressionCheckpoint(
+    const std::string& path, const DecompressionCheckpoint& checkpoint) {
+  const std::string tmp_path = path + ".tmp";
+  const std::string content =
+      std::to_string(checkpoint.crc32) + " " +
+      std::to_string(checkpoint.total) + " " +
+      std::to_string(checkpoint.offset);
+  if (!android::base::WriteStringToFile(content, tmp_path)) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
+// Returns the offset to resume writing |dest_path| from, or 0 if there is no
+// usable checkpoint for |entry|.
+uint64_t ReadDecompressionCheckpoint(const std::string& path,
+                                     const std::string& dest_path,
+                                     const ZipEntry& entry) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    return 0;
+  }
+  DecompressionCheckpoint checkpoint;
+  std::istringstream in(content);
+  if (!(in >> checkpoint.crc32 >> checkpoint.total >> checkpoint.offset)) {
+    LOG(WARNING) << "Ignoring malformed checkpoint " << path;
+    return 0;
+  }
+  if (checkpoint.crc32 != entry.crc32 ||
+      checkpoint.total != entry.uncompressed_length) {
+    LOG(WARNING) << "Ignoring checkpoint " << path << " of another APEX";
+    return 0;
+  }
+  struct stat st;
+  if (stat(dest_path.c_str(), &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) < checkpoint.offset) {
+    LOG(WARNING) << "Ignoring checkpoint " << path << " past the end of "
+                 << dest_path;
+    return 0;
+  }
+  return checkpoint.offset;
+}
+
+struct ResumableWriter {
+  int fd;
+  const DecompressOptions* options;
+  std::string checkpoint_path;
+  DecompressionCheckpoint checkpoint;
+  // Everything below this offset is already on disk. Deflate streams can't be
+  // entered midway, so those bytes are inflated again but not written.
+  uint64_t skip;
+  uint64_t offset = 0;
+  bool stopped = false;
+  Result<void> status = {};
+
+  Result<void> Checkpoint() {
+    if (fdatasync(fd) != 0) {
+      return ErrnoError() << "Failed to sync decompressed data";
+    }
+    // Stopping while still inflating the part that is already on disk must
+    // not move the checkpoint back.
+    checkpoint.offset = std::max(offset, skip);
+    return WriteDecompressionCheckpoint(checkpoint_path, checkpoint);
+  }
+
+  bool Write(const uint8_t* buf, size_t size) {
+    const uint64_t end = offset + size;
+    if (end > skip) {
+      const uint64_t from = std::max(offset, skip) - offset;
+      if (!android::base::WriteFully(fd, buf + from, size - from)) {
+        status = ErrnoError() << "Failed to write decompressed data";
+        return false;
+      }
+    }
+    const bool crossed_interval = end / kDecompressionCheckpointInterval !=
+                                  offset / kDecompressionCheckpointInterval;
+    offset = end;
+    if (crossed_interval && offset > skip) {
+      if (status = Checkpoint(); !status.ok()) {
+        return false;
+      }
+    }
+    if (options->on_progress &&
+        !options->on_progress(offset, checkpoint.total)) {
+      stopped = true;
+      status = Checkpoint();
+      return false;
+    }
+    return true;
+  }
+
+  static bool Callback(const uint8_t* buf, size_t size, void* cookie) {
+    return static_cast<ResumableWriter*>(cookie)->Write(buf, size);
+  }
+};
+
+}  // namespace
+
 Result<void> ApexFile::Decompress(const std::string& dest_path) const {
+  return Decompress(dest_path, DecompressOptions{});
+}
+
+Result<void> ApexFile::Decompress(const std::string& dest_path,
+                                  const DecompressOptions& options) const {
   const std::string& src_path = GetPath();
 
   LOG(INFO) << "Decompressing" << src_path << " to " << dest_path;
@@ -428,23 +596,86 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
                    << ErrorCodeString(ret);
   }
 
-  // Open destination file descriptor
-  unique_fd dest_fd(
-      open(dest_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644));
+  const std::string checkpoint_path =
+      GetDecompressionCheckpointPath(dest_path);
+  const uint64_t resume_offset =
+      options.resume
+          ? ReadDecompressionCheckpoint(checkpoint_path, dest_path, entry)
+          : 0;
+
+  // Open destination file descriptor. Only a checkpointed file may already
+  // exist.
+  int flags = O_WRONLY | O_CLOEXEC | O_CREAT;
+  if (resume_offset == 0) {
+    flags |= O_EXCL;
+    if (options.resume) {
+      RemoveFileIfExists(dest_path);
+    }
+  }
+  unique_fd dest_fd(open(dest_path.c_str(), flags, 0644));
   if (dest_fd.get() == -1) {
     return ErrnoError() << "Failed to open decompression destination "
                         << dest_path.c_str();
   }
 
   // Prepare a guard that deletes the extracted file if anything goes wrong
-  auto decompressed_guard = android::base::make_scope_guard(
-      [&dest_path] { RemoveFileIfExists(dest_path); });
-
-  // Extract the original_apex to dest_path
-  ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
-  if (ret < 0) {
-    return Error() << "Could not decompress to file " << dest_path << " "
-                   << ErrorCodeString(ret);
+  auto decompressed_guard =
+      android::base::make_scope_guard([&dest_path, &checkpoint_path] {
+        RemoveFileIfExists(dest_path);
+        RemoveFileIfExists(checkpoint_path);
+      });
+
+  if (!options.resume && !options.on_progress) {
+    // Extract the original_apex to dest_path
+    ret = ExtractEntryToFile(handle, &entry, dest_fd.get());
+    if (ret < 0) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << ErrorCodeString(ret);
+    }
+  } else {
+    if (resume_offset > 0) {
+      LOG(INFO) << "Resuming decompression of " << src_path << " at "
+                << resume_offset << " of " << entry.uncompressed_length;
+      if (ftruncate(dest_fd.get(), resume_offset) != 0 ||
+          lseek(dest_fd.get(), resume_offset, SEEK_SET) == -1) {
+        return ErrnoError() << "Failed to seek " << dest_path;
+      }
+    }
+    if (options.on_resume) {
+      options.on_resume(resume_offset);
+    }
+    ResumableWriter writer{
+        .fd = dest_fd.get(),
+        .options = &options,
+        .checkpoint_path = checkpoint_path,
+        .checkpoint = {.crc32 = entry.crc32,
+                       .total = entry.uncompressed_length,
+                       .offset = resume_offset},
+        .skip = resume_offset,
+    };
+    ret = ProcessZipEntryContents(handle, &entry, &ResumableWriter::Callback,
+                                  &writer);
+    if (writer.stopped) {
+      if (!writer.status.ok()) {
+        return Error() << "Failed to checkpoint " << dest_path << ": "
+                       << writer.status.error();
+      }
+      // Keep what was written for the next attempt to resume from.
+      decompressed_guard.Disable();
+      return Error() << "Decompression of " << src_path << " stopped at "
+                     << writer.offset << " of " << entry.uncompressed_length;
+    }
+    if (!writer.status.ok()) {
+      return writer.status.error();
+    }
+    if (ret < 0) {
+      return Error() << "Could not decompress to file " << dest_path << " "
+                     << ErrorCodeString(ret);
+    }
+    if (fsync(dest_fd.get()) != 0) {
+      return ErrnoError() << "Failed to sync " << dest_path;
+    }
+    RemoveFileIfExists(checkpoint_path);
   }
 
   // Verification complete. Accept the decompressed file
@@ -454,5 +685,16 @@ Result<void> ApexFile::Decompress(const std::string& dest_path) const {
   return {};
 }
 
+size_t ApexFile::InternStrings(StringPool* pool) {
+  auto [it, inserted] = pool->try_emplace(*apex_pubkey_, apex_pubkey_);
+  if (inserted || it->second == apex_pubkey_) {
+    return 0;
+  }
+  // Only our own copy goes away; one shared with another ApexFile stays.
+  size_t freed = apex_pubkey_.use_count() == 1 ? apex_pubkey_->capacity() : 0;
+  apex_pubkey_ = it->second;
+  return freed;
+}
+
 }  // namespace apex
 }  // namespace android
@@ -17,8 +17,11 @@
 #ifndef ANDROID_APEXD_APEX_FILE_H_
 #define ANDROID_APEXD_APEX_FILE_H_
 
+#include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include <android-base/result.h>
@@ -37,10 +40,34 @@ struct ApexVerityData {
   std::string root_digest;
 };
 
+// Controls how ApexFile::Decompress() writes the original APEX.
+struct DecompressOptions {
+  // Called after every chunk with the number of bytes of the original APEX
+  // written so far and its size. Returning false stops decompression, keeping
+  // what was written for a later call with |resume| to continue from.
+  std::function<bool(uint64_t written, uint64_t total)> on_progress;
+  // Called once before decompression starts with the offset it resumes from,
+  // which is 0 if there is nothing to resume. Bytes up to it are inflated
+  // again but not written, and |written| reported to |on_progress| counts
+  // them.
+  std::function<void(uint64_t offset)> on_resume;
+  // Continue from the checkpoint a previous call left at the output path, if
+  // any, rather than starting over.
+  bool resume = false;
+};
+
+// Where Decompress() records how much of |output_path| is known to be on disk.
+// It only exists while a resumable decompression is incomplete.
+std::string GetDecompressionCheckpointPath(const std::string& output_path);
+
 // Manages the content of an APEX package and provides utilities to navigate
 // the content.
 class ApexFile {
  public:
+  // Strings that ApexFiles share storage for, keyed by their contents.
+  using StringPool =
+      std::unordered_map<std::string_view, std::shared_ptr<const std::string>>;
+
   static android::base::Result<ApexFile> Open(const std::string& path);
 
   ApexFile() = delete;
@@ -53,34 +80,54 @@ class ApexFile {
   }
   const std::optional<size_t>& GetImageSize() const { return image_size_; }
   const ::apex::proto::ApexManifest& GetManifest() const { return manifest_; }
-  const std::string& GetBundledPublicKey() const { return apex_pubkey_; }
+  const std::string& GetBundledPublicKey() const { return *apex_pubkey_; }
   const std::optional<std::string>& GetFsType() const { return fs_type_; }
   android::base::Result<ApexVerityData> VerifyApexVerity(
       const std::string& public_key) const;
   bool IsCompressed() const { return is_compressed_; }
+  // Whether this is a CAPEX whose payload is an erofs image with compressed
+  // files. Unlike other CAPEXes it is mounted as is, without decompression.
+  bool IsNativelyCompressed() const { return is_natively_compressed_; }
+  // Size of the APEX inside a compressed APEX, once decompressed.
+  const std::optional<size_t>& GetDecompressedSize() const {
+    return decompressed_size_;
+  }
   android::base::Result<void> Decompress(const std::string& output_path) const;
+  android::base::Result<void> Decompress(
+      const std::string& output_path, const DecompressOptions& options) const;
+
+  // Makes this ApexFile share |pool|'s copy of strings that many ApexFiles
+  // hold identical copies of, such as the bundled public key, adding them to
+  // |pool| if they aren't there yet. Returns the number of bytes freed.
+  size_t InternStrings(StringPool* pool);
 
  private:
   ApexFile(const std::string& apex_path,
            const std::optional<uint32_t>& image_offset,
            const std::optional<size_t>& image_size,
            ::apex::proto::ApexManifest manifest, const std::string& apex_pubkey,
-           const std::optional<std::string>& fs_type, bool is_compressed)
+           const std::optional<std::string>& fs_type, bool is_compressed,
+           bool is_natively_compressed,
+           const std::optional<size_t>& decompressed_size)
       : apex_path_(apex_path),
         image_offset_(image_offset),
         image_size_(image_size),
         manifest_(std::move(manifest)),
-        apex_pubkey_(apex_pubkey),
+        apex_pubkey_(std::make_shared<const std::string>(apex_pubkey)),
         fs_type_(fs_type),
-        is_compressed_(is_compressed) {}
+        is_compressed_(is_compressed),
+        is_natively_compressed_(is_natively_compressed),
+        decompressed_size_(decompressed_size) {}
 
   std::string apex_path_;
   std::optional<uint32_t> image_offset_;
   std::optional<size_t> image_size_;
   ::apex::proto::ApexManifest manifest_;
-  std::string apex_pubkey_;
+  std::shared_ptr<const std::string> apex_pubkey_;
   std::optional<std::string> fs_type_;
   bool is_compressed_;
+  bool is_natively_compressed_;
+  std::optional<size_t> decompressed_size_;
 };
 
 }  // namespace apex
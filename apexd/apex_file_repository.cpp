@@ -76,6 +76,7 @@ Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
     if (!apex_file.ok()) {
       return Error() << "Failed to open " << file << " : " << apex_file.error();
     }
+    interned_bytes_ += apex_file->InternStrings(&string_pool_);
 
     const std::string& name = apex_file->GetManifest().name();
 
@@ -155,7 +156,9 @@ Result<void> ApexFileRepository::ScanBuiltInDir(const std::string& dir) {
                  << " (" << name << ") has unexpectedly changed";
     }
   }
-  multi_install_public_keys_.clear();
+  // Only needed while scanning; release the buckets too, not just the keys.
+  std::unordered_map<std::string, std::unordered_set<std::string>>().swap(
+      multi_install_public_keys_);
   return {};
 }
 
@@ -248,6 +251,7 @@ Result<int> ApexFileRepository::AddBlockApex(
       return Error() << "Failed to open " << apex_path << " : "
                      << apex_file.error();
     }
+    interned_bytes_ += apex_file->InternStrings(&string_pool_);
 
     // When metadata specifies the public key of the apex, it should match the
     // bundled key. Otherwise we accept it.
@@ -318,6 +322,7 @@ Result<void> ApexFileRepository::AddDataApex(const std::string& data_dir) {
       LOG(ERROR) << "Failed to open " << file << " : " << apex_file.error();
       continue;
     }
+    interned_bytes_ += apex_file->InternStrings(&string_pool_);
 
     const std::string& name = apex_file->GetManifest().name();
     if (!HasPreInstalledVersion(name)) {
@@ -368,6 +373,23 @@ Result<void> ApexFileRepository::AddDataApex(const std::string& data_dir) {
   return {};
 }
 
+Result<void> ApexFileRepository::AddStagedApex(const std::string& staged_dir) {
+  Result<std::vector<std::string>> staged_apex =
+      FindFilesBySuffix(staged_dir, {kApexPackageSuffix});
+  if (!staged_apex.ok()) {
+    return staged_apex.error();
+  }
+  for (const auto& file : *staged_apex) {
+    Result<ApexFile> apex_file = ApexFile::Open(file);
+    if (!apex_file.ok()) {
+      return Error() << "Failed to open " << file << " : "
+                     << apex_file.error();
+    }
+    data_store_.erase(apex_file->GetManifest().name());
+  }
+  return AddDataApex(staged_dir);
+}
+
 // TODO(b/179497746): remove this method when we add api for fetching ApexFile
 //  by name
 Result<const std::string> ApexFileRepository::GetPublicKey(
@@ -92,6 +92,12 @@ class ApexFileRepository final {
   // finished, all queries to the instance are thread safe.
   android::base::Result<void> AddDataApex(const std::string& data_dir);
 
+  // Like AddDataApex, but APEXes in |staged_dir| replace data APEXes of the
+  // same name even if they have a lower version, the way staging a session
+  // replaces active APEXes on the next boot. Invalidates references to the
+  // replaced ApexFiles, so it's only meant for a repository of one's own.
+  android::base::Result<void> AddStagedApex(const std::string& staged_dir);
+
   // Returns trusted public key for an apex with the given |name|.
   android::base::Result<const std::string> GetPublicKey(
       const std::string& name) const;
@@ -147,6 +153,10 @@ class ApexFileRepository final {
   // using |HasDataVersion| function.
   ApexFileRef GetDataApex(const std::string& name) const;
 
+  // Returns the number of bytes saved by sharing strings, such as public keys,
+  // that many ApexFiles hold identical copies of.
+  size_t GetInternedBytes() const { return interned_bytes_; }
+
   // Clears ApexFileRepostiry.
   // Only use in tests.
   void Reset(const std::string& decompression_dir = kApexDecompressedDir) {
@@ -155,6 +165,8 @@ class ApexFileRepository final {
     block_apex_overrides_.clear();
     decompression_dir_ = decompression_dir;
     block_disk_path_.reset();
+    string_pool_.clear();
+    interned_bytes_ = 0;
   }
 
  private:
@@ -206,6 +218,11 @@ class ApexFileRepository final {
   // Use "path" as key instead of APEX name because there can be multiple
   // versions of sharedlibs APEXes.
   std::unordered_map<std::string, BlockApexOverride> block_apex_overrides_;
+
+  // ApexFiles are interned into this as they are opened, before other threads
+  // can see them, since the stores are read without a lock.
+  ApexFile::StringPool string_pool_;
+  size_t interned_bytes_ = 0;
 };
 
 }  // namespace apex
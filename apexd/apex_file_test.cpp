@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <sys/stat.h>
+
 #include <limits>
 #include <string>
 
@@ -194,6 +196,13 @@ TEST(ApexFileTest, OpenCompressedApexFile) {
   ASSERT_FALSE(apex_file->GetImageOffset().has_value());
   ASSERT_FALSE(apex_file->GetImageSize().has_value());
   ASSERT_FALSE(apex_file->GetFsType().has_value());
+
+  const std::string original_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  struct stat original;
+  ASSERT_EQ(0, stat(original_path.c_str(), &original));
+  ASSERT_EQ(static_cast<size_t>(original.st_size),
+            apex_file->GetDecompressedSize().value_or(0));
 }
 
 TEST(ApexFileTest, OpenFailureForCompressedApexWithoutApex) {
@@ -205,6 +214,27 @@ TEST(ApexFileTest, OpenFailureForCompressedApexWithoutApex) {
               ::testing::HasSubstr("Could not find entry"));
 }
 
+TEST(ApexFileTest, OpenNativelyCompressedApex) {
+  const std::string file_path =
+      kTestDataDir + "apex.apexd_test_erofs_native.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+
+  ASSERT_FALSE(apex_file->IsCompressed());
+  ASSERT_TRUE(apex_file->IsNativelyCompressed());
+  ASSERT_EQ("erofs", apex_file->GetFsType().value_or(""));
+  ASSERT_TRUE(apex_file->GetImageOffset().has_value());
+  ASSERT_EQ(0u, apex_file->GetDecompressedSize().value_or(1));
+  ASSERT_RESULT_OK(
+      apex_file->VerifyApexVerity(apex_file->GetBundledPublicKey()));
+
+  // The same APEX isn't a compressed one unless it's packaged as such.
+  Result<ApexFile> apex =
+      ApexFile::Open(kTestDataDir + "apex.apexd_test_erofs.apex");
+  ASSERT_RESULT_OK(apex);
+  ASSERT_FALSE(apex->IsNativelyCompressed());
+}
+
 TEST(ApexFileTest, GetCompressedApexManifest) {
   const std::string file_path =
       kTestDataDir + "com.android.apex.compressed.v1.capex";
@@ -229,6 +259,23 @@ TEST(ApexFileTest, GetBundledPublicKeyOfCompressedApex) {
   EXPECT_EQ(key_content, apex_file->GetBundledPublicKey());
 }
 
+TEST(ApexFileTest, InternStringsSharesPublicKey) {
+  const std::string file_path = kTestDataDir + "apex.apexd_test.apex";
+  Result<ApexFile> first = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(first);
+  Result<ApexFile> second = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(second);
+  const std::string key = first->GetBundledPublicKey();
+
+  ApexFile::StringPool pool;
+  ASSERT_EQ(0u, first->InternStrings(&pool));
+  ASSERT_GE(second->InternStrings(&pool), key.size());
+  ASSERT_EQ(&first->GetBundledPublicKey(), &second->GetBundledPublicKey());
+  ASSERT_EQ(key, second->GetBundledPublicKey());
+  // Interning again is a no-op.
+  ASSERT_EQ(0u, second->InternStrings(&pool));
+}
+
 TEST(ApexFileTest, CannotVerifyApexVerityForCompressedApex) {
   const std::string file_path =
       kTestDataDir + "com.android.apex.compressed.v1.capex";
@@ -271,6 +318,90 @@ TEST(ApexFileTest, DISABLED_DecompressCompressedApex) {
   ASSERT_TRUE(*comparison_result);
 }
 
+TEST(ApexFileTest, DISABLED_DecompressStopsAndResumesFromCheckpoint) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/decompressed.apex";
+  const std::string checkpoint_path =
+      GetDecompressionCheckpointPath(decompression_file_path);
+
+  DecompressOptions stop_early{
+      .on_progress = [](uint64_t, uint64_t) { return false; },
+      .resume = true,
+  };
+  auto result = apex_file->Decompress(decompression_file_path, stop_early);
+  ASSERT_FALSE(result.ok());
+  ASSERT_THAT(result.error().message(), ::testing::HasSubstr("stopped at"));
+  ASSERT_EQ(0, access(decompression_file_path.c_str(), F_OK));
+  ASSERT_EQ(0, access(checkpoint_path.c_str(), F_OK));
+
+  uint64_t last_written = 0;
+  uint64_t last_total = 0;
+  DecompressOptions resume{
+      .on_progress =
+          [&](uint64_t written, uint64_t total) {
+            last_written = written;
+            last_total = total;
+            return true;
+          },
+      .resume = true,
+  };
+  ASSERT_RESULT_OK(apex_file->Decompress(decompression_file_path, resume));
+  ASSERT_EQ(last_total, last_written);
+  ASSERT_NE(0, access(checkpoint_path.c_str(), F_OK));
+
+  const std::string original_apex_file_path =
+      kTestDataDir + "com.android.apex.compressed.v1_original.apex";
+  auto comparison_result =
+      CompareFiles(original_apex_file_path, decompression_file_path);
+  ASSERT_RESULT_OK(comparison_result);
+  ASSERT_TRUE(*comparison_result);
+}
+
+TEST(ApexFileTest, DISABLED_DecompressStopDoesNotMoveCheckpointBack) {
+  const std::string file_path =
+      kTestDataDir + "com.android.apex.compressed.v1.capex";
+  Result<ApexFile> apex_file = ApexFile::Open(file_path);
+  ASSERT_RESULT_OK(apex_file);
+
+  TemporaryDir tmp_dir;
+  const std::string decompression_file_path =
+      std::string(tmp_dir.path) + "/decompressed.apex";
+
+  uint64_t stopped_at = 0;
+  int chunks = 0;
+  DecompressOptions stop_after_chunks{
+      .on_progress =
+          [&](uint64_t written, uint64_t) {
+            stopped_at = written;
+            return ++chunks < 3;
+          },
+      .resume = true,
+  };
+  ASSERT_FALSE(
+      apex_file->Decompress(decompression_file_path, stop_after_chunks).ok());
+
+  // Stop again while the part that is already on disk is inflated again.
+  uint64_t resumed_at = 0;
+  DecompressOptions stop_at_once{
+      .on_progress = [](uint64_t, uint64_t) { return false; },
+      .on_resume = [&](uint64_t offset) { resumed_at = offset; },
+      .resume = true,
+  };
+  ASSERT_FALSE(
+      apex_file->Decompress(decompression_file_path, stop_at_once).ok());
+  ASSERT_EQ(stopped_at, resumed_at);
+
+  ASSERT_FALSE(
+      apex_file->Decompress(decompression_file_path, stop_at_once).ok());
+  ASSERT_EQ(stopped_at, resumed_at);
+}
+
 TEST(ApexFileTest, DecompressFailForNormalApex) {
   const std::string file_path =
       kTestDataDir + "com.android.apex.compressed.v1_original.apex";
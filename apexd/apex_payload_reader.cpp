@@ -0,0 +1,797 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_payload_reader.h"
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+using android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+using Consumer = ApexPayloadReader::Consumer;
+
+uint16_t Le16(std::span<const uint8_t> b, size_t off) {
+  return b[off] | (b[off + 1] << 8);
+}
+
+uint32_t Le32(std::span<const uint8_t> b, size_t off) {
+  return Le16(b, off) | (static_cast<uint32_t>(Le16(b, off + 2)) << 16);
+}
+
+uint64_t Le64(std::span<const uint8_t> b, size_t off) {
+  return Le32(b, off) | (static_cast<uint64_t>(Le32(b, off + 4)) << 32);
+}
+
+// A read-only mapping of an APEX, or of a bare image.
+class Mapping {
+ public:
+  static Result<std::unique_ptr<Mapping>> Create(const std::string& path,
+                                                 uint64_t offset,
+                                                 uint64_t size) {
+    unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd.get() == -1) {
+      return ErrnoError() << "Failed to open " << path;
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << path;
+    }
+    if (size == 0 || offset + size < offset ||
+        offset + size > static_cast<uint64_t>(st.st_size)) {
+      return Error() << "Image at " << offset << " of size " << size
+                     << " is out of bounds of " << path;
+    }
+    // Offsets of mappings must be page aligned, so the mapping starts at the
+    // beginning of the file.
+    void* addr =
+        mmap(nullptr, offset + size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (addr == MAP_FAILED) {
+      return ErrnoError() << "Failed to map " << path;
+    }
+    return std::unique_ptr<Mapping>(new Mapping(addr, offset, size));
+  }
+
+  ~Mapping() { munmap(addr_, offset_ + size_); }
+
+  uint64_t size() const { return size_; }
+
+  Result<std::span<const uint8_t>> Get(uint64_t offset, uint64_t len) const {
+    if (offset > size_ || len > size_ - offset) {
+      return Error() << "Read of " << len << " bytes at " << offset
+                     << " is out of bounds of the image";
+    }
+    return std::span<const uint8_t>(
+        static_cast<const uint8_t*>(addr_) + offset_ + offset, len);
+  }
+
+ private:
+  Mapping(void* addr, uint64_t offset, uint64_t size)
+      : addr_(addr), offset_(offset), size_(size) {}
+
+  void* addr_;
+  uint64_t offset_;
+  uint64_t size_;
+};
+
+// Where a run of a file is stored. A |physical| of 0 is a hole.
+struct Extent {
+  uint64_t logical;
+  uint64_t physical;
+  uint64_t len;
+};
+
+struct DirEntry {
+  std::string name;
+  uint64_t ino;
+};
+
+// Emits |extents| of a file of |size| bytes, sorted by logical offset, to
+// |consumer|, filling holes with zeros.
+Result<void> EmitExtents(const Mapping& image, std::vector<Extent> extents,
+                         uint64_t size,
+                         const Consumer& consumer) {
+  static const uint8_t kZeros[64 * 1024] = {};
+  auto emit_zeros = [&](uint64_t len) {
+    while (len > 0) {
+      uint64_t chunk = std::min<uint64_t>(len, sizeof(kZeros));
+      if (!consumer(std::span<const uint8_t>(kZeros, chunk))) {
+        return false;
+      }
+      len -= chunk;
+    }
+    return true;
+  };
+
+  std::sort(extents.begin(), extents.end(),
+            [](const auto& a, const auto& b) { return a.logical < b.logical; });
+  uint64_t pos = 0;
+  for (const auto& extent : extents) {
+    if (extent.logical >= size) {
+      break;
+    }
+    if (extent.logical < pos) {
+      return Error() << "Overlapping extents at " << extent.logical;
+    }
+    if (!emit_zeros(extent.logical - pos)) {
+      return {};
+    }
+    const uint64_t len = std::min(extent.len, size - extent.logical);
+    if (extent.physical == 0) {
+      if (!emit_zeros(len)) {
+        return {};
+      }
+    } else {
+      auto data = image.Get(extent.physical, len);
+      if (!data.ok()) {
+        return data.error();
+      }
+      if (!consumer(*data)) {
+        return {};
+      }
+    }
+    pos = extent.logical + len;
+  }
+  emit_zeros(size - pos);
+  return {};
+}
+
+}  // namespace
+
+class ApexPayloadReader::Filesystem {
+ public:
+  explicit Filesystem(std::unique_ptr<Mapping> image)
+      : image_(std::move(image)) {}
+  virtual ~Filesystem() = default;
+
+  virtual const std::string& GetType() const = 0;
+  virtual uint64_t GetRootIno() const = 0;
+  // Returns the entry of |ino|, without a name.
+  virtual Result<PayloadEntry> GetInode(uint64_t ino) const = 0;
+  // Returns all entries of the directory |ino|, including "." and "..".
+  virtual Result<std::vector<DirEntry>> ReadDir(uint64_t ino) const = 0;
+  virtual Result<void> ReadData(uint64_t ino,
+                                const Consumer& consumer) const = 0;
+
+  Result<std::string> ReadDataToString(uint64_t ino) const {
+    std::string data;
+    auto st = ReadData(ino, [&](std::span<const uint8_t> chunk) {
+      data.append(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+      return true;
+    });
+    if (!st.ok()) {
+      return st.error();
+    }
+    return data;
+  }
+
+ protected:
+  std::unique_ptr<Mapping> image_;
+};
+
+namespace {
+
+// ext4, as documented in
+// https://www.kernel.org/doc/html/latest/filesystems/ext4/
+class Ext4 : public ApexPayloadReader::Filesystem {
+ public:
+  static constexpr uint64_t kSuperblockOffset = 1024;
+  static constexpr uint16_t kMagic = 0xEF53;
+
+  static Result<std::unique_ptr<Filesystem>> Create(
+      std::unique_ptr<Mapping> image) {
+    auto sb = image->Get(kSuperblockOffset, 1024);
+    if (!sb.ok()) {
+      return sb.error();
+    }
+    if (Le16(*sb, 56) != kMagic) {
+      return Error() << "Not an ext4 image";
+    }
+    std::unique_ptr<Ext4> fs(new Ext4(std::move(image)));
+    const uint32_t log_block_size = Le32(*sb, 24);
+    if (log_block_size > 6) {
+      return Error() << "Invalid block size";
+    }
+    fs->block_size_ = 1024u << log_block_size;
+    fs->inodes_count_ = Le32(*sb, 0);
+    fs->first_data_block_ = Le32(*sb, 20);
+    fs->inodes_per_group_ = Le32(*sb, 40);
+    fs->incompat_ = Le32(*sb, 96);
+    fs->inode_size_ = Le32(*sb, 76) == 0 ? 128 : Le16(*sb, 88);
+    fs->desc_size_ = (fs->incompat_ & kIncompat64Bit) ? Le16(*sb, 254) : 32;
+    if (fs->inodes_per_group_ == 0 || fs->inode_size_ < 128 ||
+        fs->desc_size_ < 32) {
+      return Error() << "Invalid ext4 superblock";
+    }
+    return fs;
+  }
+
+  const std::string& GetType() const override {
+    static const std::string kType = "ext4";
+    return kType;
+  }
+
+  uint64_t GetRootIno() const override { return 2; }
+
+  Result<PayloadEntry> GetInode(uint64_t ino) const override {
+    auto inode = GetInodeBytes(ino);
+    if (!inode.ok()) {
+      return inode.error();
+    }
+    const auto& b = *inode;
+    return PayloadEntry{
+        .name = {},
+        .ino = ino,
+        .mode = Le16(b, 0),
+        .uid = static_cast<uid_t>(Le16(b, 2) | (Le16(b, 120) << 16)),
+        .gid = static_cast<gid_t>(Le16(b, 24) | (Le16(b, 122) << 16)),
+        .size = Le32(b, 4) | (static_cast<uint64_t>(Le32(b, 108)) << 32),
+    };
+  }
+
+  Result<std::vector<DirEntry>> ReadDir(uint64_t ino) const override {
+    auto data = ReadDataToString(ino);
+    if (!data.ok()) {
+      return data.error();
+    }
+    std::span<const uint8_t> b(reinterpret_cast<const uint8_t*>(data->data()),
+                               data->size());
+    std::vector<DirEntry> entries;
+    // Hashed directories are also readable this way: their index blocks look
+    // like blocks of deleted entries.
+    for (size_t off = 0; off + 8 <= b.size();) {
+      const uint32_t entry_ino = Le32(b, off);
+      const uint16_t rec_len = Le16(b, off + 4);
+      const uint16_t name_len =
+          (incompat_ & kIncompatFiletype) ? b[off + 6] : Le16(b, off + 6);
+      if (rec_len < 8 || rec_len > b.size() - off || 8u + name_len > rec_len) {
+        return Error() << "Corrupted directory entry in inode " << ino;
+      }
+      if (entry_ino != 0) {
+        entries.push_back(
+            {std::string(reinterpret_cast<const char*>(&b[off + 8]), name_len),
+             entry_ino});
+      }
+      off += rec_len;
+    }
+    return entries;
+  }
+
+  Result<void> ReadData(uint64_t ino, const Consumer& consumer) const override {
+    auto inode = GetInodeBytes(ino);
+    if (!inode.ok()) {
+      return inode.error();
+    }
+    const auto& b = *inode;
+    const uint16_t mode = Le16(b, 0);
+    const uint32_t flags = Le32(b, 32);
+    const uint64_t size =
+        Le32(b, 4) | (static_cast<uint64_t>(Le32(b, 108)) << 32);
+    const auto i_block = b.subspan(40, 60);
+    if (flags & kInlineDataFl) {
+      return Error() << "Inode " << ino << " has inline data, unsupported";
+    }
+    if (S_ISLNK(mode) && !(flags & kExtentsFl) && size < i_block.size()) {
+      // Fast symlink: the target is stored in place of the block map.
+      consumer(i_block.subspan(0, size));
+      return {};
+    }
+    std::vector<Extent> extents;
+    auto st = (flags & kExtentsFl) ? CollectExtents(i_block, 0, &extents)
+                                   : CollectBlockMap(i_block, size, &extents);
+    if (!st.ok()) {
+      return Error() << "Inode " << ino << ": " << st.error();
+    }
+    return EmitExtents(*image_, std::move(extents), size, consumer);
+  }
+
+ private:
+  static constexpr uint32_t kIncompatFiletype = 0x2;
+  static constexpr uint32_t kIncompat64Bit = 0x80;
+  static constexpr uint32_t kExtentsFl = 0x80000;
+  static constexpr uint32_t kInlineDataFl = 0x10000000;
+  static constexpr uint16_t kExtentMagic = 0xF30A;
+  static constexpr uint16_t kMaxExtentDepth = 5;
+
+  explicit Ext4(std::unique_ptr<Mapping> image)
+      : Filesystem(std::move(image)) {}
+
+  Result<std::span<const uint8_t>> GetInodeBytes(uint64_t ino) const {
+    if (ino == 0 || ino > inodes_count_) {
+      return Error() << "Invalid inode " << ino;
+    }
+    const uint64_t group = (ino - 1) / inodes_per_group_;
+    const uint64_t index = (ino - 1) % inodes_per_group_;
+    auto desc = image_->Get(
+        (first_data_block_ + 1) * block_size_ + group * desc_size_, desc_size_);
+    if (!desc.ok()) {
+      return desc.error();
+    }
+    uint64_t inode_table = Le32(*desc, 8);
+    if (desc_size_ >= 64) {
+      inode_table |= static_cast<uint64_t>(Le32(*desc, 40)) << 32;
+    }
+    return image_->Get(inode_table * block_size_ + index * inode_size_,
+                       inode_size_);
+  }
+
+  // Walks an extent tree node, which is either the i_block of an inode or a
+  // block of the tree.
+  Result<void> CollectExtents(std::span<const uint8_t> node, uint16_t level,
+                              std::vector<Extent>* extents) const {
+    if (node.size() < 12 || Le16(node, 0) != kExtentMagic) {
+      return Error() << "Bad extent header";
+    }
+    const uint16_t entries = Le16(node, 2);
+    const uint16_t depth = Le16(node, 6);
+    if (level > kMaxExtentDepth || 12u + entries * 12u > node.size()) {
+      return Error() << "Corrupted extent tree";
+    }
+    for (uint16_t i = 0; i < entries; i++) {
+      const auto e = node.subspan(12 + i * 12, 12);
+      if (depth == 0) {
+        uint16_t len = Le16(e, 4);
+        // Uninitialized extents read as zeros.
+        const bool uninitialized = len > 32768;
+        if (uninitialized) {
+          len -= 32768;
+        }
+        const uint64_t start =
+            (static_cast<uint64_t>(Le16(e, 6)) << 32) | Le32(e, 8);
+        extents->push_back({
+            .logical = static_cast<uint64_t>(Le32(e, 0)) * block_size_,
+            .physical = uninitialized ? 0 : start * block_size_,
+            .len = static_cast<uint64_t>(len) * block_size_,
+        });
+      } else {
+        const uint64_t leaf =
+            Le32(e, 4) | (static_cast<uint64_t>(Le16(e, 8)) << 32);
+        auto child = image_->Get(leaf * block_size_, block_size_);
+        if (!child.ok()) {
+          return child.error();
+        }
+        if (auto st = CollectExtents(*child, level + 1, extents); !st.ok()) {
+          return st;
+        }
+      }
+    }
+    return {};
+  }
+
+  // Walks the direct and indirect block map of an inode without extents.
+  Result<void> CollectBlockMap(std::span<const uint8_t> i_block, uint64_t size,
+                               std::vector<Extent>* extents) const {
+    const uint64_t blocks = (size + block_size_ - 1) / block_size_;
+    const uint64_t per_block = block_size_ / 4;
+    uint64_t logical = 0;
+    std::function<Result<void>(uint32_t, int)> walk =
+        [&](uint32_t block, int indirection) -> Result<void> {
+      if (logical >= blocks) {
+        return {};
+      }
+      if (indirection == 0) {
+        AddBlock(logical++, block, extents);
+        return {};
+      }
+      uint64_t span = 1;
+      for (int i = 1; i < indirection; i++) {
+        span *= per_block;
+      }
+      if (block == 0) {
+        logical += span * per_block;
+        return {};
+      }
+      auto table = image_->Get(static_cast<uint64_t>(block) * block_size_,
+                               block_size_);
+      if (!table.ok()) {
+        return table.error();
+      }
+      for (uint64_t i = 0; i < per_block && logical < blocks; i++) {
+        if (auto st = walk(Le32(*table, i * 4), indirection - 1); !st.ok()) {
+          return st;
+        }
+      }
+      return {};
+    };
+    for (int i = 0; i < 15; i++) {
+      if (auto st = walk(Le32(i_block, i * 4), i < 12 ? 0 : i - 11); !st.ok()) {
+        return st;
+      }
+    }
+    return {};
+  }
+
+  // Adds a block to |extents|, merging it with the last one if contiguous.
+  void AddBlock(uint64_t logical, uint32_t block,
+                std::vector<Extent>* extents) const {
+    const uint64_t physical = static_cast<uint64_t>(block) * block_size_;
+    if (!extents->empty()) {
+      auto& last = extents->back();
+      if (last.logical + last.len == logical * block_size_ &&
+          ((last.physical == 0 && physical == 0) ||
+           (last.physical != 0 && last.physical + last.len == physical))) {
+        last.len += block_size_;
+        return;
+      }
+    }
+    extents->push_back({logical * block_size_, physical, block_size_});
+  }
+
+  uint64_t block_size_ = 0;
+  uint32_t inodes_count_ = 0;
+  uint32_t first_data_block_ = 0;
+  uint32_t inodes_per_group_ = 0;
+  uint32_t incompat_ = 0;
+  uint16_t inode_size_ = 0;
+  uint16_t desc_size_ = 0;
+};
+
+// erofs, as laid out in fs/erofs/erofs_fs.h of the kernel. Inodes are
+// identified by their nid.
+class Erofs : public ApexPayloadReader::Filesystem {
+ public:
+  static constexpr uint64_t kSuperblockOffset = 1024;
+  static constexpr uint32_t kMagic = 0xE0F5E1E2;
+
+  static Result<std::unique_ptr<Filesystem>> Create(
+      std::unique_ptr<Mapping> image) {
+    auto sb = image->Get(kSuperblockOffset, 128);
+    if (!sb.ok()) {
+      return sb.error();
+    }
+    if (Le32(*sb, 0) != kMagic) {
+      return Error() << "Not an erofs image";
+    }
+    std::unique_ptr<Erofs> fs(new Erofs(std::move(image)));
+    fs->blkszbits_ = (*sb)[12];
+    if (fs->blkszbits_ < 9 || fs->blkszbits_ > 16) {
+      return Error() << "Invalid block size";
+    }
+    fs->root_nid_ = Le16(*sb, 14);
+    fs->meta_blkaddr_ = Le32(*sb, 40);
+    return fs;
+  }
+
+  const std::string& GetType() const override {
+    static const std::string kType = "erofs";
+    return kType;
+  }
+
+  uint64_t GetRootIno() const override { return root_nid_; }
+
+  Result<PayloadEntry> GetInode(uint64_t nid) const override {
+    auto inode = ParseInode(nid);
+    if (!inode.ok()) {
+      return inode.error();
+    }
+    return inode->entry;
+  }
+
+  Result<std::vector<DirEntry>> ReadDir(uint64_t nid) const override {
+    auto data = ReadDataToString(nid);
+    if (!data.ok()) {
+      return data.error();
+    }
+    std::span<const uint8_t> all(
+        reinterpret_cast<const uint8_t*>(data->data()), data->size());
+    std::vector<DirEntry> entries;
+    const size_t block_size = size_t{1} << blkszbits_;
+    // Each block starts with an array of dirents, followed by their names.
+    for (size_t block_off = 0; block_off < all.size();
+         block_off += block_size) {
+      const auto b =
+          all.subspan(block_off, std::min(block_size, all.size() - block_off));
+      if (b.size() < kDirentSize) {
+        return Error() << "Corrupted directory " << nid;
+      }
+      const size_t count = Le16(b, 8) / kDirentSize;
+      if (count == 0 || count * kDirentSize > b.size()) {
+        return Error() << "Corrupted directory " << nid;
+      }
+      for (size_t i = 0; i < count; i++) {
+        const size_t name_off = Le16(b, i * kDirentSize + 8);
+        const size_t name_end =
+            i + 1 < count ? Le16(b, (i + 1) * kDirentSize + 8) : b.size();
+        if (name_off > name_end || name_end > b.size()) {
+          return Error() << "Corrupted directory " << nid;
+        }
+        std::string name(reinterpret_cast<const char*>(&b[name_off]),
+                         name_end - name_off);
+        // The last name of a block may be padded with zeros.
+        name.resize(strnlen(name.c_str(), name.size()));
+        entries.push_back({std::move(name), Le64(b, i * kDirentSize)});
+      }
+    }
+    return entries;
+  }
+
+  Result<void> ReadData(uint64_t nid, const Consumer& consumer) const override {
+    auto inode = ParseInode(nid);
+    if (!inode.ok()) {
+      return inode.error();
+    }
+    const uint64_t size = inode->entry.size;
+    const uint64_t block_size = uint64_t{1} << blkszbits_;
+    std::vector<Extent> extents;
+    switch (inode->layout) {
+      case kLayoutFlatPlain:
+        extents.push_back({0, inode->raw_blkaddr << blkszbits_, size});
+        break;
+      case kLayoutFlatInline: {
+        // Whole blocks are stored out of line, the tail right after the inode.
+        const uint64_t tail = size % block_size;
+        const uint64_t head = size - tail;
+        if (head > 0) {
+          extents.push_back({0, inode->raw_blkaddr << blkszbits_, head});
+        }
+        if (tail > 0) {
+          extents.push_back({head, inode->inline_offset, tail});
+        }
+        break;
+      }
+      case kLayoutChunkBased: {
+        auto st = CollectChunks(*inode, &extents);
+        if (!st.ok()) {
+          return st;
+        }
+        break;
+      }
+      default:
+        return Error() << "Inode " << nid << " is compressed, unsupported";
+    }
+    return EmitExtents(*image_, std::move(extents), size, consumer);
+  }
+
+ private:
+  static constexpr size_t kDirentSize = 12;
+  static constexpr uint16_t kLayoutFlatPlain = 0;
+  static constexpr uint16_t kLayoutFlatInline = 2;
+  static constexpr uint16_t kLayoutChunkBased = 4;
+  static constexpr uint16_t kChunkFormatBlkbitsMask = 0x1f;
+  static constexpr uint16_t kChunkFormatIndexes = 0x20;
+  static constexpr uint32_t kNullAddr = 0xFFFFFFFF;
+
+  struct Inode {
+    PayloadEntry entry;
+    uint16_t layout;
+    // Also holds the chunk format of chunk based inodes.
+    uint64_t raw_blkaddr;
+    // Where inline data, or chunk indexes, start.
+    uint64_t inline_offset;
+  };
+
+  explicit Erofs(std::unique_ptr<Mapping> image)
+      : Filesystem(std::move(image)) {}
+
+  Result<Inode> ParseInode(uint64_t nid) const {
+    const uint64_t offset =
+        (static_cast<uint64_t>(meta_blkaddr_) << blkszbits_) + nid * 32;
+    auto compact = image_->Get(offset, 32);
+    if (!compact.ok()) {
+      return compact.error();
+    }
+    const uint16_t format = Le16(*compact, 0);
+    const bool extended = format & 1;
+    auto b = extended ? image_->Get(offset, 64) : compact;
+    if (!b.ok()) {
+      return b.error();
+    }
+    const uint16_t xattr_icount = Le16(*b, 2);
+    const uint64_t xattr_size =
+        xattr_icount == 0 ? 0 : 12 + (xattr_icount - 1) * 4;
+    Inode inode{
+        .entry =
+            {
+                .name = {},
+                .ino = nid,
+                .mode = Le16(*b, 4),
+                .uid = extended ? Le32(*b, 24) : Le16(*b, 24),
+                .gid = extended ? Le32(*b, 28) : Le16(*b, 26),
+                .size = extended ? Le64(*b, 8) : Le32(*b, 8),
+            },
+        .layout = static_cast<uint16_t>((format >> 1) & 0x7),
+        .raw_blkaddr = Le32(*b, 16),
+        .inline_offset = offset + b->size() + xattr_size,
+    };
+    return inode;
+  }
+
+  Result<void> CollectChunks(const Inode& inode,
+                             std::vector<Extent>* extents) const {
+    const uint16_t format = inode.raw_blkaddr & 0xffff;
+    const unsigned chunkbits =
+        blkszbits_ + (format & kChunkFormatBlkbitsMask);
+    if (chunkbits >= 48) {
+      return Error() << "Invalid chunk size";
+    }
+    const uint64_t chunk_size = uint64_t{1} << chunkbits;
+    const uint64_t count = (inode.entry.size + chunk_size - 1) / chunk_size;
+    const bool indexes = format & kChunkFormatIndexes;
+    const uint64_t index_size = indexes ? 8 : 4;
+    // Full chunk indexes are aligned to their size.
+    const uint64_t start = indexes ? (inode.inline_offset + 7) / 8 * 8
+                                   : inode.inline_offset;
+    auto table = image_->Get(start, count * index_size);
+    if (!table.ok()) {
+      return table.error();
+    }
+    for (uint64_t i = 0; i < count; i++) {
+      const uint32_t blkaddr =
+          Le32(*table, i * index_size + (indexes ? 4 : 0));
+      extents->push_back({
+          .logical = i * chunk_size,
+          .physical = blkaddr == kNullAddr
+                          ? 0
+                          : static_cast<uint64_t>(blkaddr) << blkszbits_,
+          .len = chunk_size,
+      });
+    }
+    return {};
+  }
+
+  uint8_t blkszbits_ = 0;
+  uint16_t root_nid_ = 0;
+  uint32_t meta_blkaddr_ = 0;
+};
+
+}  // namespace
+
+ApexPayloadReader::ApexPayloadReader(std::unique_ptr<Filesystem> fs)
+    : fs_(std::move(fs)) {}
+ApexPayloadReader::ApexPayloadReader(ApexPayloadReader&&) noexcept = default;
+ApexPayloadReader& ApexPayloadReader::operator=(ApexPayloadReader&&) noexcept =
+    default;
+ApexPayloadReader::~ApexPayloadReader() = default;
+
+Result<ApexPayloadReader> ApexPayloadReader::Open(const ApexFile& apex) {
+  if (apex.IsCompressed() && !apex.IsNativelyCompressed()) {
+    return Error() << "Cannot read the payload of compressed APEX "
+                   << apex.GetPath();
+  }
+  if (!apex.GetImageOffset() || !apex.GetImageSize()) {
+    return Error() << "APEX " << apex.GetPath() << " has no payload image";
+  }
+  return OpenImage(apex.GetPath(), *apex.GetImageOffset(),
+                   *apex.GetImageSize());
+}
+
+Result<ApexPayloadReader> ApexPayloadReader::OpenImage(const std::string& path,
+                                                       uint64_t offset,
+                                                       uint64_t size) {
+  auto image = Mapping::Create(path, offset, size);
+  if (!image.ok()) {
+    return image.error();
+  }
+  auto magic = (*image)->Get(Ext4::kSuperblockOffset, 64);
+  if (!magic.ok()) {
+    return magic.error();
+  }
+  Result<std::unique_ptr<Filesystem>> fs =
+      Le32(*magic, 0) == Erofs::kMagic ? Erofs::Create(std::move(*image))
+                                        : Ext4::Create(std::move(*image));
+  if (!fs.ok()) {
+    return Error() << "Failed to read payload of " << path << ": "
+                   << fs.error();
+  }
+  return ApexPayloadReader(std::move(*fs));
+}
+
+const std::string& ApexPayloadReader::GetFsType() const {
+  return fs_->GetType();
+}
+
+Result<PayloadEntry> ApexPayloadReader::Stat(const std::string& path) const {
+  if (!android::base::StartsWith(path, "/")) {
+    return Error() << "Path " << path << " is not absolute";
+  }
+  uint64_t ino = fs_->GetRootIno();
+  std::string name = "/";
+  for (const auto& component : android::base::Split(path, "/")) {
+    if (component.empty() || component == ".") {
+      continue;
+    }
+    auto entries = fs_->ReadDir(ino);
+    if (!entries.ok()) {
+      return Error() << "Failed to look up " << path << ": "
+                     << entries.error();
+    }
+    auto it = std::find_if(entries->begin(), entries->end(),
+                           [&](const auto& e) { return e.name == component; });
+    if (it == entries->end()) {
+      return Error() << path << " not found";
+    }
+    ino = it->ino;
+    name = component;
+  }
+  auto entry = fs_->GetInode(ino);
+  if (!entry.ok()) {
+    return entry.error();
+  }
+  entry->name = std::move(name);
+  return entry;
+}
+
+Result<std::vector<PayloadEntry>> ApexPayloadReader::List(
+    const std::string& path) const {
+  auto dir = Stat(path);
+  if (!dir.ok()) {
+    return dir.error();
+  }
+  if (!S_ISDIR(dir->mode)) {
+    return Error() << path << " is not a directory";
+  }
+  auto entries = fs_->ReadDir(dir->ino);
+  if (!entries.ok()) {
+    return entries.error();
+  }
+  std::vector<PayloadEntry> result;
+  for (const auto& e : *entries) {
+    if (e.name == "." || e.name == "..") {
+      continue;
+    }
+    auto entry = fs_->GetInode(e.ino);
+    if (!entry.ok()) {
+      return entry.error();
+    }
+    entry->name = e.name;
+    result.push_back(std::move(*entry));
+  }
+  std::sort(result.begin(), result.end(),
+            [](const auto& a, const auto& b) { return a.name < b.name; });
+  return result;
+}
+
+Result<void> ApexPayloadReader::ReadFile(const std::string& path,
+                                         const Consumer& consumer) const {
+  auto entry = Stat(path);
+  if (!entry.ok()) {
+    return entry.error();
+  }
+  if (!S_ISREG(entry->mode) && !S_ISLNK(entry->mode)) {
+    return Error() << path << " is not a regular file";
+  }
+  return fs_->ReadData(entry->ino, consumer);
+}
+
+Result<std::string> ApexPayloadReader::ReadFileToString(
+    const std::string& path) const {
+  std::string content;
+  auto st = ReadFile(path, [&](std::span<const uint8_t> chunk) {
+    content.append(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    return true;
+  });
+  if (!st.ok()) {
+    return st.error();
+  }
+  return content;
+}
+
+}  // namespace apex
+}  // namespace android
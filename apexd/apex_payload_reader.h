@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEX_PAYLOAD_READER_H_
+#define ANDROID_APEXD_APEX_PAYLOAD_READER_H_
+
+#include <android-base/result.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "apex_file.h"
+
+namespace android {
+namespace apex {
+
+struct PayloadEntry {
+  std::string name;
+  uint64_t ino;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  uint64_t size;
+};
+
+// Reads files out of the ext4 or erofs payload of an APEX without mounting or
+// extracting it. The whole image is mapped read-only, and file contents are
+// handed out as spans of that mapping, so nothing is copied unless a caller
+// asks for it.
+//
+// Paths are absolute within the payload, e.g. "/etc/init.rc". Compressed erofs
+// files, and ext4 inline data, can be listed and stat'ed but not read.
+class ApexPayloadReader {
+ public:
+  // Called with consecutive pieces of a file. Returning false stops reading.
+  using Consumer = std::function<bool(std::span<const uint8_t>)>;
+
+  static android::base::Result<ApexPayloadReader> Open(const ApexFile& apex);
+  // Opens a filesystem image at |offset| of the file at |path|.
+  static android::base::Result<ApexPayloadReader> OpenImage(
+      const std::string& path, uint64_t offset, uint64_t size);
+
+  ApexPayloadReader(ApexPayloadReader&&) noexcept;
+  ApexPayloadReader& operator=(ApexPayloadReader&&) noexcept;
+  ~ApexPayloadReader();
+
+  const std::string& GetFsType() const;
+
+  android::base::Result<PayloadEntry> Stat(const std::string& path) const;
+
+  // Lists the entries of a directory, sorted by name, without "." and "..".
+  android::base::Result<std::vector<PayloadEntry>> List(
+      const std::string& path) const;
+
+  // Passes the content of a regular file, or the target of a symlink, to
+  // |consumer| straight from the mapping. Holes read as zeros.
+  android::base::Result<void> ReadFile(const std::string& path,
+                                       const Consumer& consumer) const;
+  android::base::Result<std::string> ReadFileToString(
+      const std::string& path) const;
+
+  class Filesystem;
+
+ private:
+  explicit ApexPayloadReader(std::unique_ptr<Filesystem> fs);
+
+  std::unique_ptr<Filesystem> fs_;
+};
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEX_PAYLOAD_READER_H_
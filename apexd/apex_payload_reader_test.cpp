@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_payload_reader.h"
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include <filesystem>
+#include <string>
+
+#include "apex_file.h"
+#include "apex_manifest.h"
+#include "apexd_test_utils.h"
+
+using android::base::Error;
+using android::base::GetExecutableDirectory;
+using android::base::Result;
+using android::base::StringPrintf;
+using ::testing::Contains;
+using ::testing::Field;
+using ::testing::HasSubstr;
+
+static const std::string kTestDataDir = GetExecutableDirectory() + "/";
+
+namespace android {
+namespace apex {
+namespace {
+
+struct ApexPayloadReaderTestParam {
+  const char* type;
+  const char* prefix;
+};
+
+constexpr const ApexPayloadReaderTestParam kParameters[] = {
+    {"ext4", "apex.apexd_test"}, {"erofs", "apex.apexd_test_erofs"}};
+
+class ApexPayloadReaderTest
+    : public ::testing::TestWithParam<ApexPayloadReaderTestParam> {
+ protected:
+  Result<ApexPayloadReader> OpenReader() {
+    auto apex = ApexFile::Open(kTestDataDir + GetParam().prefix + ".apex");
+    if (!apex.ok()) {
+      return apex.error();
+    }
+    return ApexPayloadReader::Open(*apex);
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(Apex, ApexPayloadReaderTest,
+                         ::testing::ValuesIn(kParameters));
+
+TEST_P(ApexPayloadReaderTest, ListRoot) {
+  auto reader = OpenReader();
+  ASSERT_RESULT_OK(reader);
+  ASSERT_EQ(GetParam().type, reader->GetFsType());
+
+  auto entries = reader->List("/");
+  ASSERT_RESULT_OK(entries);
+  ASSERT_THAT(*entries, Contains(Field(&PayloadEntry::name, "etc")));
+  ASSERT_THAT(*entries,
+              Contains(Field(&PayloadEntry::name, "apex_manifest.pb")));
+  ASSERT_TRUE(std::is_sorted(
+      entries->begin(), entries->end(),
+      [](const auto& a, const auto& b) { return a.name < b.name; }));
+}
+
+TEST_P(ApexPayloadReaderTest, StatFile) {
+  auto reader = OpenReader();
+  ASSERT_RESULT_OK(reader);
+
+  auto entry = reader->Stat("/etc/sample_prebuilt_file");
+  ASSERT_RESULT_OK(entry);
+  ASSERT_EQ("sample_prebuilt_file", entry->name);
+  ASSERT_TRUE(S_ISREG(entry->mode));
+  ASSERT_EQ(0u, entry->size);
+
+  auto dir = reader->Stat("/etc");
+  ASSERT_RESULT_OK(dir);
+  ASSERT_TRUE(S_ISDIR(dir->mode));
+
+  auto missing = reader->Stat("/etc/missing");
+  ASSERT_FALSE(missing.ok());
+  ASSERT_THAT(missing.error().message(), HasSubstr("not found"));
+}
+
+TEST_P(ApexPayloadReaderTest, ReadFileMatchesManifest) {
+  auto apex = ApexFile::Open(kTestDataDir + GetParam().prefix + ".apex");
+  ASSERT_RESULT_OK(apex);
+  auto reader = ApexPayloadReader::Open(*apex);
+  ASSERT_RESULT_OK(reader);
+
+  auto content = reader->ReadFileToString("/apex_manifest.pb");
+  ASSERT_RESULT_OK(content);
+  auto manifest = ParseManifest(*content);
+  ASSERT_RESULT_OK(manifest);
+  ASSERT_EQ(apex->GetManifest().name(), manifest->name());
+  ASSERT_EQ(apex->GetManifest().version(), manifest->version());
+
+  auto not_a_file = reader->ReadFileToString("/etc");
+  ASSERT_FALSE(not_a_file.ok());
+}
+
+// Raw images generated by apexd_testdata/gen_payload_images.sh, covering
+// layouts which the payloads of the test APEXes don't use.
+struct PayloadImageTestParam {
+  const char* type;
+  const char* image;
+};
+
+constexpr const PayloadImageTestParam kImages[] = {
+    // Extent tree of depth 1, multi-block linear directory.
+    {"ext4", "payload_ext4.img"},
+    // Hash-indexed directory.
+    {"ext4", "payload_ext4_htree.img"},
+    // 1K blocks, (double) indirect block maps.
+    {"ext4", "payload_ext4_1k_blockmap.img"},
+    // Chunk based files.
+    {"erofs", "payload_erofs_chunked.img"},
+};
+
+class PayloadImageTest
+    : public ::testing::TestWithParam<PayloadImageTestParam> {
+ protected:
+  Result<ApexPayloadReader> OpenReader() {
+    const std::string path = kTestDataDir + GetParam().image;
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    if (ec) {
+      return Error() << "Failed to get size of " << path << ": "
+                     << ec.message();
+    }
+    return ApexPayloadReader::OpenImage(path, 0, size);
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(Image, PayloadImageTest, ::testing::ValuesIn(kImages));
+
+TEST_P(PayloadImageTest, ReadSparseFile) {
+  auto reader = OpenReader();
+  ASSERT_RESULT_OK(reader);
+  ASSERT_EQ(GetParam().type, reader->GetFsType());
+
+  auto content = reader->ReadFileToString("/sparse");
+  ASSERT_RESULT_OK(content);
+  ASSERT_EQ(64u * 4096, content->size());
+  for (size_t i = 0; i < 64; i++) {
+    std::string expected(4096, '\0');
+    if (i % 2 == 0) {
+      const std::string data = "block " + std::to_string(i) + "\n";
+      expected.replace(0, data.size(), data);
+    }
+    ASSERT_EQ(expected, content->substr(i * 4096, 4096)) << "block " << i;
+  }
+}
+
+TEST_P(PayloadImageTest, ReadLargeFile) {
+  auto reader = OpenReader();
+  ASSERT_RESULT_OK(reader);
+
+  std::string expected;
+  for (int i = 1; i <= 60000; i++) {
+    expected += std::to_string(i) + "\n";
+  }
+  auto entry = reader->Stat("/seq");
+  ASSERT_RESULT_OK(entry);
+  ASSERT_EQ(expected.size(), entry->size);
+  auto content = reader->ReadFileToString("/seq");
+  ASSERT_RESULT_OK(content);
+  ASSERT_EQ(expected, *content);
+}
+
+TEST_P(PayloadImageTest, ListLargeDirectory) {
+  auto reader = OpenReader();
+  ASSERT_RESULT_OK(reader);
+
+  auto entries = reader->List("/dir");
+  ASSERT_RESULT_OK(entries);
+  ASSERT_EQ(1000u, entries->size());
+  for (size_t i = 0; i < entries->size(); i++) {
+    ASSERT_EQ(StringPrintf("entry_%03zu", i), (*entries)[i].name);
+    ASSERT_TRUE(S_ISREG((*entries)[i].mode));
+  }
+
+  auto last = reader->Stat("/dir/entry_999");
+  ASSERT_RESULT_OK(last);
+  ASSERT_EQ(0u, last->size);
+}
+
+TEST(ApexPayloadReaderTest, CannotReadCompressedApex) {
+  auto apex =
+      ApexFile::Open(kTestDataDir + "com.android.apex.compressed.v1.capex");
+  ASSERT_RESULT_OK(apex);
+  auto reader = ApexPayloadReader::Open(*apex);
+  ASSERT_FALSE(reader.ok());
+  ASSERT_THAT(reader.error().message(), HasSubstr("compressed"));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
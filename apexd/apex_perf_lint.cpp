@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_perf_lint.h"
+
+#include <android-base/result.h>
+#include <android-base/stringprintf.h>
+#include <sys/stat.h>
+
+#include "apex_payload_reader.h"
+
+using android::base::Result;
+using android::base::StringPrintf;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Rough throughputs of a mid-range device, used to estimate boot costs. They
+// are only meant to rank APEXes against each other.
+constexpr uint64_t kSha256BytesPerMs = 1000 * 1024;
+constexpr uint64_t kSha512BytesPerMs = 400 * 1024;
+// Uncompressed APEXes at least this large are worth shipping as CAPEXes.
+constexpr uint64_t kCompressionCandidateSize = 16 * 1024 * 1024;
+// Images with more free space than this are flagged as oversized.
+constexpr uint64_t kMaxWastedImageSize = 4 * 1024 * 1024;
+
+std::string ToMiB(uint64_t bytes) {
+  return StringPrintf("%.1f MiB", bytes / (1024.0 * 1024.0));
+}
+
+// Sums the sizes of the files under |dir|, as they are and rounded up to
+// whole blocks.
+Result<void> MeasureContent(const ApexPayloadReader& reader,
+                            const std::string& dir, uint64_t* bytes,
+                            uint64_t* block_bytes) {
+  constexpr uint64_t kBlockSize = 4096;
+  auto entries = reader.List(dir);
+  if (!entries.ok()) {
+    return entries.error();
+  }
+  for (const auto& entry : *entries) {
+    const std::string path = (dir == "/" ? "" : dir) + "/" + entry.name;
+    if (S_ISDIR(entry.mode)) {
+      if (entry.name == "lost+found") {
+        continue;
+      }
+      *block_bytes += kBlockSize;
+      if (auto st = MeasureContent(reader, path, bytes, block_bytes);
+          !st.ok()) {
+        return st;
+      }
+      continue;
+    }
+    *bytes += entry.size;
+    *block_bytes += (entry.size + kBlockSize - 1) / kBlockSize * kBlockSize;
+  }
+  return {};
+}
+
+}  // namespace
+
+std::vector<PerfFinding> LintApex(const std::string& apex_path,
+                                  bool is_compressed, const ApexFile& apex) {
+  std::vector<PerfFinding> findings;
+  const uint64_t image_size = apex.GetImageSize().value_or(0);
+  // Same as apexd: factory APEXes are mounted without dm-verity, but what a
+  // CAPEX decompresses to is mounted on it, like an APEX in /data. Verity costs
+  // of the others are reported as they would be once the APEX is updated.
+  const bool mounts_on_verity = is_compressed;
+  auto verity_cost = [&](std::chrono::milliseconds cost) {
+    return mounts_on_verity ? cost : std::chrono::milliseconds(0);
+  };
+  const std::string verity_note =
+      mounts_on_verity ? ""
+                       : " Costs nothing at boot as shipped, since the APEX "
+                         "is mounted without dm-verity.";
+
+  if (apex.GetImageOffset().value_or(0) % 4096 != 0) {
+    findings.push_back({
+        .id = "unaligned-payload",
+        .message = StringPrintf(
+            "payload is at offset %u, which is not 4 KiB aligned. Loop "
+            "devices can't use direct I/O, so the payload is cached twice.",
+            *apex.GetImageOffset()),
+    });
+  }
+
+  auto verity = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+  if (verity.ok()) {
+    const uint64_t hash_rate = verity->hash_algorithm == "sha256"
+                                   ? kSha256BytesPerMs
+                                   : kSha512BytesPerMs;
+    if (verity->desc->tree_size == 0) {
+      findings.push_back({
+          .id = "no-hashtree",
+          .message = "no hashtree in the payload. apexd has to generate one "
+                     "in /data before it can activate the APEX." +
+                     verity_note,
+          .boot_cost =
+              verity_cost(std::chrono::milliseconds(image_size / hash_rate)),
+      });
+    }
+    if (verity->hash_algorithm != "sha256") {
+      findings.push_back({
+          .id = "slow-hash",
+          .message = "dm-verity uses " + verity->hash_algorithm +
+                     ". sha256 is hardware accelerated on most devices." +
+                     verity_note,
+          .boot_cost = verity_cost(std::chrono::milliseconds(
+              image_size / kSha512BytesPerMs - image_size / kSha256BytesPerMs)),
+      });
+    }
+  }
+
+  struct stat st;
+  if (!is_compressed && stat(apex_path.c_str(), &st) == 0 &&
+      static_cast<uint64_t>(st.st_size) >= kCompressionCandidateSize) {
+    findings.push_back({
+        .id = "uncompressed",
+        .message = ToMiB(st.st_size) +
+                   " uncompressed. Consider shipping it as a CAPEX to save "
+                   "space on the partition.",
+    });
+  }
+
+  auto reader = ApexPayloadReader::Open(apex);
+  if (!reader.ok()) {
+    return findings;
+  }
+  uint64_t content = 0;
+  uint64_t block_content = 0;
+  if (!MeasureContent(*reader, "/", &content, &block_content).ok()) {
+    return findings;
+  }
+  if (reader->GetFsType() == "ext4" && image_size > block_content * 3 / 2) {
+    findings.push_back({
+        .id = "ext4-payload",
+        .message = "payload is ext4. erofs would take about " +
+                   ToMiB(block_content) + " instead of " + ToMiB(image_size) +
+                   ", and less to read and verify." + verity_note,
+        .boot_cost = verity_cost(std::chrono::milliseconds(
+            (image_size - block_content) / kSha256BytesPerMs)),
+    });
+  } else if (image_size > block_content + kMaxWastedImageSize) {
+    findings.push_back({
+        .id = "oversized-image",
+        .message = "payload image is " + ToMiB(image_size) + " for " +
+                   ToMiB(content) + " of files.",
+    });
+  }
+  return findings;
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_APEXD_APEX_PERF_LINT_H_
+#define ANDROID_APEXD_APEX_PERF_LINT_H_
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "apex_file.h"
+
+namespace android {
+namespace apex {
+
+// A build choice of an APEX with a known runtime cost.
+struct PerfFinding {
+  std::string id;
+  std::string message;
+  // Rough extra boot time it costs on a mid-range device, if any. Findings
+  // that don't slow down booting the APEX as it is shipped are informational
+  // and cost nothing.
+  std::chrono::milliseconds boot_cost{0};
+};
+
+// Flags build choices of the factory APEX at |apex_path| that slow down
+// activating it. |apex| is its payload: the APEX itself, or what it
+// decompresses to if |is_compressed|.
+std::vector<PerfFinding> LintApex(const std::string& apex_path,
+                                  bool is_compressed, const ApexFile& apex);
+
+}  // namespace apex
+}  // namespace android
+
+#endif  // ANDROID_APEXD_APEX_PERF_LINT_H_
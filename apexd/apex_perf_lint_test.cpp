@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apex_perf_lint.h"
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+
+#include "apex_file.h"
+#include "apexd_test_utils.h"
+
+using android::base::GetExecutableDirectory;
+using ::testing::AllOf;
+using ::testing::Contains;
+using ::testing::Field;
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+static const std::string kTestDataDir = GetExecutableDirectory() + "/";
+
+namespace android {
+namespace apex {
+namespace {
+
+auto HasId(const std::string& id) { return Field(&PerfFinding::id, id); }
+
+// Factory APEXes are mounted without dm-verity, so what only costs time when
+// verifying the payload is reported with no boot cost.
+TEST(ApexPerfLintTest, VerityFindingsOfFactoryApexAreInformational) {
+  const std::string path = kTestDataDir + "apex.apexd_test_no_hashtree.apex";
+  auto apex = ApexFile::Open(path);
+  ASSERT_RESULT_OK(apex);
+
+  auto findings = LintApex(path, /* is_compressed= */ false, *apex);
+  ASSERT_THAT(findings,
+              Contains(AllOf(HasId("no-hashtree"),
+                             Field(&PerfFinding::boot_cost,
+                                   std::chrono::milliseconds(0)),
+                             Field(&PerfFinding::message,
+                                   HasSubstr("mounted without dm-verity")))));
+}
+
+// What a CAPEX decompresses to is mounted on dm-verity, like an APEX in /data.
+TEST(ApexPerfLintTest, VerityFindingsOfCompressedApexCostBootTime) {
+  const std::string path = kTestDataDir + "apex.apexd_test_no_hashtree.apex";
+  auto apex = ApexFile::Open(path);
+  ASSERT_RESULT_OK(apex);
+
+  auto findings = LintApex(path, /* is_compressed= */ true, *apex);
+  ASSERT_THAT(findings,
+              Contains(AllOf(HasId("no-hashtree"),
+                             Field(&PerfFinding::message,
+                                   Not(HasSubstr("without dm-verity"))))));
+  ASSERT_THAT(findings, Not(Contains(HasId("uncompressed"))));
+}
+
+TEST(ApexPerfLintTest, NoVerityFindingsWithHashtree) {
+  const std::string path = kTestDataDir + "apex.apexd_test.apex";
+  auto apex = ApexFile::Open(path);
+  ASSERT_RESULT_OK(apex);
+
+  auto findings = LintApex(path, /* is_compressed= */ true, *apex);
+  ASSERT_THAT(findings, Not(Contains(HasId("no-hashtree"))));
+  ASSERT_THAT(findings, Not(Contains(HasId("slow-hash"))));
+  ASSERT_THAT(findings, Not(Contains(HasId("unaligned-payload"))));
+}
+
+TEST(ApexPerfLintTest, ErofsPayloadIsNotFlaggedAsExt4) {
+  const std::string path = kTestDataDir + "apex.apexd_test_erofs.apex";
+  auto apex = ApexFile::Open(path);
+  ASSERT_RESULT_OK(apex);
+
+  auto findings = LintApex(path, /* is_compressed= */ false, *apex);
+  ASSERT_THAT(findings, Not(Contains(HasId("ext4-payload"))));
+}
+
+}  // namespace
+}  // namespace apex
+}  // namespace android
@@ -37,6 +37,7 @@
 #include <libdm/dm_table.h>
 #include <libdm/dm_target.h>
 #include <linux/f2fs.h>
+#include <linux/fs.h>
 #include <linux/loop.h>
 #include <selinux/android.h>
 #include <stdlib.h>
@@ -51,7 +52,9 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <csignal>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
@@ -66,6 +69,7 @@
 #include <string>
 #include <string_view>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -77,11 +81,23 @@
 #include "apex_manifest.h"
 #include "apex_shim.h"
 #include "apexd_checkpoint.h"
+#include "apexd_concurrency.h"
+#include "apexd_dm.h"
+#include "apexd_embedded_hashtree.h"
+#include "apexd_hashtree_store.h"
 #include "apexd_lifecycle.h"
+#include "apexd_lock_stats.h"
 #include "apexd_loop.h"
+#include "apexd_maintenance.h"
+#include "apexd_memory.h"
+#include "apexd_mount.h"
+#include "apexd_pin.h"
+#include "apexd_prefetch.h"
 #include "apexd_private.h"
 #include "apexd_rollback_utils.h"
 #include "apexd_session.h"
+#include "apexd_space_reservation.h"
+#include "apexd_throttle.h"
 #include "apexd_utils.h"
 #include "apexd_verity.h"
 #include "com_android_apex.h"
@@ -122,6 +138,31 @@ static constexpr const char* kDmVerityRestartOnCorruption =
 
 MountedApexDatabase gMountedApexes;
 
+// Serializes activation and deactivation of APEXes with the same name, which
+// share a mount point, a dm device name and an entry in gMountedApexes. APEXes
+// with different names still activate in parallel.
+class ApexNameLocks {
+ public:
+  std::unique_lock<std::mutex> Lock(const std::string& apex_name) {
+    std::mutex* apex_mutex;
+    {
+      std::lock_guard lock(mutex_);
+      auto& entry = locks_[apex_name];
+      if (entry == nullptr) {
+        entry = std::make_unique<std::mutex>();
+      }
+      apex_mutex = entry.get();
+    }
+    return std::unique_lock(*apex_mutex);
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<std::mutex>> locks_;
+};
+
+ApexNameLocks gApexNameLocks;
+
 std::optional<ApexdConfig> gConfig;
 
 CheckpointInterface* gVoldService;
@@ -190,15 +231,20 @@ void ReleaseF2fsCompressedBlocks(const std::string& file_path) {
             << file_path;
 }
 
-std::unique_ptr<DmTable> CreateVerityTable(const ApexVerityData& verity_data,
-                                           const std::string& block_device,
-                                           const std::string& hash_device,
-                                           bool restart_on_corruption) {
+// |hash_offset| is where the hashtree starts on |hash_device|. By default it's
+// at the start of a separate hash device, or where the descriptor says if the
+// hashtree is in the image.
+std::unique_ptr<DmTable> CreateVerityTable(
+    const ApexVerityData& verity_data, const std::string& block_device,
+    const std::string& hash_device, bool restart_on_corruption,
+    std::optional<uint64_t> hash_offset = std::nullopt) {
   AvbHashtreeDescriptor* desc = verity_data.desc.get();
   auto table = std::make_unique<DmTable>();
 
   uint32_t hash_start_block = 0;
-  if (hash_device == block_device) {
+  if (hash_offset.has_value()) {
+    hash_start_block = *hash_offset / desc->hash_block_size;
+  } else if (hash_device == block_device) {
     hash_start_block = desc->tree_offset / desc->hash_block_size;
   }
 
@@ -432,6 +478,16 @@ Result<void> VerifyMountedImage(const ApexFile& apex,
   return {};
 }
 
+bool IsPrefetchEnabled() {
+  return android::sysprop::ApexProperties::prefetch_enabled().value_or(false);
+}
+
+// Hashtrees of all packages, named after their content. The hashtree files
+// of packages link to it.
+HashTreeStore GetHashTreeStore() {
+  return HashTreeStore(std::string(gConfig->apex_hash_tree_dir) + "/store");
+}
+
 Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                                          const std::string& mount_point,
                                          const std::string& device_name,
@@ -477,12 +533,26 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (!apex.GetImageOffset() || !apex.GetImageSize()) {
     return Error() << "Cannot create mount point without image offset and size";
   }
+  // A hashtree embedded at staging is reached through the same loop device as
+  // the payload, so that device has to extend up to the end of the hashtree.
+  std::optional<EmbeddedHashTree> embedded_hashtree;
+  uint64_t loop_size = apex.GetImageSize().value();
+  if (!ApexFileRepository::GetInstance().IsPreInstalledApex(apex)) {
+    auto embedded = FindEmbeddedHashTree(full_path);
+    if (!embedded.ok()) {
+      LOG(WARNING) << "Ignoring embedded hashtree: " << embedded.error();
+    } else if (embedded->has_value() &&
+               (*embedded)->offset >= apex.GetImageOffset().value()) {
+      embedded_hashtree = std::move(*embedded);
+      loop_size = embedded_hashtree->offset + embedded_hashtree->size -
+                  apex.GetImageOffset().value();
+    }
+  }
   loop::LoopbackDeviceUniqueFd loopback_device;
   for (size_t attempts = 1;; ++attempts) {
     Result<loop::LoopbackDeviceUniqueFd> ret =
-        loop::CreateAndConfigureLoopDevice(full_path,
-                                           apex.GetImageOffset().value(),
-                                           apex.GetImageSize().value());
+        loop::CreateAndConfigureLoopDevice(
+            full_path, apex.GetImageOffset().value(), loop_size);
     if (ret.ok()) {
       loopback_device = std::move(*ret);
       break;
@@ -522,6 +592,8 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                             /* device_name = */ "",
                             /* hashtree_loop_name = */ "",
                             /* is_temp_mount */ temp_mount);
+  apex_data.loop_direct_io = loopback_device.io_mode.direct_io;
+  apex_data.loop_buffered_reason = loopback_device.io_mode.buffered_reason;
 
   // for APEXes in immutable partitions, we don't need to mount them on
   // dm-verity because they are already in the dm-verity protected partition;
@@ -531,14 +603,26 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
                                // decompressed apexes are on /data
                                instance.IsDecompressedApex(apex) ||
                                // block apexes are from host
-                               instance.IsBlockApex(apex);
+                               instance.IsBlockApex(apex) ||
+                               // they replace decompressed apexes
+                               apex.IsNativelyCompressed();
 
   DmVerityDevice verity_dev;
   loop::LoopbackDeviceUniqueFd loop_for_hash;
   if (mount_on_verity) {
     std::string hash_device = loopback_device.name;
-    if (verity_data->desc->tree_size == 0) {
-      if (auto st = PrepareHashTree(apex, *verity_data, hashtree_file);
+    std::optional<uint64_t> hash_offset;
+    if (verity_data->desc->tree_size == 0 && embedded_hashtree.has_value() &&
+        embedded_hashtree->Matches(*verity_data) &&
+        (embedded_hashtree->offset - apex.GetImageOffset().value()) %
+                verity_data->desc->hash_block_size ==
+            0) {
+      LOG(VERBOSE) << "Using hashtree embedded in " << full_path;
+      hash_offset = embedded_hashtree->offset - apex.GetImageOffset().value();
+    } else if (verity_data->desc->tree_size == 0) {
+      const HashTreeStore store = GetHashTreeStore();
+      if (auto st =
+              PrepareHashTree(apex, *verity_data, hashtree_file, &store);
           !st.ok()) {
         return st.error();
       }
@@ -555,7 +639,8 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
     }
     auto verity_table =
         CreateVerityTable(*verity_data, loopback_device.name, hash_device,
-                          /* restart_on_corruption = */ !verify_image);
+                          /* restart_on_corruption = */ !verify_image,
+                          hash_offset);
     Result<DmVerityDevice> verity_dev_res =
         CreateVerityDevice(device_name, *verity_table, reuse_device);
     if (!verity_dev_res.ok()) {
@@ -589,12 +674,39 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
   if (!apex.GetFsType()) {
     return Error() << "Cannot mount package without FsType";
   }
-  if (mount(block_device.c_str(), mount_point.c_str(),
-            apex.GetFsType().value().c_str(), mount_flags, nullptr) == 0) {
-    auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-        boot_clock::now() - time_started).count();
-    LOG(INFO) << "Successfully mounted package " << full_path << " on "
-              << mount_point << " duration=" << time_elapsed;
+  bool mounted = false;
+  bool new_mount_api_failed = false;
+  if (SupportsNewMountApi()) {
+    // Verify the image before it's attached, so that nobody can see an
+    // unverified mount at |mount_point|.
+    auto detached = DetachedMount::Create(
+        block_device, apex.GetFsType().value(), mount_flags);
+    if (detached.ok()) {
+      auto status = VerifyMountedImage(apex, detached->GetPath());
+      if (!status.ok()) {
+        return Error() << "Failed to verify " << full_path << ": "
+                       << status.error();
+      }
+      auto attached = detached->AttachTo(mount_point);
+      mounted = attached.ok();
+      if (!attached.ok()) {
+        LOG(WARNING) << "Retrying with mount(2) for " << full_path << ": "
+                     << attached.error();
+      }
+    } else {
+      LOG(WARNING) << "Retrying with mount(2) for " << full_path << ": "
+                   << detached.error();
+    }
+    new_mount_api_failed = !mounted;
+  }
+  if (!mounted) {
+    if (mount(block_device.c_str(), mount_point.c_str(),
+              apex.GetFsType().value().c_str(), mount_flags, nullptr) != 0) {
+      return ErrnoError() << "Mounting failed for package " << full_path;
+    }
+    if (new_mount_api_failed) {
+      DisableNewMountApi();
+    }
     auto status = VerifyMountedImage(apex, mount_point);
     if (!status.ok()) {
       if (umount2(mount_point.c_str(), UMOUNT_NOFOLLOW) != 0) {
@@ -603,16 +715,22 @@ Result<MountedApexData> MountPackageImpl(const ApexFile& apex,
       return Error() << "Failed to verify " << full_path << ": "
                      << status.error();
     }
-    // Time to accept the temporaries as good.
-    verity_dev.Release();
-    loopback_device.CloseGood();
-    loop_for_hash.CloseGood();
-
-    scope_guard.Disable();  // Accept the mount.
-    return apex_data;
-  } else {
-    return ErrnoError() << "Mounting failed for package " << full_path;
   }
+  auto time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      boot_clock::now() - time_started).count();
+  LOG(INFO) << "Successfully mounted package " << full_path << " on "
+            << mount_point << " duration=" << time_elapsed;
+  if (!temp_mount && IsPrefetchEnabled()) {
+    SchedulePrefetch(kApexPrefetchDir, GetPackageId(apex.GetManifest()),
+                     mount_point, verity_data->root_digest);
+  }
+  // Time to accept the temporaries as good.
+  verity_dev.Release();
+  loopback_device.CloseGood();
+  loop_for_hash.CloseGood();
+
+  scope_guard.Disable();  // Accept the mount.
+  return apex_data;
 }
 
 std::string GetHashTreeFileName(const ApexFile& apex, bool is_new) {
@@ -622,6 +740,41 @@ std::string GetHashTreeFileName(const ApexFile& apex, bool is_new) {
   return is_new ? ret + ".new" : ret;
 }
 
+// Where a staged APEX with its hashtree embedded is kept until the session is
+// activated.
+std::string GetVerityReadyApexPath(const ApexFile& apex) {
+  return GetHashTreeFileName(apex, /* is_new= */ true) + kApexPackageSuffix;
+}
+
+// Writes a copy of the staged |apex| with the hashtree generated while
+// verifying it embedded, so that activating it needs neither the hashtree file
+// nor a second loop device. Failing isn't fatal, StagePackages() then falls
+// back to the hashtree file.
+void PrepareVerityReadyApex(const ApexFile& apex) {
+  ATRACE_NAME("PrepareVerityReadyApex");
+  const std::string hashtree_file =
+      GetHashTreeFileName(apex, /* is_new= */ true);
+  if (access(hashtree_file.c_str(), F_OK) != 0) {
+    // The payload comes with its own hashtree.
+    return;
+  }
+  auto verity_data = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+  if (!verity_data.ok()) {
+    LOG(WARNING) << "Not embedding hashtree into " << apex.GetPath() << ": "
+                 << verity_data.error();
+    return;
+  }
+  const std::string path = GetVerityReadyApexPath(apex);
+  if (auto st =
+          EmbedHashTree(apex.GetPath(), hashtree_file, *verity_data, path);
+      !st.ok()) {
+    LOG(WARNING) << "Failed to embed hashtree into " << apex.GetPath() << ": "
+                 << st.error();
+    return;
+  }
+  LOG(INFO) << "Embedded hashtree of " << apex.GetPath() << " into " << path;
+}
+
 Result<MountedApexData> VerifyAndTempMountPackage(
     const ApexFile& apex, const std::string& mount_point) {
   const std::string& package_id = GetPackageId(apex.GetManifest());
@@ -1203,7 +1356,7 @@ Result<void> ActivateSharedLibsPackage(const std::string& mount_point) {
   // Having static mutex here is not great, but since this function is called
   // only twice during boot we can probably live with that. In U+ we will have
   // a proper solution implemented.
-  static std::mutex mtx;
+  static InstrumentedMutex mtx("activate_shared_libs");
   // ActivateSharedLibsPackage can be called concurrently from multiple threads.
   // Since this function mutates the shared state in /apex/sharedlibs hold the
   // mutex to avoid potential race conditions.
@@ -1322,6 +1475,7 @@ Result<void> ActivatePackageImpl(const ApexFile& apex_file,
   if (!IsValidPackageName(manifest.name())) {
     return Errorf("Package name {} is not allowed.", manifest.name());
   }
+  auto name_lock = gApexNameLocks.Lock(manifest.name());
 
   // Validate upgraded shim apex
   if (shim::IsShimApex(apex_file) &&
@@ -1442,22 +1596,16 @@ Result<void> DeactivatePackage(const std::string& full_path) {
     return apex_file.error();
   }
 
+  auto name_lock = gApexNameLocks.Lock(apex_file->GetManifest().name());
   return UnmountPackage(*apex_file, /* allow_latest= */ true,
                         /* deferred= */ false);
 }
 
-Result<std::vector<ApexFile>> GetStagedApexFiles(
-    int session_id, const std::vector<int>& child_session_ids) {
-  auto session = ApexSession::GetSession(session_id);
-  if (!session.ok()) {
-    return session.error();
-  }
-  // We should only accept sessions in SessionState::STAGED state
-  auto session_state = (*session).GetState();
-  if (session_state != SessionState::STAGED) {
-    return Error() << "Session " << session_id << " is not in state STAGED";
-  }
+namespace {
 
+// Opens the APEXes staged for the session |session_id|, whatever its state.
+Result<std::vector<ApexFile>> OpenSessionApexFiles(
+    int session_id, const std::vector<int>& child_session_ids) {
   std::vector<int> ids_to_scan;
   if (!child_session_ids.empty()) {
     ids_to_scan = child_session_ids;
@@ -1486,6 +1634,22 @@ Result<std::vector<ApexFile>> GetStagedApexFiles(
   return OpenApexFiles(apex_file_paths);
 }
 
+}  // namespace
+
+Result<std::vector<ApexFile>> GetStagedApexFiles(
+    int session_id, const std::vector<int>& child_session_ids) {
+  auto session = ApexSession::GetSession(session_id);
+  if (!session.ok()) {
+    return session.error();
+  }
+  // We should only accept sessions in SessionState::STAGED state
+  auto session_state = (*session).GetState();
+  if (session_state != SessionState::STAGED) {
+    return Error() << "Session " << session_id << " is not in state STAGED";
+  }
+  return OpenSessionApexFiles(session_id, child_session_ids);
+}
+
 Result<ClassPath> MountAndDeriveClassPath(
     const std::vector<ApexFile>& apex_files) {
   auto guard = android::base::make_scope_guard([&]() {
@@ -1711,20 +1875,38 @@ namespace {
 
 enum ActivationMode { kBootstrapMode = 0, kBootMode, kOtaChrootMode, kVmMode };
 
+// Publishes activation status of individual APEXes during boot, so that
+// services depending on a few APEXes don't have to wait for all of them. For
+// each APEX, <apexd.status>.apex.<name> is set to "activated" once it is
+// mounted.
+void PublishApexActivated(const std::string& apex_name) {
+  const std::string prop = StringPrintf(
+      "%s.apex.%s", gConfig->apex_status_sysprop, apex_name.c_str());
+  if (!SetProperty(prop, kApexStatusActivated)) {
+    PLOG(ERROR) << "Failed to set " << prop << " to " << kApexStatusActivated;
+  }
+}
+
 std::vector<Result<void>> ActivateApexWorker(
     ActivationMode mode, std::queue<const ApexFile*>& apex_queue,
-    std::mutex& mutex) {
+    InstrumentedMutex& mutex, ActivationConcurrencyController& controller,
+    size_t index) {
   ATRACE_NAME("ActivateApexWorker");
   std::vector<Result<void>> ret;
+  controller.OnWorkerStart();
 
-  while (true) {
+  while (controller.WaitForSlot(index)) {
     const ApexFile* apex;
     {
       std::lock_guard lock(mutex);
-      if (apex_queue.empty()) break;
+      if (apex_queue.empty()) {
+        controller.Finish();
+        break;
+      }
       apex = apex_queue.front();
       apex_queue.pop();
     }
+    const auto start = std::chrono::steady_clock::now();
 
     std::string device_name;
     if (mode == ActivationMode::kBootMode) {
@@ -1741,42 +1923,73 @@ std::vector<Result<void>> ActivateApexWorker(
       ret.push_back(Error() << "Failed to activate " << apex->GetPath() << "("
                             << device_name << "): " << res.error());
     } else {
+      if (mode == ActivationMode::kBootMode) {
+        PublishApexActivated(apex->GetManifest().name());
+      }
       ret.push_back({});
     }
+    controller.ReportCompletion(std::chrono::steady_clock::now() - start);
   }
 
   return ret;
 }
 
+// Returns online CPUs, falling back to treating all of them as equally fast
+// if their capacity can't be read.
+std::vector<CpuCapacity> GetActivationCpus() {
+  auto cpus = GetOnlineCpuCapacities();
+  if (cpus.ok()) {
+    return *cpus;
+  }
+  LOG(WARNING) << "Failed to read CPU topology: " << cpus.error();
+  std::vector<CpuCapacity> ret;
+  for (int i = 0; i < std::max(get_nprocs(), 1); i++) {
+    ret.push_back({i, 1024});
+  }
+  return ret;
+}
+
 Result<void> ActivateApexPackages(const std::vector<ApexFileRef>& apexes,
                                   ActivationMode mode) {
   ATRACE_NAME("ActivateApexPackages");
   std::queue<const ApexFile*> apex_queue;
-  std::mutex apex_queue_mutex;
+  InstrumentedMutex apex_queue_mutex("activation_queue");
 
   for (const ApexFile& apex : apexes) {
     apex_queue.emplace(&apex);
   }
 
-  // Creates threads as many as half number of cores for the performance.
-  size_t worker_num = std::max(get_nprocs_conf() >> 1, 1);
-  worker_num = std::min(apex_queue.size(), worker_num);
+  // Starts with half of the online CPU capacity and lets the controller adjust
+  // it to what the storage can sustain.
+  const auto cpus = GetActivationCpus();
+  ActivationConcurrencyController::Options options;
+  options.max_workers = std::min(apex_queue.size(), cpus.size());
+  const size_t max_workers_prop =
+      android::sysprop::ApexProperties::activation_max_workers().value_or(0);
+  if (max_workers_prop != 0) {
+    options.max_workers = std::min(options.max_workers, max_workers_prop);
+  }
+  options.initial_workers = ComputeInitialWorkerCount(
+      cpus, apex_queue.size(), options.max_workers);
 
-  // On -eng builds there might be two different pre-installed art apexes.
-  // Attempting to activate them in parallel will result in UB (e.g.
-  // apexd-bootstrap might crash). In order to avoid this, for the time being on
-  // -eng builds activate apexes sequentially.
-  // TODO(b/176497601): remove this.
-  if (GetProperty("ro.build.type", "") == "eng") {
-    worker_num = 1;
+  if ((mode == ActivationMode::kBootstrapMode ||
+       mode == ActivationMode::kBootMode) &&
+      android::sysprop::ApexProperties::activation_pin_perf_cpus().value_or(
+          false)) {
+    options.pin_cpus = GetPerformanceCpus(cpus);
   }
+  // Workers above the current limit stay parked until the controller needs
+  // them.
+  const size_t worker_num = options.max_workers;
+  ActivationConcurrencyController controller(std::move(options));
 
   std::vector<std::future<std::vector<Result<void>>>> futures;
   futures.reserve(worker_num);
   for (size_t i = 0; i < worker_num; i++) {
     futures.push_back(std::async(std::launch::async, ActivateApexWorker,
                                  std::ref(mode), std::ref(apex_queue),
-                                 std::ref(apex_queue_mutex)));
+                                 std::ref(apex_queue_mutex),
+                                 std::ref(controller), i));
   }
 
   size_t activated_cnt = 0;
@@ -2251,6 +2464,24 @@ std::string StageDestPath(const ApexFile& apex_file) {
                       kApexPackageSuffix);
 }
 
+// Returns whether |path| is a copy of the staged |apex| with its hashtree
+// embedded, as written by PrepareVerityReadyApex().
+bool IsVerityReadyCopy(const std::string& path, const ApexFile& apex) {
+  if (access(path.c_str(), F_OK) != 0) {
+    return false;
+  }
+  auto copy = ApexFile::Open(path);
+  if (!copy.ok() ||
+      GetPackageId(copy->GetManifest()) != GetPackageId(apex.GetManifest()) ||
+      copy->GetBundledPublicKey() != apex.GetBundledPublicKey()) {
+    return false;
+  }
+  auto verity_data = apex.VerifyApexVerity(apex.GetBundledPublicKey());
+  auto embedded = FindEmbeddedHashTree(path);
+  return verity_data.ok() && embedded.ok() && embedded->has_value() &&
+         (*embedded)->Matches(*verity_data);
+}
+
 }  // namespace
 
 Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
@@ -2305,19 +2536,48 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
   auto scope_guard = android::base::make_scope_guard(deleter);
 
   std::unordered_set<std::string> staged_packages;
+  std::vector<std::string> obsolete_hashtree_files;
   for (const ApexFile& apex_file : *apex_files) {
-    // First promote new hashtree file to the one that will be used when
-    // mounting apex.
     std::string new_hashtree_file = GetHashTreeFileName(apex_file,
                                                         /* is_new = */ true);
     std::string old_hashtree_file = GetHashTreeFileName(apex_file,
                                                         /* is_new = */ false);
+    // Prefer the copy with the hashtree embedded, written when the session
+    // was submitted. It makes the hashtree files unnecessary.
+    const std::string verity_ready_path = GetVerityReadyApexPath(apex_file);
+    if (IsVerityReadyCopy(verity_ready_path, apex_file)) {
+      std::string dest_path = StageDestPath(apex_file);
+      if (TEMP_FAILURE_RETRY(rename(verity_ready_path.c_str(),
+                                    dest_path.c_str())) != 0) {
+        return ErrnoError() << "Failed to move " << verity_ready_path << " to "
+                            << dest_path;
+      }
+      staged_files.insert(dest_path);
+      staged_packages.insert(apex_file.GetManifest().name());
+      if (auto st = RestoreconPath(dest_path); !st.ok()) {
+        return st.error();
+      }
+      obsolete_hashtree_files.push_back(std::move(new_hashtree_file));
+      obsolete_hashtree_files.push_back(std::move(old_hashtree_file));
+      LOG(DEBUG) << "Success moving " << verity_ready_path << " to "
+                 << dest_path;
+      continue;
+    }
+
+    // First promote new hashtree file to the one that will be used when
+    // mounting apex.
     if (access(new_hashtree_file.c_str(), F_OK) == 0) {
       if (TEMP_FAILURE_RETRY(rename(new_hashtree_file.c_str(),
                                     old_hashtree_file.c_str())) != 0) {
         return ErrnoError() << "Failed to move " << new_hashtree_file << " to "
                             << old_hashtree_file;
       }
+      // Both may be links to the same hashtree of the store, in which case
+      // rename() leaves them alone.
+      if (access(new_hashtree_file.c_str(), F_OK) == 0 &&
+          unlink(new_hashtree_file.c_str()) != 0) {
+        return ErrnoError() << "Failed to unlink " << new_hashtree_file;
+      }
       changed_hashtree_files.emplace_back(std::move(old_hashtree_file));
     }
     // And only then move apex to /data/apex/active.
@@ -2342,6 +2602,13 @@ Result<void> StagePackages(const std::vector<std::string>& tmp_paths) {
 
   scope_guard.Disable();  // Accept the state.
 
+  for (const std::string& hashtree_file : obsolete_hashtree_files) {
+    std::string err;
+    if (!RemoveFileIfExists(hashtree_file, &err)) {
+      LOG(WARNING) << "Failed to remove " << hashtree_file << " : " << err;
+    }
+  }
+
   return RemovePreviouslyActiveApexFiles(staged_packages, staged_files);
 }
 
@@ -2538,7 +2805,6 @@ int OnBootstrap() {
     LOG(ERROR) << "Failed to pre-allocate loop devices : " << res.error();
   }
 
-  DeviceMapper& dm = DeviceMapper::Instance();
   // Create empty dm device for each found APEX.
   // This is a boot time optimization that makes use of the fact that user space
   // paths will be created by ueventd before apexd is started, and hence
@@ -2546,13 +2812,14 @@ int OnBootstrap() {
   // Note: since at this point we don't know which APEXes are updated, we are
   // optimistically creating a verity device for all of them. Once boot
   // finishes, apexd will clean up unused devices.
-  // TODO(b/192241176): move to apexd_verity.{h,cpp}
+  std::vector<std::string> dm_names;
+  dm_names.reserve(pre_installed_apexes.size());
   for (const auto& apex : pre_installed_apexes) {
-    const std::string& name = apex.get().GetManifest().name();
-    if (!dm.CreateEmptyDevice(name)) {
-      LOG(ERROR) << "Failed to create empty device " << name;
-    }
+    dm_names.push_back(apex.get().GetManifest().name());
   }
+  const size_t dm_created = CreateEmptyDmDevices(dm_names);
+  LOG(INFO) << "Created " << dm_created << " of " << dm_names.size()
+            << " empty dm devices";
 
   // Create directories for APEX shared libraries.
   auto sharedlibs_apex_dir = CreateSharedLibsApexDir();
@@ -2639,6 +2906,8 @@ void InitializeDataApex() {
   }
 }
 
+namespace {
+
 /**
  * For every package X, there can be at most two APEX, pre-installed vs
  * installed on data. We usually select only one of these APEX for each package
@@ -2652,13 +2921,21 @@ void InitializeDataApex() {
  * shared libs are exceptions. We have to activate both APEX for them.
  *
  * @param all_apex all the APEX grouped by their package name
+ * @param reasons if not null, filled with why each APEX of the returned list
+ * was selected
  * @return list of ApexFile that needs to be activated
  */
-std::vector<ApexFileRef> SelectApexForActivation(
+std::vector<ApexFileRef> SelectApexForActivationImpl(
     const std::unordered_map<std::string, std::vector<ApexFileRef>>& all_apex,
-    const ApexFileRepository& instance) {
+    const ApexFileRepository& instance, std::vector<std::string>* reasons) {
   LOG(INFO) << "Selecting APEX for activation";
   std::vector<ApexFileRef> activation_list;
+  auto select = [&](const ApexFileRef& apex, std::string reason) {
+    activation_list.emplace_back(apex);
+    if (reasons != nullptr) {
+      reasons->push_back(std::move(reason));
+    }
+  };
   // For every package X, select which APEX to activate
   for (auto& apex_it : all_apex) {
     const std::string& package_name = apex_it.first;
@@ -2681,7 +2958,9 @@ std::vector<ApexFileRef> SelectApexForActivation(
     if (apex_files.size() == 1) {
       LOG(DEBUG) << "Selecting the only APEX: " << package_name << " "
                  << apex_files[0].get().GetPath();
-      activation_list.emplace_back(apex_files[0]);
+      select(apex_files[0], instance.IsPreInstalledApex(apex_files[0])
+                                ? "only the pre-installed version exists"
+                                : "only version on /data");
       continue;
     }
 
@@ -2690,9 +2969,8 @@ std::vector<ApexFileRef> SelectApexForActivation(
 
     // Given an APEX A and the version of the other APEX B, should we activate
     // it?
-    auto select_apex = [&instance, &activation_list](
-                           const ApexFileRef& a_ref,
-                           const int version_b) mutable {
+    auto select_apex = [&instance, &select](const ApexFileRef& a_ref,
+                                            const int version_b) mutable {
       const ApexFile& a = a_ref.get();
       // If A has higher version than B, then it should be activated
       const bool higher_version = a.GetManifest().version() > version_b;
@@ -2711,6 +2989,7 @@ std::vector<ApexFileRef> SelectApexForActivation(
       const bool provides_shared_apex_libs =
           a.GetManifest().providesharedapexlibs();
       bool activate = false;
+      std::string reason;
       if (provides_shared_apex_libs) {
         // preinstalled version gets activated in all cases except when same
         // version as data.
@@ -2719,6 +2998,10 @@ std::vector<ApexFileRef> SelectApexForActivation(
           LOG(DEBUG) << "Activating preinstalled shared libs APEX: "
                      << a.GetManifest().name() << " " << a.GetPath();
           activate = true;
+          reason = StringPrintf(
+              "provides shared libs, pre-installed version kept next to "
+              "version %d on /data",
+              version_b);
         }
         // data version gets activated in all cases except when its version
         // is lower than preinstalled version.
@@ -2727,14 +3010,20 @@ std::vector<ApexFileRef> SelectApexForActivation(
           LOG(DEBUG) << "Activating shared libs APEX: "
                      << a.GetManifest().name() << " " << a.GetPath();
           activate = true;
+          reason = StringPrintf(
+              "provides shared libs, version on /data is not lower than %d",
+              version_b);
         }
       } else if (higher_version || same_version_priority_to_data) {
         LOG(DEBUG) << "Selecting between two APEX: " << a.GetManifest().name()
                    << " " << a.GetPath();
         activate = true;
+        reason = higher_version
+                     ? StringPrintf("higher version than %d", version_b)
+                     : "same version as the pre-installed one, /data wins";
       }
       if (activate) {
-        activation_list.emplace_back(a_ref);
+        select(a_ref, std::move(reason));
       }
     };
     const int version_0 = apex_files[0].get().GetManifest().version();
@@ -2745,6 +3034,15 @@ std::vector<ApexFileRef> SelectApexForActivation(
   return activation_list;
 }
 
+}  // namespace
+
+std::vector<ApexFileRef> SelectApexForActivation(
+    const std::unordered_map<std::string, std::vector<ApexFileRef>>& all_apex,
+    const ApexFileRepository& instance) {
+  return SelectApexForActivationImpl(all_apex, instance,
+                                     /* reasons= */ nullptr);
+}
+
 namespace {
 
 Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
@@ -2767,10 +3065,229 @@ Result<ApexFile> OpenAndValidateDecompressedApex(const ApexFile& capex,
   return std::move(*apex);
 }
 
+// Uncompressed APEXes on /data indexed by the root digest of their payload, so
+// that a CAPEX can reuse one that is already there under another name, e.g.
+// after a slot switch or an interrupted OTA. Directories are scanned on the
+// first lookup, which only happens when a CAPEX would be decompressed, and
+// again once they changed. Only APEXes that changed are opened again.
+// .ota.apex files aren't indexed: they may still be being decompressed into.
+class UncompressedApexIndex {
+ public:
+  explicit UncompressedApexIndex(std::vector<std::string> dirs)
+      : dirs_(std::move(dirs)) {}
+
+  const std::vector<std::string>& Find(const std::string& root_digest) {
+    if (auto mtimes = GetDirMtimes(); !scanned_ || mtimes != dir_mtimes_) {
+      Scan();
+      scanned_ = true;
+      dir_mtimes_ = std::move(mtimes);
+    }
+    static const std::vector<std::string> kNone;
+    auto it = by_digest_.find(root_digest);
+    return it == by_digest_.end() ? kNone : it->second;
+  }
+
+ private:
+  struct Entry {
+    ino_t ino;
+    int64_t mtime_ns;
+    std::string root_digest;
+  };
+
+  std::vector<int64_t> GetDirMtimes() const {
+    std::vector<int64_t> mtimes;
+    for (const auto& dir : dirs_) {
+      struct stat st;
+      mtimes.push_back(stat(dir.c_str(), &st) == 0
+                           ? st.st_mtim.tv_sec * 1000000000LL +
+                                 st.st_mtim.tv_nsec
+                           : -1);
+    }
+    return mtimes;
+  }
+
+  void Scan() {
+    ATRACE_NAME("UncompressedApexIndex::Scan");
+    std::unordered_map<std::string, Entry> entries;
+    by_digest_.clear();
+    for (const auto& dir : dirs_) {
+      auto paths = FindFilesBySuffix(dir, {kApexPackageSuffix});
+      if (!paths.ok()) {
+        LOG(WARNING) << "Can't index APEXes in " << dir << ": "
+                     << paths.error();
+        continue;
+      }
+      for (const auto& path : *paths) {
+        if (base::EndsWith(path, kOtaApexPackageSuffix)) {
+          continue;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+          continue;
+        }
+        const int64_t mtime_ns =
+            st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        auto it = entries_.find(path);
+        if (it != entries_.end() && it->second.ino == st.st_ino &&
+            it->second.mtime_ns == mtime_ns) {
+          by_digest_[it->second.root_digest].push_back(path);
+          entries.emplace(path, std::move(it->second));
+          continue;
+        }
+        auto apex = ApexFile::Open(path);
+        if (!apex.ok() || apex->IsCompressed()) {
+          continue;
+        }
+        // Whether the key is the right one is checked when the APEX is reused.
+        auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+        if (!verity_data.ok()) {
+          continue;
+        }
+        by_digest_[verity_data->root_digest].push_back(path);
+        entries.emplace(path,
+                        Entry{st.st_ino, mtime_ns, verity_data->root_digest});
+      }
+    }
+    entries_ = std::move(entries);
+  }
+
+  std::vector<std::string> dirs_;
+  bool scanned_ = false;
+  std::vector<int64_t> dir_mtimes_;
+  std::unordered_map<std::string, Entry> entries_;
+  std::unordered_map<std::string, std::vector<std::string>> by_digest_;
+};
+
+// Makes |dest| a copy of |src| that shares its blocks, on file systems that
+// support it.
+Result<void> ReflinkFile(const std::string& src, const std::string& dest) {
+  unique_fd src_fd(open(src.c_str(), O_RDONLY | O_CLOEXEC));
+  if (src_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << src;
+  }
+  unique_fd dest_fd(
+      open(dest.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT | O_EXCL, 0644));
+  if (dest_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << dest;
+  }
+  if (ioctl(dest_fd.get(), FICLONE, src_fd.get()) != 0) {
+    Result<void> error = ErrnoError() << "Failed to reflink " << src;
+    RemoveFileIfExists(dest);
+    return error;
+  }
+  return {};
+}
+
+// Puts an uncompressed APEX with the payload of |capex| found by |index| at
+// |dest|, sharing its blocks instead of decompressing |capex| again.
+Result<ApexFile> ReuseUncompressedApex(const ApexFile& capex,
+                                       const std::string& dest,
+                                       UncompressedApexIndex* index) {
+  const std::string& digest =
+      capex.GetManifest().capexmetadata().originalapexdigest();
+  if (digest.empty()) {
+    return Error() << capex.GetPath() << " has no original APEX digest";
+  }
+  for (const auto& path : index->Find(digest)) {
+    if (path == dest) {
+      continue;
+    }
+    // Hard links keep the label of |path|, which is checked below. Reflinks
+    // are new files and need one.
+    if (link(path.c_str(), dest.c_str()) != 0) {
+      if (auto st = ReflinkFile(path, dest); !st.ok()) {
+        LOG(VERBOSE) << "Can't reuse " << path << ": " << st.error();
+        continue;
+      }
+      if (auto st = RestoreconPath(dest); !st.ok()) {
+        LOG(WARNING) << st.error();
+        RemoveFileIfExists(dest);
+        continue;
+      }
+    }
+    auto apex = OpenAndValidateDecompressedApex(capex, dest);
+    if (apex.ok()) {
+      LOG(INFO) << "Reused " << path << " for " << capex.GetPath();
+      return apex;
+    }
+    LOG(WARNING) << "Can't reuse " << path << ": " << apex.error();
+    RemoveFileIfExists(dest);
+  }
+  return Error() << "No uncompressed APEX with root digest " << digest;
+}
+
+// Set from the SIGTERM handler of otapreopt_chroot to stop decompressing at
+// the next chunk. What was written is checkpointed and the next run resumes.
+std::atomic<bool> gStopOtaDecompression = false;
+
+// Paces decompression of CAPEXes for an OTA and publishes how far it got, so
+// that preparing an OTA in the background doesn't starve the foreground of
+// storage bandwidth.
+class OtaDecompressionProgress {
+ public:
+  OtaDecompressionProgress(uint64_t total, uint64_t bytes_per_sec)
+      : total_(total),
+        limiter_(bytes_per_sec),
+        path_(StringPrintf("%s/%s", gConfig->decompression_dir,
+                           kOtaDecompressionProgressFilename)) {}
+
+  DecompressOptions GetOptions() {
+    last_written_ = 0;
+    return DecompressOptions{
+        .on_progress =
+            [this](uint64_t written, uint64_t) {
+              // Only bytes past the resume offset are written; the ones
+              // before it are inflated again in memory and cost no I/O.
+              if (written > last_written_) {
+                limiter_.Acquire(written - last_written_);
+                last_written_ = written;
+              }
+              Publish(done_ + last_written_);
+              return !gStopOtaDecompression;
+            },
+        .on_resume = [this](uint64_t offset) { last_written_ = offset; },
+        .resume = true,
+    };
+  }
+
+  // Called once a CAPEX of |size| bytes decompressed is done with, whether it
+  // needed decompression or not.
+  void Finish(uint64_t size) {
+    done_ += size;
+    Publish(done_);
+  }
+
+ private:
+  void Publish(uint64_t done) {
+    done = std::min(done, total_);
+    const uint64_t percent = total_ == 0 ? 100 : done * 100 / total_;
+    if (percent == last_percent_) {
+      return;
+    }
+    last_percent_ = percent;
+    const std::string tmp_path = path_ + ".tmp";
+    const std::string content =
+        std::to_string(done) + " " + std::to_string(total_);
+    if (!android::base::WriteStringToFile(content, tmp_path) ||
+        rename(tmp_path.c_str(), path_.c_str()) != 0) {
+      PLOG(WARNING) << "Failed to publish progress to " << path_;
+    }
+  }
+
+  const uint64_t total_;
+  BandwidthLimiter limiter_;
+  const std::string path_;
+  uint64_t done_ = 0;
+  uint64_t last_written_ = 0;
+  std::optional<uint64_t> last_percent_;
+};
+
 // Process a single compressed APEX. Returns the decompressed APEX if
-// successful.
+// successful. |progress| is only set for is_ota_chroot.
 Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
-                                       bool is_ota_chroot) {
+                                       bool is_ota_chroot,
+                                       UncompressedApexIndex* index,
+                                       OtaDecompressionProgress* progress) {
   LOG(INFO) << "Processing compressed APEX " << capex.GetPath();
   const auto decompressed_apex_path =
       StringPrintf("%s/%s%s", gConfig->decompression_dir,
@@ -2800,7 +3317,10 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
                                     GetPackageId(capex.GetManifest()).c_str(),
                                     kOtaApexPackageSuffix);
   auto ota_path_exists = PathExists(ota_apex_path);
-  if (ota_path_exists.ok() && *ota_path_exists) {
+  const bool ota_apex_checkpointed =
+      is_ota_chroot &&
+      access(GetDecompressionCheckpointPath(ota_apex_path).c_str(), F_OK) == 0;
+  if (ota_path_exists.ok() && *ota_path_exists && !ota_apex_checkpointed) {
     if (is_ota_chroot) {
       // During ota_chroot, we try to reuse ota APEX as is
       auto result = OpenAndValidateDecompressedApex(capex, ota_apex_path);
@@ -2844,20 +3364,43 @@ Result<ApexFile> ProcessCompressedApex(const ApexFile& capex,
     }
   }
 
+  auto decompression_dest =
+      is_ota_chroot ? ota_apex_path : decompressed_apex_path;
+
+  // An identical APEX may already be on /data under another name. A partly
+  // decompressed one is cheaper to resume.
+  if (!ota_apex_checkpointed) {
+    auto reused = ReuseUncompressedApex(capex, decompression_dest, index);
+    if (reused.ok()) {
+      gChangedActiveApexes.insert(reused->GetManifest().name());
+      return reused;
+    }
+    LOG(VERBOSE) << reused.error();
+  }
+
   // There was no way to avoid decompression
 
-  // Clean up reserved space before decompressing capex
-  if (auto ret = DeleteDirContent(gConfig->ota_reserved_dir); !ret.ok()) {
-    LOG(ERROR) << "Failed to clean up reserved space: " << ret.error();
+  // Give back the space reserved for this module right before decompressing
+  // it. Reservations of other modules stay until their turn.
+  if (auto ret = SpaceReservation(gConfig->ota_reserved_dir)
+                     .Release(capex.GetManifest().name());
+      !ret.ok()) {
+    LOG(ERROR) << "Failed to release reserved space: " << ret.error();
   }
 
-  auto decompression_dest =
-      is_ota_chroot ? ota_apex_path : decompressed_apex_path;
   auto scope_guard = android::base::make_scope_guard(
       [&]() { RemoveFileIfExists(decompression_dest); });
 
-  auto decompression_result = capex.Decompress(decompression_dest);
+  auto decompression_result =
+      progress != nullptr
+          ? capex.Decompress(decompression_dest, progress->GetOptions())
+          : capex.Decompress(decompression_dest);
   if (!decompression_result.ok()) {
+    if (access(GetDecompressionCheckpointPath(decompression_dest).c_str(),
+               F_OK) == 0) {
+      // Stopped midway; leave it for the next run to resume.
+      scope_guard.Disable();
+    }
     return Error() << "Failed to decompress : " << capex.GetPath().c_str()
                    << " " << decompression_result.error();
   }
@@ -2895,12 +3438,34 @@ std::vector<ApexFile> ProcessCompressedApex(
   LOG(INFO) << "Processing compressed APEX";
 
   std::vector<ApexFile> decompressed_apex_list;
+  UncompressedApexIndex index(
+      {gConfig->decompression_dir, gConfig->active_apex_data_dir});
+  // Decompression during boot is on the critical path and runs at full speed.
+  std::optional<OtaDecompressionProgress> progress;
+  if (is_ota_chroot) {
+    uint64_t total = 0;
+    for (const ApexFile& capex : compressed_apex) {
+      total += capex.GetDecompressedSize().value_or(0);
+    }
+    const uint64_t bandwidth_kbps =
+        android::sysprop::ApexProperties::ota_decompression_bandwidth_kbps()
+            .value_or(32768);
+    progress.emplace(total, bandwidth_kbps * 1024);
+  }
   for (const ApexFile& capex : compressed_apex) {
     if (!capex.IsCompressed()) {
       continue;
     }
+    if (gStopOtaDecompression) {
+      LOG(INFO) << "Decompression stopped before " << capex.GetPath();
+      break;
+    }
 
-    auto decompressed_apex = ProcessCompressedApex(capex, is_ota_chroot);
+    auto decompressed_apex = ProcessCompressedApex(
+        capex, is_ota_chroot, &index, progress ? &*progress : nullptr);
+    if (progress) {
+      progress->Finish(capex.GetDecompressedSize().value_or(0));
+    }
     if (decompressed_apex.ok()) {
       decompressed_apex_list.emplace_back(std::move(*decompressed_apex));
       continue;
@@ -2937,6 +3502,401 @@ Result<void> ValidateDecompressedApex(const ApexFile& capex,
   return {};
 }
 
+namespace {
+
+// Rough rates used to turn the bytes an activation plan reads, decompresses
+// and hashes into time. They are meant to compare plans against each other,
+// not to predict the absolute boot time of a particular device.
+constexpr uint64_t kPlanReadBytesPerSec = 200ull << 20;
+constexpr uint64_t kPlanDecompressBytesPerSec = 100ull << 20;
+constexpr uint64_t kPlanHashBytesPerSec = 400ull << 20;
+// Setting up loop and dm-verity devices and mounting a single APEX.
+constexpr std::chrono::microseconds kPlanMountCost{3000};
+
+std::chrono::microseconds BytesToTime(uint64_t bytes, uint64_t bytes_per_sec) {
+  return std::chrono::microseconds(bytes * 1000000 / bytes_per_sec);
+}
+
+// Fills in what |entry| costs on top of mounting |apex|, following the
+// decisions ProcessCompressedApex and MountPackageImpl would make.
+void EstimateActivationCost(const ApexFile& apex,
+                            const ApexFileRepository& instance,
+                            ApexActivationPlanEntry* entry) {
+  if (apex.IsCompressed()) {
+    const std::string package_id = GetPackageId(apex.GetManifest());
+    const std::string decompressed_path =
+        StringPrintf("%s/%s%s", gConfig->decompression_dir, package_id.c_str(),
+                     kDecompressedApexPackageSuffix);
+    const std::string ota_apex_path =
+        StringPrintf("%s/%s%s", gConfig->decompression_dir, package_id.c_str(),
+                     kOtaApexPackageSuffix);
+    if (OpenAndValidateDecompressedApex(apex, decompressed_path).ok()) {
+      entry->notes.push_back("reuses " + decompressed_path);
+    } else if (OpenAndValidateDecompressedApex(apex, ota_apex_path).ok()) {
+      entry->notes.push_back("reuses " + ota_apex_path);
+    } else {
+      entry->needs_decompression = true;
+      if (auto size = GetFileSize(apex.GetPath()); size.ok()) {
+        entry->bytes_to_read += *size;
+      }
+      entry->bytes_to_decompress = apex.GetDecompressedSize().value_or(0);
+      entry->notes.push_back("needs decompression");
+    }
+    // Decompressed APEXes are copies of pre-installed ones, which come with a
+    // hashtree.
+    return;
+  }
+
+  if (apex.IsNativelyCompressed()) {
+    entry->notes.push_back("mounted without decompression");
+  } else if (instance.IsPreInstalledApex(apex) && !instance.IsBlockApex(apex)) {
+    // Mounted without dm-verity, see MountPackageImpl.
+    return;
+  }
+  auto public_key = instance.GetPublicKey(apex.GetManifest().name());
+  if (!public_key.ok()) {
+    entry->notes.push_back("can't be verified: " +
+                           public_key.error().message());
+    return;
+  }
+  auto verity_data = apex.VerifyApexVerity(*public_key);
+  if (!verity_data.ok()) {
+    entry->notes.push_back("can't be verified: " +
+                           verity_data.error().message());
+    return;
+  }
+  if (verity_data->desc->tree_size != 0) {
+    return;
+  }
+  auto embedded = FindEmbeddedHashTree(apex.GetPath());
+  if ((embedded.ok() && embedded->has_value() &&
+       (*embedded)->Matches(*verity_data)) ||
+      IsVerityReadyCopy(GetVerityReadyApexPath(apex), apex)) {
+    entry->notes.push_back("uses the hashtree embedded at staging");
+    return;
+  }
+  // A hashtree generated while staging is renamed to the active one on boot.
+  for (bool is_new : {false, true}) {
+    const std::string hashtree_file = GetHashTreeFileName(apex, is_new);
+    if (access(hashtree_file.c_str(), F_OK) == 0) {
+      entry->notes.push_back("reuses " + hashtree_file +
+                             " if its root digest matches");
+      return;
+    }
+  }
+  const HashTreeStore store = GetHashTreeStore();
+  if (access(store.GetPath(*verity_data).c_str(), F_OK) == 0) {
+    entry->notes.push_back("reuses hashtree " + store.GetPath(*verity_data));
+    return;
+  }
+  entry->needs_hashtree = true;
+  entry->bytes_to_read += apex.GetImageSize().value_or(0);
+  entry->bytes_to_hash = apex.GetImageSize().value_or(0);
+  entry->notes.push_back("needs hashtree generation");
+}
+
+}  // namespace
+
+Result<std::vector<ApexActivationPlanEntry>> PlanActivation() {
+  ATRACE_NAME("PlanActivation");
+  // Scan into a repository of our own, so that a running apexd keeps the view
+  // it activated its APEXes from.
+  ApexFileRepository instance(gConfig->decompression_dir);
+  if (auto st = instance.AddPreInstalledApex(gConfig->apex_built_in_dirs);
+      !st.ok()) {
+    return Error() << "Failed to scan pre-installed APEXes: " << st.error();
+  }
+  if (auto st = instance.AddDataApex(gConfig->active_apex_data_dir);
+      !st.ok()) {
+    return Error() << "Failed to scan data APEXes: " << st.error();
+  }
+  // APEXes of staged sessions replace the ones on /data on the next boot, even
+  // if they are older (i.e. rollbacks).
+  for (const auto& session :
+       ApexSession::GetSessionsInState(SessionState::STAGED)) {
+    std::vector<int> ids(session.GetChildSessionIds().begin(),
+                         session.GetChildSessionIds().end());
+    if (ids.empty()) {
+      ids.push_back(session.GetId());
+    }
+    for (int id : ids) {
+      const std::string dir = std::string(gConfig->staged_session_dir) +
+                              "/session_" + std::to_string(id);
+      if (auto st = instance.AddStagedApex(dir); !st.ok()) {
+        return Error() << "Failed to scan staged session " << id << ": "
+                       << st.error();
+      }
+    }
+  }
+
+  std::vector<std::string> reasons;
+  auto activation_list = SelectApexForActivationImpl(
+      instance.AllApexFilesByName(), instance, &reasons);
+  std::vector<ApexActivationPlanEntry> plan;
+  for (size_t i = 0; i < activation_list.size(); i++) {
+    const ApexFile& apex = activation_list[i].get();
+    ApexActivationPlanEntry entry;
+    entry.name = apex.GetManifest().name();
+    entry.path = apex.GetPath();
+    entry.version = apex.GetManifest().version();
+    entry.is_pre_installed = instance.IsPreInstalledApex(apex);
+    entry.reason = reasons[i];
+    EstimateActivationCost(apex, instance, &entry);
+    entry.estimated_cost =
+        kPlanMountCost +
+        BytesToTime(entry.bytes_to_read, kPlanReadBytesPerSec) +
+        BytesToTime(entry.bytes_to_decompress, kPlanDecompressBytesPerSec) +
+        BytesToTime(entry.bytes_to_hash, kPlanHashBytesPerSec);
+    plan.push_back(std::move(entry));
+  }
+  std::sort(plan.begin(), plan.end(), [](const auto& a, const auto& b) {
+    return std::tie(a.name, a.path) < std::tie(b.name, b.path);
+  });
+  return plan;
+}
+
+std::string FormatActivationPlanEntries(
+    const std::vector<ApexActivationPlanEntry>& plan) {
+  std::stringstream out;
+  uint64_t total_read = 0;
+  uint64_t total_decompress = 0;
+  uint64_t total_hash = 0;
+  std::chrono::microseconds total_cost{0};
+  for (const auto& entry : plan) {
+    out << entry.name << " " << entry.version << " " << entry.path
+        << (entry.is_pre_installed ? " [pre-installed]" : " [data]") << "\n"
+        << "  reason: " << entry.reason << "\n";
+    for (const auto& note : entry.notes) {
+      out << "  " << note << "\n";
+    }
+    out << "  cost: read " << entry.bytes_to_read << " bytes, decompress "
+        << entry.bytes_to_decompress << " bytes, hash " << entry.bytes_to_hash
+        << " bytes, ~"
+        << std::chrono::duration_cast<std::chrono::milliseconds>(
+               entry.estimated_cost)
+               .count()
+        << "ms\n";
+    total_read += entry.bytes_to_read;
+    total_decompress += entry.bytes_to_decompress;
+    total_hash += entry.bytes_to_hash;
+    total_cost += entry.estimated_cost;
+  }
+  out << "Total: " << plan.size() << " APEXes, read " << total_read
+      << " bytes, decompress " << total_decompress << " bytes, hash "
+      << total_hash << " bytes, ~"
+      << std::chrono::duration_cast<std::chrono::milliseconds>(total_cost)
+             .count()
+      << "ms if activated one at a time\n";
+  return out.str();
+}
+
+Result<std::string> GetActivationInputsIdentity(
+    const ApexFileRepository& instance) {
+  ATRACE_NAME("GetActivationInputsIdentity");
+  std::stringstream identity;
+  identity << "build " << GetProperty(kBuildFingerprintSysprop, "") << "\n";
+
+  std::vector<std::string> pre_installed;
+  for (const ApexFile& apex : instance.GetPreInstalledApexFiles()) {
+    pre_installed.push_back(apex.GetPath());
+  }
+  std::sort(pre_installed.begin(), pre_installed.end());
+  for (const auto& path : pre_installed) {
+    identity << "pre_installed " << path << "\n";
+  }
+
+  std::vector<std::string> dirs = gConfig->apex_built_in_dirs;
+  dirs.push_back(gConfig->active_apex_data_dir);
+  dirs.push_back(gConfig->decompression_dir);
+  for (const auto& dir : dirs) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) {
+      if (errno == ENOENT) {
+        identity << "missing " << dir << "\n";
+        continue;
+      }
+      return ErrnoError() << "Failed to stat " << dir;
+    }
+    identity << "dir " << dir << " " << st.st_mtime << "\n";
+    auto files = ReadDir(dir, [](const auto& entry) {
+      std::error_code ec;
+      return entry.is_regular_file(ec);
+    });
+    if (!files.ok()) {
+      return files.error();
+    }
+    std::sort(files->begin(), files->end());
+    for (const auto& file : *files) {
+      if (stat(file.c_str(), &st) != 0) {
+        return ErrnoError() << "Failed to stat " << file;
+      }
+      // ctime can't be set from userspace, so it catches content changes
+      // that preserve size and mtime.
+      identity << "file " << file << " " << st.st_ino << " " << st.st_size
+               << " " << st.st_mtime << " " << st.st_ctime << "\n";
+    }
+  }
+  return identity.str();
+}
+
+// The plan only records which APEXes were selected. Their signatures and
+// verity parameters are still checked when they are mounted, so a stale or
+// tampered plan can't get an APEX activated without verification.
+Result<void> WriteActivationPlan(const std::string& inputs_identity,
+                                 const std::vector<ApexFileRef>& plan) {
+  std::stringstream content;
+  content << inputs_identity << "--\n";
+  for (const ApexFile& apex : plan) {
+    content << apex.GetPath() << "\n";
+  }
+  const std::string tmp_file =
+      std::string(gConfig->activation_plan_file) + ".tmp";
+  if (!android::base::WriteStringToFile(content.str(), tmp_file)) {
+    return ErrnoError() << "Failed to write " << tmp_file;
+  }
+  if (rename(tmp_file.c_str(), gConfig->activation_plan_file) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_file << " to "
+                        << gConfig->activation_plan_file;
+  }
+  return {};
+}
+
+Result<std::vector<std::string>> ReadActivationPlan(
+    const std::string& inputs_identity) {
+  std::string content;
+  if (!android::base::ReadFileToString(gConfig->activation_plan_file,
+                                       &content)) {
+    return ErrnoError() << "Failed to read " << gConfig->activation_plan_file;
+  }
+  const std::string header = inputs_identity + "--\n";
+  if (!StartsWith(content, header)) {
+    return Error() << "Activation inputs changed since the plan was written";
+  }
+  std::vector<std::string> plan;
+  for (auto& path : android::base::Split(content.substr(header.size()), "\n")) {
+    if (!path.empty()) {
+      plan.push_back(std::move(path));
+    }
+  }
+  return plan;
+}
+
+void PrepareForShutdown() {
+  ATRACE_NAME("PrepareForShutdown");
+  WaitForBootCompletedCleanup();
+  ApexPinner::GetInstance().Shutdown();
+
+  // Session states are written without fsync. Sync the filesystems they live
+  // on, so that nothing is lost if the device goes down while apexd isn't
+  // running.
+  for (const auto& dir : {ApexSession::GetSessionsDir(),
+                          std::string(gConfig->active_apex_data_dir)}) {
+    unique_fd fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd.get() == -1 || syncfs(fd.get()) != 0) {
+      PLOG(WARNING) << "Failed to sync " << dir;
+    }
+  }
+}
+
+namespace {
+
+// Turns paths of a cached activation plan into ApexFiles. APEXes known to
+// |instance| are referenced directly; others (i.e. decompressed APEXes) are
+// opened and kept in |opened_apex|.
+Result<std::vector<ApexFileRef>> ResolveActivationPlan(
+    const std::vector<std::string>& plan, const ApexFileRepository& instance,
+    std::vector<ApexFile>* opened_apex) {
+  std::unordered_map<std::string, ApexFileRef> known_apex;
+  for (const auto& apex_list :
+       {instance.GetPreInstalledApexFiles(), instance.GetDataApexFiles()}) {
+    for (const ApexFile& apex : apex_list) {
+      known_apex.emplace(apex.GetPath(), std::cref(apex));
+    }
+  }
+  std::vector<std::string> unknown_paths;
+  for (const auto& path : plan) {
+    if (known_apex.count(path) == 0) {
+      unknown_paths.push_back(path);
+    }
+  }
+  for (const auto& path : unknown_paths) {
+    auto apex = ApexFile::Open(path);
+    if (!apex.ok()) {
+      return apex.error();
+    }
+    opened_apex->push_back(std::move(*apex));
+  }
+  // Only take references once |opened_apex| is not going to grow anymore.
+  for (const ApexFile& apex : *opened_apex) {
+    known_apex.emplace(apex.GetPath(), std::cref(apex));
+  }
+  std::vector<ApexFileRef> ret;
+  for (const auto& path : plan) {
+    ret.push_back(known_apex.at(path));
+  }
+  return ret;
+}
+
+// Selects APEXes to activate on boot from everything |instance| knows about,
+// and replaces compressed ones with their decompressed copies, which are kept
+// in |decompressed_apex|.
+std::vector<ApexFileRef> SelectApexForBoot(
+    const ApexFileRepository& instance,
+    std::vector<ApexFile>* decompressed_apex) {
+  decompressed_apex->clear();
+  // Group every ApexFile on device by name
+  const auto& all_apex = instance.AllApexFilesByName();
+  // There can be multiple APEX packages with package name X. Determine which
+  // one to activate.
+  // TODO(b/218672709): skip activation of sepolicy APEX during boot.
+  auto activation_list = SelectApexForActivation(all_apex, instance);
+
+  // Process compressed APEX, if any
+  std::vector<ApexFileRef> compressed_apex;
+  for (auto it = activation_list.begin(); it != activation_list.end();) {
+    if (it->get().IsCompressed()) {
+      compressed_apex.emplace_back(*it);
+      it = activation_list.erase(it);
+    } else {
+      it++;
+    }
+  }
+  if (!compressed_apex.empty()) {
+    *decompressed_apex =
+        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
+    for (const ApexFile& apex_file : *decompressed_apex) {
+      activation_list.emplace_back(std::cref(apex_file));
+    }
+  }
+  return activation_list;
+}
+
+// Unmounts every APEX of |apexes| that is mounted, so that a failed boot
+// activation can be redone from scratch.
+void DeactivateMountedApexes(const std::vector<ApexFileRef>& apexes) {
+  for (const ApexFile& apex : apexes) {
+    bool mounted = false;
+    gMountedApexes.ForallMountedApexes(
+        apex.GetManifest().name(),
+        [&](const MountedApexData& data, bool /* latest */) {
+          if (data.full_path == apex.GetPath()) {
+            mounted = true;
+          }
+        });
+    if (!mounted) {
+      continue;
+    }
+    if (auto st = UnmountPackage(apex, /* allow_latest= */ true,
+                                 /* deferred= */ false);
+        !st.ok()) {
+      LOG(ERROR) << "Failed to deactivate " << apex.GetPath() << " : "
+                 << st.error();
+    }
+  }
+}
+
+}  // namespace
+
 void OnStart() {
   ATRACE_NAME("OnStart");
   LOG(INFO) << "Marking APEXd as starting";
@@ -2982,36 +3942,62 @@ void OnStart() {
     LOG(ERROR) << "Failed to resume revert : " << status.error();
   }
 
-  // Group every ApexFile on device by name
   const auto& instance = ApexFileRepository::GetInstance();
-  const auto& all_apex = instance.AllApexFilesByName();
-  // There can be multiple APEX packages with package name X. Determine which
-  // one to activate.
-  // TODO(b/218672709): skip activation of sepolicy APEX during boot.
-  auto activation_list = SelectApexForActivation(all_apex, instance);
+  std::vector<ApexFileRef> activation_list;
+  std::vector<ApexFile> decompressed_apex;
 
-  // Process compressed APEX, if any
-  std::vector<ApexFileRef> compressed_apex;
-  for (auto it = activation_list.begin(); it != activation_list.end();) {
-    if (it->get().IsCompressed()) {
-      compressed_apex.emplace_back(*it);
-      it = activation_list.erase(it);
+  // On most boots nothing that selection depends on has changed, in which case
+  // the plan of the previous boot can be reused as is.
+  auto inputs_identity = GetActivationInputsIdentity(instance);
+  Result<std::vector<ApexFileRef>> cached_plan =
+      Error() << "Failed to identify activation inputs";
+  if (!inputs_identity.ok()) {
+    LOG(WARNING) << inputs_identity.error();
+  } else {
+    auto plan = ReadActivationPlan(*inputs_identity);
+    if (plan.ok()) {
+      cached_plan = ResolveActivationPlan(*plan, instance, &decompressed_apex);
     } else {
-      it++;
+      cached_plan = plan.error();
     }
   }
-  std::vector<ApexFile> decompressed_apex;
-  if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ false);
-    for (const ApexFile& apex_file : decompressed_apex) {
-      activation_list.emplace_back(std::cref(apex_file));
-    }
+  if (cached_plan.ok()) {
+    LOG(INFO) << "Reusing activation plan of the previous boot";
+    activation_list = std::move(*cached_plan);
+  } else {
+    LOG(INFO) << "Selecting APEXes for activation: " << cached_plan.error();
+    activation_list = SelectApexForBoot(instance, &decompressed_apex);
+  }
+  // Decompression changes the inputs, so the identity has to be taken again.
+  auto plan_identity = inputs_identity;
+  if (!cached_plan.ok()) {
+    plan_identity = GetActivationInputsIdentity(instance);
   }
 
   // TODO(b/179248390): activate parallelly if possible
   auto activate_status =
       ActivateApexPackages(activation_list, ActivationMode::kBootMode);
+  if (!activate_status.ok() && cached_plan.ok()) {
+    // The plan may have gone stale in a way the identity doesn't catch. Don't
+    // let it decide the fallback; select as if there was no plan. APEXes that
+    // did get activated from the plan are unmounted first, so that they can't
+    // end up mixed with the versions selected now.
+    LOG(WARNING) << "Failed to activate APEXes of the cached plan : "
+                 << activate_status.error();
+    DeactivateMountedApexes(activation_list);
+    activation_list = SelectApexForBoot(instance, &decompressed_apex);
+    plan_identity = GetActivationInputsIdentity(instance);
+    activate_status =
+        ActivateApexPackages(activation_list, ActivationMode::kBootMode);
+  }
+  if (activate_status.ok() && plan_identity.ok()) {
+    if (auto st = WriteActivationPlan(*plan_identity, activation_list);
+        !st.ok()) {
+      LOG(WARNING) << "Failed to persist activation plan : " << st.error();
+    }
+  } else if (!RemoveFileIfExists(gConfig->activation_plan_file)) {
+    LOG(WARNING) << "Failed to remove " << gConfig->activation_plan_file;
+  }
   if (!activate_status.ok()) {
     std::string error_message =
         StringPrintf("Failed to activate packages: %s",
@@ -3029,6 +4015,8 @@ void OnStart() {
     }
   }
 
+  RecordApexIoCheckpoint("activation");
+
   // Now that APEXes are mounted, snapshot or restore DE_sys data.
   SnapshotOrRestoreDeSysData();
 
@@ -3139,6 +4127,7 @@ Result<std::vector<ApexFile>> SubmitStagedSession(
   for (const auto& apex : ret) {
     // Release compressed blocks in case /data is f2fs-compressed filesystem.
     ReleaseF2fsCompressedBlocks(apex.GetPath());
+    PrepareVerityReadyApex(apex);
   }
 
   // The scope guard above uses lambda that captures ret by reference.
@@ -3196,7 +4185,7 @@ Result<void> MarkStagedSessionSuccessful(const int session_id) {
 }
 
 // Removes APEXes on /data that have not been activated
-void RemoveInactiveDataApex() {
+uint64_t RemoveInactiveDataApex() {
   std::vector<std::string> all_apex_files;
   Result<std::vector<std::string>> active_apex =
       FindFilesBySuffix(gConfig->active_apex_data_dir, {kApexPackageSuffix});
@@ -3219,14 +4208,148 @@ void RemoveInactiveDataApex() {
                           std::make_move_iterator(decompressed_apex->end()));
   }
 
+  uint64_t reclaimed = 0;
   for (const auto& path : all_apex_files) {
     if (!apexd_private::IsMounted(path)) {
       LOG(INFO) << "Removing inactive data APEX " << path;
-      if (unlink(path.c_str()) != 0) {
-        PLOG(ERROR) << "Failed to unlink inactive data APEX " << path;
+      auto bytes = UnlinkAndGetReclaimedBytes(path);
+      if (!bytes.ok()) {
+        LOG(ERROR) << "Failed to remove inactive data APEX : "
+                   << bytes.error();
+        continue;
       }
+      reclaimed += *bytes;
     }
   }
+  return reclaimed;
+}
+
+// Removes hashtrees that belong neither to a mounted APEX nor to an APEX of a
+// session that isn't finalized yet, and trims the hashtree store to its budget.
+Result<uint64_t> RemoveUnusedHashTrees() {
+  std::vector<std::string> in_use;
+  gMountedApexes.ForallMountedApexes(
+      [&](const std::string&, const MountedApexData& data, bool) {
+        auto apex = ApexFile::Open(data.full_path);
+        if (apex.ok()) {
+          in_use.push_back(GetPackageId(apex->GetManifest()));
+        }
+      });
+  // A session that is verified but not staged yet already has its new
+  // hashtrees, and one that is activated may still be reverted.
+  for (const auto& session : ApexSession::GetActiveSessions()) {
+    const auto& child_ids = session.GetChildSessionIds();
+    auto apexes = OpenSessionApexFiles(
+        session.GetId(), std::vector<int>(child_ids.begin(), child_ids.end()));
+    if (!apexes.ok()) {
+      // Without knowing which hashtrees the session needs, none can go.
+      return Error() << "Failed to get APEXes of session " << session.GetId()
+                     << " : " << apexes.error();
+    }
+    for (const auto& apex : *apexes) {
+      in_use.push_back(
+          std::filesystem::path(GetHashTreeFileName(apex, /* is_new= */ true))
+              .filename());
+      in_use.push_back(
+          std::filesystem::path(GetVerityReadyApexPath(apex)).filename());
+    }
+  }
+  auto reclaimed = RemoveObsoleteHashTrees(gConfig->apex_hash_tree_dir, in_use);
+  if (!reclaimed.ok()) {
+    return reclaimed.error();
+  }
+  // Hashtrees released above stay in the store for reinstalls and rollbacks,
+  // as long as they fit in the budget.
+  const uint64_t budget =
+      static_cast<uint64_t>(
+          android::sysprop::ApexProperties::hashtree_store_budget_kb()
+              .value_or(32768))
+      << 10;
+  auto collected = GetHashTreeStore().GarbageCollect(budget);
+  if (!collected.ok()) {
+    return collected.error();
+  }
+  return *reclaimed + *collected;
+}
+
+// Returns whether the device runs another build than the one the last OTA was
+// prepared on. Without a prepared OTA, there is nothing applied either.
+Result<bool> IsOtaApplied() {
+  std::string source_build;
+  if (!android::base::ReadFileToString(gConfig->ota_source_build_file,
+                                       &source_build)) {
+    if (errno == ENOENT) {
+      return false;
+    }
+    return ErrnoError() << "Failed to read " << gConfig->ota_source_build_file;
+  }
+  return source_build != GetProperty(kBuildFingerprintSysprop, "");
+}
+
+// Removes APEXes decompressed for an OTA that were not picked up when booting
+// into the build the OTA was applied to. Until the device runs another build
+// than the one the OTA was prepared on, they are kept for it to resume.
+Result<uint64_t> RemoveStaleOtaApex() {
+  auto applied = IsOtaApplied();
+  if (!applied.ok()) {
+    return applied.error();
+  }
+  if (!*applied) {
+    return 0;
+  }
+  auto ota_apex = FindFilesBySuffix(gConfig->decompression_dir,
+                                    {kOtaApexPackageSuffix});
+  if (!ota_apex.ok()) {
+    return ota_apex.error();
+  }
+  uint64_t reclaimed = 0;
+  for (const auto& path : *ota_apex) {
+    LOG(INFO) << "Removing stale OTA APEX " << path;
+    auto bytes = UnlinkAndGetReclaimedBytes(path);
+    if (!bytes.ok()) {
+      LOG(ERROR) << bytes.error();
+      continue;
+    }
+    reclaimed += *bytes;
+    RemoveFileIfExists(GetDecompressionCheckpointPath(path));
+  }
+  return reclaimed;
+}
+
+// Releases space reserved for decompressing CAPEXes that is left once the
+// device runs the build the OTA was applied to. Each module gives back its
+// reservation right before it is decompressed, so what is left was not needed:
+// the module reused an existing APEX or its .ota.apex, a newer data APEX was
+// selected instead, or processing failed. Until then the reservations are kept
+// for the OTA, and cancelling the OTA releases them. Runs after
+// RemoveStaleOtaApex, which needs the record of the OTA this drops.
+Result<uint64_t> ReleaseLeftoverReservedSpace() {
+  auto applied = IsOtaApplied();
+  if (!applied.ok()) {
+    return applied.error();
+  }
+  if (!*applied) {
+    return 0;
+  }
+  SpaceReservation reservation(gConfig->ota_reserved_dir);
+  auto ledger = reservation.GetLedger();
+  if (!ledger.ok()) {
+    return ledger.error();
+  }
+  uint64_t released = 0;
+  for (const auto& [module_name, size] : *ledger) {
+    LOG(INFO) << "Releasing " << size << " bytes left reserved for "
+              << module_name;
+    released += size;
+  }
+  if (auto st = reservation.ReleaseAll(); !st.ok()) {
+    return st.error();
+  }
+  if (!RemoveFileIfExists(gConfig->ota_source_build_file)) {
+    return ErrnoError() << "Failed to remove "
+                        << gConfig->ota_source_build_file;
+  }
+  return released;
 }
 
 bool IsApexDevice(const std::string& dev_name) {
@@ -3239,30 +4362,287 @@ bool IsApexDevice(const std::string& dev_name) {
   return false;
 }
 
-// TODO(b/192241176): move to apexd_verity.{h,cpp}.
 void DeleteUnusedVerityDevices() {
+  ATRACE_NAME("DeleteUnusedVerityDevices");
   DeviceMapper& dm = DeviceMapper::Instance();
   std::vector<DeviceMapper::DmBlockDevice> all_devices;
   if (!dm.GetAvailableDevices(&all_devices)) {
     LOG(WARNING) << "Failed to fetch dm devices";
     return;
   }
+  std::vector<std::string> unused;
   for (const auto& dev : all_devices) {
     auto state = dm.GetState(dev.name());
     if (state == DmDeviceState::SUSPENDED && IsApexDevice(dev.name())) {
       LOG(INFO) << "Deleting unused dm device " << dev.name();
-      auto res = DeleteVerityDevice(dev.name(), /* deferred= */ false);
-      if (!res.ok()) {
-        LOG(WARNING) << res.error();
-      }
+      unused.push_back(dev.name());
     }
   }
+  if (unused.empty()) {
+    return;
+  }
+  // Nothing needs the devices to be gone before boot completes, so removals
+  // are deferred rather than waiting for the uevent of each device in turn.
+  if (auto res = DeleteDmDevices(unused); !res.ok()) {
+    LOG(WARNING) << res.error();
+  }
+}
+
+// Records which parts of the active APEXes were read during boot, so that the
+// next boot can prefetch them right after mounting. A profile is recorded once
+// per APEX version; profiles of APEXes that are no longer active are removed.
+void RecordPrefetchProfiles() {
+  if (!IsPrefetchEnabled()) {
+    return;
+  }
+  ATRACE_NAME("RecordPrefetchProfiles");
+  if (auto st = CreateDirIfNeeded(kApexPrefetchDir, 0700); !st.ok()) {
+    LOG(ERROR) << st.error();
+    return;
+  }
+
+  std::vector<MountedApexData> active;
+  gMountedApexes.ForallMountedApexes(
+      [&](const std::string&, const MountedApexData& data, bool latest) {
+        if (latest) {
+          active.push_back(data);
+        }
+      });
+
+  std::unordered_set<std::string> profiles;
+  for (const auto& data : active) {
+    auto apex = ApexFile::Open(data.full_path);
+    if (!apex.ok()) {
+      LOG(WARNING) << apex.error();
+      continue;
+    }
+    auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+    if (!verity_data.ok()) {
+      LOG(WARNING) << verity_data.error();
+      continue;
+    }
+    const std::string path = GetPrefetchProfilePath(
+        kApexPrefetchDir, GetPackageId(apex->GetManifest()));
+    profiles.insert(path);
+    if (ReadPrefetchProfile(path, verity_data->root_digest).ok()) {
+      continue;
+    }
+    auto profile =
+        RecordPrefetchProfile(data.mount_point, verity_data->root_digest);
+    if (!profile.ok()) {
+      LOG(WARNING) << profile.error();
+      continue;
+    }
+    if (auto st = WritePrefetchProfile(path, *profile); !st.ok()) {
+      LOG(WARNING) << st.error();
+      continue;
+    }
+    LOG(INFO) << "Recorded " << profile->extents.size()
+              << " prefetch extents for " << data.full_path;
+  }
+
+  auto stale = ReadDir(kApexPrefetchDir, [&](const auto& entry) {
+    return profiles.count(entry.path()) == 0;
+  });
+  if (!stale.ok()) {
+    LOG(WARNING) << stale.error();
+    return;
+  }
+  for (const auto& path : *stale) {
+    if (!RemoveFileIfExists(path)) {
+      LOG(WARNING) << "Failed to delete stale prefetch profile " << path;
+    }
+  }
+}
+
+// Cleanup at boot completion removes inactive files from the APEX
+// directories, which would invalidate the activation plan of this boot even
+// though the set of active APEXes stays the same. Re-take the identity of the
+// inputs so that the plan can be reused on the next boot.
+void RefreshActivationPlan() {
+  std::string content;
+  if (!android::base::ReadFileToString(gConfig->activation_plan_file,
+                                       &content)) {
+    return;
+  }
+  auto pos = content.find("\n--\n");
+  if (pos == std::string::npos) {
+    return;
+  }
+  const auto& instance = ApexFileRepository::GetInstance();
+  std::vector<ApexFile> opened_apex;
+  auto plan = ResolveActivationPlan(
+      android::base::Split(android::base::Trim(content.substr(pos + 4)), "\n"),
+      instance, &opened_apex);
+  auto identity = GetActivationInputsIdentity(instance);
+  if (!plan.ok() || !identity.ok()) {
+    // Something in the plan is gone; let the next boot select from scratch.
+    RemoveFileIfExists(gConfig->activation_plan_file);
+    return;
+  }
+  if (auto st = WriteActivationPlan(*identity, *plan); !st.ok()) {
+    LOG(WARNING) << "Failed to refresh activation plan : " << st.error();
+  }
+}
+
+std::vector<MountedApexData> GetMountedApexLoopIoModes() {
+  std::vector<MountedApexData> ret;
+  gMountedApexes.ForallMountedApexes([&](const std::string& /* package */,
+                                         const MountedApexData& data,
+                                         bool /* latest */) {
+    if (data.is_temp_mount || data.loop_name.empty()) {
+      return;
+    }
+    MountedApexData copy = data;
+    // The kernel may change the mode after the device was set up, and APEXes
+    // mounted by a previous instance of apexd have no recorded mode.
+    if (auto dio = loop::IsDirectIoEnabled(data.loop_name); dio.ok()) {
+      if (!*dio && copy.loop_buffered_reason.empty()) {
+        copy.loop_buffered_reason = "unknown";
+      }
+      copy.loop_direct_io = *dio;
+    }
+    ret.push_back(std::move(copy));
+  });
+  return ret;
+}
+
+std::vector<ApexIoSample> SampleApexIoStats() {
+  ATRACE_NAME("SampleApexIoStats");
+  DeviceMapper& dm = DeviceMapper::Instance();
+  std::vector<ApexIoSample> samples;
+  gMountedApexes.ForallMountedApexes([&](const std::string& package,
+                                         const MountedApexData& data,
+                                         bool /* latest */) {
+    if (data.is_temp_mount) {
+      return;
+    }
+    // Reads through dm-verity also show up on the loop device below it, so
+    // only the top-most device is sampled.
+    std::string dev_path = data.loop_name;
+    if (!data.device_name.empty() &&
+        !dm.GetDmDevicePathByName(data.device_name, &dev_path)) {
+      LOG(WARNING) << "Failed to get path of dm device " << data.device_name;
+      return;
+    }
+    ApexIoSample sample;
+    sample.apex_name = package;
+    sample.full_path = data.full_path;
+    sample.block_device = android::base::Basename(dev_path);
+    auto stats = ReadBlockIoStats(sample.block_device);
+    if (!stats.ok()) {
+      LOG(WARNING) << stats.error();
+      return;
+    }
+    sample.stats = *stats;
+    samples.push_back(std::move(sample));
+  });
+  return samples;
+}
+
+void RecordApexIoCheckpoint(const std::string& label) {
+  ApexIoAccounting::GetInstance().AddCheckpoint(label, SampleApexIoStats());
 }
 
 void BootCompletedCleanup() {
-  RemoveInactiveDataApex();
-  ApexSession::DeleteFinalizedSessions();
-  DeleteUnusedVerityDevices();
+  RecordApexIoCheckpoint("boot-completed");
+  // Boot completion is when apps start launching, so the cleanup is done in
+  // the background at idle priority. Tasks run in the order they are posted.
+  auto& executor = MaintenanceExecutor::GetInstance();
+  executor.Post("RemoveInactiveDataApex", []() -> Result<uint64_t> {
+    return RemoveInactiveDataApex();
+  });
+  executor.Post("RefreshActivationPlan", []() -> Result<uint64_t> {
+    RefreshActivationPlan();
+    return 0;
+  });
+  executor.Post("DeleteFinalizedSessions", []() -> Result<uint64_t> {
+    ApexSession::DeleteFinalizedSessions();
+    return 0;
+  });
+  executor.Post("DeleteUnusedVerityDevices", []() -> Result<uint64_t> {
+    DeleteUnusedVerityDevices();
+    return 0;
+  });
+  executor.Post("RemoveUnusedHashTrees", RemoveUnusedHashTrees);
+  executor.Post("RemoveStaleOtaApex", RemoveStaleOtaApex);
+  executor.Post("ReleaseLeftoverReservedSpace", ReleaseLeftoverReservedSpace);
+  executor.Post("RecordPrefetchProfiles", []() -> Result<uint64_t> {
+    RecordPrefetchProfiles();
+    return 0;
+  });
+  if (android::sysprop::ApexProperties::trim_memory_after_boot().value_or(
+          true)) {
+    // Last, so that it also returns what the other tasks freed.
+    executor.Post("TrimMemory", []() -> Result<uint64_t> {
+      TrimMemory();
+      return 0;
+    });
+  }
+}
+
+void TrimMemory() {
+  auto before = ReadMemoryUsage();
+  if (!before.ok()) {
+    LOG(WARNING) << before.error();
+  }
+  TrimHeap();
+  auto after = ReadMemoryUsage();
+  if (!after.ok()) {
+    LOG(WARNING) << after.error();
+    return;
+  }
+  auto& accounting = MemoryAccounting::GetInstance();
+  if (before.ok()) {
+    accounting.AddCheckpoint("before-trim", *before);
+    LOG(INFO) << "Trimmed memory: RSS " << before->rss_kb << " kB -> "
+              << after->rss_kb << " kB";
+  }
+  accounting.AddCheckpoint("after-trim", *after);
+}
+
+void WaitForBootCompletedCleanup() {
+  MaintenanceExecutor::GetInstance().WaitForIdle();
+}
+
+bool PinBootCriticalApexes(std::function<void()> on_release) {
+  const std::string names =
+      android::sysprop::ApexProperties::pinned_apexes().value_or("");
+  if (names.empty()) {
+    return false;
+  }
+  ATRACE_NAME("PinBootCriticalApexes");
+  std::vector<ApexPinner::PinTarget> targets;
+  for (const auto& name : android::base::Split(names, ",")) {
+    auto data = gMountedApexes.GetLatestMountedApex(name);
+    if (!data.has_value()) {
+      LOG(WARNING) << "Not pinning " << name << " : not active";
+      continue;
+    }
+    targets.push_back({name, data->mount_point});
+  }
+  // The budget is configured in KiB.
+  const uint64_t budget =
+      static_cast<uint64_t>(
+          android::sysprop::ApexProperties::pin_budget_kb().value_or(16384))
+      << 10;
+  auto& pinner = ApexPinner::GetInstance();
+  if (auto st = pinner.Pin(targets, budget); !st.ok()) {
+    LOG(ERROR) << "Failed to pin APEXes : " << st.error();
+    return false;
+  }
+  if (pinner.GetPinnedBytes() == 0) {
+    return false;
+  }
+  if (auto st = pinner.StartMemoryPressureMonitor(std::move(on_release));
+      !st.ok()) {
+    // Without a way to learn about memory pressure, pinned pages could starve
+    // the rest of the system.
+    LOG(ERROR) << "Releasing pinned APEXes : " << st.error();
+    pinner.ReleaseAll();
+    return false;
+  }
+  return true;
 }
 
 int UnmountAll() {
@@ -3347,6 +4727,11 @@ bool ShouldAllocateSpaceForDecompression(const std::string& new_apex_name,
   if (!instance.HasDataVersion(new_apex_name)) {
     // Data apex doesn't exist. Compare against pre-installed APEX
     auto pre_installed_apex = instance.GetPreInstalledApex(new_apex_name);
+    if (pre_installed_apex.get().IsNativelyCompressed() &&
+        pre_installed_apex.get().GetManifest().version() == new_apex_version) {
+      // Same natively compressed APEX, which is mounted without decompression.
+      return false;
+    }
     if (!pre_installed_apex.get().IsCompressed()) {
       // Compressing an existing uncompressed system APEX.
       return true;
@@ -3373,24 +4758,40 @@ bool ShouldAllocateSpaceForDecompression(const std::string& new_apex_name,
   return new_apex_version > data_version;
 }
 
-int64_t CalculateSizeForCompressedApex(
+std::map<std::string, int64_t> CalculateReservationsForCompressedApex(
     const std::vector<std::tuple<std::string, int64_t, int64_t>>&
         compressed_apexes,
     const ApexFileRepository& instance) {
-  int64_t result = 0;
+  std::map<std::string, int64_t> result;
   for (const auto& compressed_apex : compressed_apexes) {
     std::string module_name;
     int64_t version_code;
     int64_t decompressed_size;
     std::tie(module_name, version_code, decompressed_size) = compressed_apex;
+    if (decompressed_size == 0) {
+      // Natively compressed APEXes are mounted without decompression.
+      continue;
+    }
     if (ShouldAllocateSpaceForDecompression(module_name, version_code,
                                             instance)) {
-      result += decompressed_size;
+      result[module_name] += decompressed_size;
     }
   }
   return result;
 }
 
+int64_t CalculateSizeForCompressedApex(
+    const std::vector<std::tuple<std::string, int64_t, int64_t>>&
+        compressed_apexes,
+    const ApexFileRepository& instance) {
+  int64_t result = 0;
+  for (const auto& [module_name, size] :
+       CalculateReservationsForCompressedApex(compressed_apexes, instance)) {
+    result += size;
+  }
+  return result;
+}
+
 void CollectApexInfoList(std::ostream& os,
                          const std::vector<ApexFile>& active_apexs,
                          const std::vector<ApexFile>& inactive_apexs) {
@@ -3434,13 +4835,16 @@ void CollectApexInfoList(std::ostream& os,
   com::android::apex::write(os, apex_info_list);
 }
 
-// Reserve |size| bytes in |dest_dir| by creating a zero-filled file.
-// Also, we always clean up ota_apex that has been processed as
-// part of pre-reboot decompression whenever we reserve space.
-Result<void> ReserveSpaceForCompressedApex(int64_t size,
-                                           const std::string& dest_dir) {
-  if (size < 0) {
-    return Error() << "Cannot reserve negative byte of space";
+// Reserve space in |dest_dir| for decompressing each module in
+// |reservations| after the OTA. Also, we always clean up ota_apex that has
+// been processed as part of pre-reboot decompression whenever we reserve space.
+Result<void> ReserveSpaceForCompressedApex(
+    const std::map<std::string, int64_t>& reservations,
+    const std::string& dest_dir) {
+  for (const auto& [module_name, size] : reservations) {
+    if (size < 0) {
+      return Error() << "Cannot reserve negative byte of space";
+    }
   }
 
   // Since we are reserving space, then we must be preparing for a new OTA.
@@ -3452,36 +4856,43 @@ Result<void> ReserveSpaceForCompressedApex(int64_t size,
   }
   for (const std::string& ota_apex : *ota_apex_files) {
     RemoveFileIfExists(ota_apex);
+    RemoveFileIfExists(GetDecompressionCheckpointPath(ota_apex));
   }
 
-  auto file_path = StringPrintf("%s/full.tmp", dest_dir.c_str());
-  if (size == 0) {
+  SpaceReservation reservation(dest_dir);
+  if (reservations.empty()) {
     LOG(INFO) << "Cleaning up reserved space for compressed APEX";
     // Ota is being cancelled. Clean up reserved space
-    RemoveFileIfExists(file_path);
-    return {};
+    if (!RemoveFileIfExists(gConfig->ota_source_build_file)) {
+      LOG(ERROR) << "Failed to remove " << gConfig->ota_source_build_file;
+    }
+    return reservation.ReleaseAll();
   }
-
-  LOG(INFO) << "Reserving " << size << " bytes for compressed APEX";
-  unique_fd dest_fd(
-      open(file_path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0644));
-  if (dest_fd.get() == -1) {
-    return ErrnoError() << "Failed to open file for reservation "
-                        << file_path.c_str();
+  if (auto st = reservation.Reserve(reservations); !st.ok()) {
+    return st.error();
   }
-
-  // Resize to required size
-  std::error_code ec;
-  std::filesystem::resize_file(file_path, size, ec);
-  if (ec) {
-    RemoveFileIfExists(file_path);
-    return ErrnoError() << "Failed to resize file " << file_path.c_str()
-                        << " : " << ec.message();
+  // Tells the boot into the new build apart from boots before the OTA is
+  // applied, which must keep what was prepared for it.
+  if (!android::base::WriteStringToFile(
+          GetProperty(kBuildFingerprintSysprop, ""),
+          gConfig->ota_source_build_file)) {
+    return ErrnoError() << "Failed to write " << gConfig->ota_source_build_file;
   }
-
   return {};
 }
 
+// Reserve |size| bytes in |dest_dir| for compressed APEX, without knowing
+// which modules they are for.
+Result<void> ReserveSpaceForCompressedApex(int64_t size,
+                                           const std::string& dest_dir) {
+  if (size == 0) {
+    return ReserveSpaceForCompressedApex(std::map<std::string, int64_t>{},
+                                         dest_dir);
+  }
+  return ReserveSpaceForCompressedApex(
+      {{SpaceReservation::kUnattributed, size}}, dest_dir);
+}
+
 // Adds block apexes if system property is set.
 Result<int> AddBlockApex(ApexFileRepository& instance) {
   auto prop = GetProperty(gConfig->vm_payload_metadata_partition_prop, "");
@@ -3594,8 +5005,35 @@ int OnOtaChrootBootstrap() {
   }
   std::vector<ApexFile> decompressed_apex;
   if (!compressed_apex.empty()) {
-    decompressed_apex =
-        ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ true);
+    // Decompression for an OTA happens while the device is in use, so it
+    // runs at background priority and can be paused with SIGSTOP/SIGCONT, or
+    // stopped with SIGTERM and resumed by running otapreopt_chroot again.
+    gStopOtaDecompression = false;
+    auto previous_handler =
+        signal(SIGTERM, [](int) { gStopOtaDecompression = true; });
+    std::thread decompression_thread([&]() {
+      const int nice_level =
+          android::sysprop::ApexProperties::ota_decompression_nice().value_or(
+              10);
+      if (auto st = SetCurrentThreadBackgroundPriority(nice_level); !st.ok()) {
+        LOG(WARNING) << st.error();
+      }
+      decompressed_apex =
+          ProcessCompressedApex(compressed_apex, /* is_ota_chroot= */ true);
+    });
+    decompression_thread.join();
+    signal(SIGTERM, previous_handler);
+    if (gStopOtaDecompression) {
+      LOG(INFO) << "Decompression of compressed APEX was stopped";
+      return 1;
+    }
+    // Progress is only of interest while decompression is under way.
+    const std::string progress_file =
+        StringPrintf("%s/%s", gConfig->decompression_dir,
+                     kOtaDecompressionProgressFilename);
+    if (!RemoveFileIfExists(progress_file)) {
+      LOG(WARNING) << "Failed to remove " << progress_file;
+    }
 
     for (const ApexFile& apex_file : decompressed_apex) {
       activation_list.emplace_back(std::cref(apex_file));
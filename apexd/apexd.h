@@ -20,6 +20,9 @@
 #include <android-base/macros.h>
 #include <android-base/result.h>
 
+#include <chrono>
+#include <functional>
+#include <map>
 #include <ostream>
 #include <string>
 #include <vector>
@@ -29,6 +32,7 @@
 #include "apex_database.h"
 #include "apex_file.h"
 #include "apex_file_repository.h"
+#include "apexd_io_stats.h"
 #include "apexd_session.h"
 
 namespace android {
@@ -56,6 +60,10 @@ struct ApexdConfig {
   // and the subsequent numbers should point APEX files.
   const char* vm_payload_metadata_partition_prop;
   const char* active_apex_selinux_ctx;
+  // Where the activation plan of the previous boot is persisted.
+  const char* activation_plan_file;
+  // Where the build an OTA is being prepared on is recorded.
+  const char* ota_source_build_file;
 };
 
 static const ApexdConfig kDefaultConfig = {
@@ -69,6 +77,8 @@ static const ApexdConfig kDefaultConfig = {
     kMetadataSepolicyStagedDir,
     kVmPayloadMetadataPartitionProp,
     "u:object_r:staging_data_file",
+    kActivationPlanFile,
+    kOtaSourceBuildFile,
 };
 
 class CheckpointInterface;
@@ -146,6 +156,10 @@ void Initialize(CheckpointInterface* checkpoint_service);
 // Initializes data apex as in-memory state. Should be called only if we are
 // not booting, since initialization timing is different when booting
 void InitializeDataApex();
+// Called when apexservice has no clients left after boot, before apexd exits.
+// Waits for maintenance to finish and makes sure all state apexd persists is
+// on disk.
+void PrepareForShutdown();
 // Migrates sessions from /data/apex/session to /metadata/session.i
 // Must only be called during boot (i.e apexd.status is not "ready" or
 // "activated").
@@ -153,7 +167,23 @@ android::base::Result<void> MigrateSessionsDirIfNeeded();
 // Apex activation logic. Scans staged apex sessions and activates apexes.
 // Must only be called during boot (i.e apexd.status is not "ready" or
 // "activated").
+// Every selected APEX is activated before apexd.status becomes "activated":
+// init imports APEX rc files and linkerconfig runs on that signal, and nothing
+// blocks on a path under /apex that isn't mounted yet, so no APEX can be
+// activated after it.
 void OnStart();
+// Returns a description of everything SelectApexForActivation and
+// ProcessCompressedApex depend on: the build, the pre-installed APEXes chosen
+// by |instance| and the identity (inode, size, mtime, ctime) of every file in
+// the APEX directories. Exposed for unit tests.
+android::base::Result<std::string> GetActivationInputsIdentity(
+    const ApexFileRepository& instance);
+android::base::Result<void> WriteActivationPlan(
+    const std::string& inputs_identity, const std::vector<ApexFileRef>& plan);
+// Returns paths of the APEXes in the persisted activation plan, or an error if
+// it was computed for different inputs.
+android::base::Result<std::vector<std::string>> ReadActivationPlan(
+    const std::string& inputs_identity);
 // For every package X, there can be at most two APEX, pre-installed vs
 // installed on data. We decide which ones should be activated and return them
 // as a list
@@ -162,6 +192,31 @@ std::vector<ApexFileRef> SelectApexForActivation(
     const ApexFileRepository& instance);
 std::vector<ApexFile> ProcessCompressedApex(
     const std::vector<ApexFileRef>& compressed_apex, bool is_ota_chroot);
+
+// What activating a single APEX on the next boot would take, as predicted by
+// PlanActivation().
+struct ApexActivationPlanEntry {
+  std::string name;
+  std::string path;
+  int64_t version = 0;
+  bool is_pre_installed = false;
+  // Why this file was selected for its module.
+  std::string reason;
+  bool needs_decompression = false;
+  bool needs_hashtree = false;
+  // Human readable details, e.g. which existing files would be reused.
+  std::vector<std::string> notes;
+  uint64_t bytes_to_read = 0;
+  uint64_t bytes_to_decompress = 0;
+  uint64_t bytes_to_hash = 0;
+  std::chrono::microseconds estimated_cost{0};
+};
+// Scans pre-installed, data and staged APEXes and selects which ones to
+// activate the way the next boot would, without mounting or decompressing
+// anything.
+android::base::Result<std::vector<ApexActivationPlanEntry>> PlanActivation();
+std::string FormatActivationPlanEntries(
+    const std::vector<ApexActivationPlanEntry>& plan);
 // Validate |apex| is same as |capex|
 android::base::Result<void> ValidateDecompressedApex(const ApexFile& capex,
                                                      const ApexFile& apex);
@@ -177,8 +232,36 @@ void OnAllPackagesActivated(bool is_bootstrap);
 void OnAllPackagesReady();
 void OnBootCompleted();
 // Exposed for testing
-void RemoveInactiveDataApex();
+// Returns data of all mounted APEXes, with the current I/O mode of their loop
+// devices.
+std::vector<MountedApexDatabase::MountedApexData> GetMountedApexLoopIoModes();
+// Samples read I/O stats of the block device of each mounted APEX.
+std::vector<ApexIoSample> SampleApexIoStats();
+// Stores a sample of I/O stats of all mounted APEXes under |label|.
+void RecordApexIoCheckpoint(const std::string& label);
+
+// Returns the number of bytes reclaimed.
+uint64_t RemoveInactiveDataApex();
+// Removes APEXes decompressed for an OTA once the device runs the build the OTA
+// was applied to. Returns the number of bytes reclaimed.
+android::base::Result<uint64_t> RemoveStaleOtaApex();
+// Releases the space reserved for an OTA once the device runs the build the OTA
+// was applied to. Returns the number of bytes released.
+android::base::Result<uint64_t> ReleaseLeftoverReservedSpace();
+// Schedules cleanup after boot completes on a low priority background thread.
 void BootCompletedCleanup();
+// Blocks until the cleanup scheduled by BootCompletedCleanup is done.
+void WaitForBootCompletedCleanup();
+// Returns free heap pages to the kernel, recording apexd's memory usage before
+// and after. Nothing is dropped: the repository still serves the binder
+// service after boot. Runs as the last step of BootCompletedCleanup unless
+// apexd.config.trim_memory_after_boot is false.
+void TrimMemory();
+// Locks hot pages of the APEXes listed in apexd.config.pin.apexes in memory.
+// |on_release| is called if the pins are later dropped due to memory pressure.
+// Returns true if anything was pinned; the caller must then keep the process
+// alive for the pins to have an effect.
+bool PinBootCriticalApexes(std::function<void()> on_release);
 int SnapshotOrRestoreDeUserData();
 
 int UnmountAll();
@@ -195,6 +278,13 @@ bool ShouldAllocateSpaceForDecompression(const std::string& new_apex_name,
                                          int64_t new_apex_version,
                                          const ApexFileRepository& instance);
 
+// Returns the space to reserve for decompressing each module in
+// |compressed_apexes| after an OTA.
+std::map<std::string, int64_t> CalculateReservationsForCompressedApex(
+    const std::vector<std::tuple<std::string, int64_t, int64_t>>&
+        compressed_apexes,
+    const ApexFileRepository& instance);
+
 int64_t CalculateSizeForCompressedApex(
     const std::vector<std::tuple<std::string, int64_t, int64_t>>&
         compressed_apexes,
@@ -204,10 +294,17 @@ void CollectApexInfoList(std::ostream& os,
                          const std::vector<ApexFile>& active_apexs,
                          const std::vector<ApexFile>& inactive_apexs);
 
-// Reserve |size| bytes in |dest_dir| by creating a zero-filled file
+// Reserve |size| bytes in |dest_dir| by creating a file with allocated blocks
 android::base::Result<void> ReserveSpaceForCompressedApex(
     int64_t size, const std::string& dest_dir);
 
+// Reserve space in |dest_dir| for each module in |reservations|, to be
+// released right before that module is decompressed. An empty map releases
+// all reserved space.
+android::base::Result<void> ReserveSpaceForCompressedApex(
+    const std::map<std::string, int64_t>& reservations,
+    const std::string& dest_dir);
+
 // Entry point when running in the VM mode (with --vm arg)
 int OnStartInVmMode();
 
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_concurrency.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <sched.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+
+using android::base::ConsumePrefix;
+using android::base::Error;
+using android::base::ErrnoError;
+using android::base::ParseInt;
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Result;
+using android::base::Split;
+using android::base::StringPrintf;
+using android::base::Trim;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+static constexpr const char* kIoPressureFile = "/proc/pressure/io";
+static constexpr uint32_t kMaxCpuCapacity = 1024;
+// Fraction of wall time all tasks may be stalled on I/O before storage is
+// considered saturated.
+static constexpr double kSaturatedIoStall = 0.5;
+// Below this fraction there is room for more I/O in flight.
+static constexpr double kIdleIoStall = 0.1;
+// An increase has to improve throughput by at least this much to be kept.
+static constexpr double kMinThroughputGain = 1.05;
+
+}  // namespace
+
+Result<std::vector<int>> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  for (const auto& range : Split(Trim(list), ",")) {
+    if (range.empty()) {
+      continue;
+    }
+    auto bounds = Split(range, "-");
+    int first, last;
+    if (bounds.size() > 2 || !ParseInt(bounds[0], &first, 0) ||
+        !ParseInt(bounds.back(), &last, first)) {
+      return Error() << "Malformed CPU list \"" << list << "\"";
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+Result<std::vector<CpuCapacity>> GetOnlineCpuCapacities(
+    const std::string& sysfs_cpu_dir) {
+  std::string online;
+  const std::string online_file = sysfs_cpu_dir + "/online";
+  if (!ReadFileToString(online_file, &online)) {
+    return ErrnoError() << "Failed to read " << online_file;
+  }
+  auto cpus = ParseCpuList(online);
+  if (!cpus.ok()) {
+    return cpus.error();
+  }
+  std::vector<CpuCapacity> ret;
+  for (int cpu : *cpus) {
+    uint32_t capacity = kMaxCpuCapacity;
+    std::string content;
+    const std::string capacity_file =
+        StringPrintf("%s/cpu%d/cpu_capacity", sysfs_cpu_dir.c_str(), cpu);
+    if (ReadFileToString(capacity_file, &content) &&
+        !ParseUint(Trim(content), &capacity)) {
+      LOG(WARNING) << "Ignoring malformed " << capacity_file;
+      capacity = kMaxCpuCapacity;
+    }
+    ret.push_back({cpu, capacity});
+  }
+  if (ret.empty()) {
+    return Error() << "No online CPUs in " << online_file;
+  }
+  return ret;
+}
+
+std::vector<int> GetPerformanceCpus(const std::vector<CpuCapacity>& cpus) {
+  uint32_t max_capacity = 0;
+  uint32_t min_capacity = UINT32_MAX;
+  for (const auto& cpu : cpus) {
+    max_capacity = std::max(max_capacity, cpu.capacity);
+    min_capacity = std::min(min_capacity, cpu.capacity);
+  }
+  std::vector<int> ret;
+  if (max_capacity == min_capacity) {
+    return ret;
+  }
+  for (const auto& cpu : cpus) {
+    if (cpu.capacity == max_capacity) {
+      ret.push_back(cpu.cpu);
+    }
+  }
+  return ret;
+}
+
+size_t ComputeInitialWorkerCount(const std::vector<CpuCapacity>& cpus,
+                                 size_t task_count, size_t max_workers) {
+  uint64_t total_capacity = 0;
+  uint32_t max_capacity = 0;
+  for (const auto& cpu : cpus) {
+    total_capacity += cpu.capacity;
+    max_capacity = std::max(max_capacity, cpu.capacity);
+  }
+  size_t workers =
+      max_capacity == 0 ? 1 : total_capacity / max_capacity / 2;
+  workers = std::max(workers, size_t{1});
+  if (max_workers != 0) {
+    workers = std::min(workers, max_workers);
+  }
+  return std::max(std::min(workers, task_count), size_t{1});
+}
+
+Result<uint64_t> ReadIoFullStallUs() {
+  std::string content;
+  if (!ReadFileToString(kIoPressureFile, &content)) {
+    return ErrnoError() << "Failed to read " << kIoPressureFile;
+  }
+  for (auto& line : Split(content, "\n")) {
+    if (!ConsumePrefix(&line, "full ")) {
+      continue;
+    }
+    for (auto& field : Split(line, " ")) {
+      uint64_t total;
+      if (ConsumePrefix(&field, "total=") && ParseUint(field, &total)) {
+        return total;
+      }
+    }
+  }
+  return Error() << "No full stall total in " << kIoPressureFile;
+}
+
+ActivationConcurrencyController::ActivationConcurrencyController(
+    Options options)
+    : options_(std::move(options)),
+      limit_(std::clamp(options_.initial_workers, size_t{1},
+                        std::max(options_.max_workers, size_t{1}))),
+      window_start_(std::chrono::steady_clock::now()) {
+  if (options_.max_workers <= 1) {
+    return;
+  }
+  if (auto stall = options_.read_io_stall_us(); stall.ok()) {
+    window_start_stall_us_ = *stall;
+    has_stall_us_ = true;
+  } else {
+    LOG(VERBOSE) << "I/O pressure is not available: " << stall.error();
+  }
+  LOG(INFO) << "Activation concurrency: starting with " << limit_ << " of "
+            << options_.max_workers << " workers";
+  ATRACE_INT("apexd_activation_workers", limit_);
+}
+
+void ActivationConcurrencyController::OnWorkerStart() {
+  if (options_.pin_cpus.empty()) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : options_.pin_cpus) {
+    CPU_SET(cpu, &set);
+  }
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    PLOG(WARNING) << "Failed to pin activation worker to performance CPUs";
+  }
+}
+
+bool ActivationConcurrencyController::WaitForSlot(size_t index) {
+  std::unique_lock lock(mutex_);
+  cv_.wait(lock, [&] { return finished_ || index < limit_; });
+  return !finished_;
+}
+
+void ActivationConcurrencyController::ReportCompletion(
+    std::chrono::nanoseconds latency) {
+  if (options_.max_workers <= 1) {
+    return;
+  }
+  std::lock_guard lock(mutex_);
+  window_completions_++;
+  window_latency_ += latency;
+  if (window_completions_ >= std::max(limit_, size_t{2})) {
+    AdjustLocked(std::chrono::steady_clock::now());
+  }
+}
+
+void ActivationConcurrencyController::Finish() {
+  {
+    std::lock_guard lock(mutex_);
+    finished_ = true;
+  }
+  cv_.notify_all();
+}
+
+size_t ActivationConcurrencyController::GetLimit() const {
+  std::lock_guard lock(mutex_);
+  return limit_;
+}
+
+void ActivationConcurrencyController::AdjustLocked(
+    std::chrono::steady_clock::time_point now) {
+  using namespace std::chrono;
+  const double elapsed_us =
+      std::max<double>(duration_cast<microseconds>(now - window_start_).count(),
+                       1);
+  double io_stall = 0;
+  if (has_stall_us_) {
+    auto stall = options_.read_io_stall_us();
+    if (stall.ok()) {
+      io_stall = (*stall - window_start_stall_us_) / elapsed_us;
+      window_start_stall_us_ = *stall;
+    }
+  }
+  const double throughput = window_completions_ * 1e6 / elapsed_us;
+  const auto mean_latency =
+      duration_cast<milliseconds>(window_latency_ / window_completions_);
+  const std::string stats =
+      StringPrintf("io stall %.0f%%, %.1f APEXes/s, mean latency %lldms",
+                   io_stall * 100, throughput,
+                   static_cast<long long>(mean_latency.count()));
+
+  const bool was_increase = last_change_was_increase_;
+  last_change_was_increase_ = false;
+  if (io_stall >= kSaturatedIoStall && limit_ > 1) {
+    SetLimitLocked(limit_ - 1, "storage is saturated (" + stats + ")");
+  } else if (was_increase &&
+             throughput < last_throughput_ * kMinThroughputGain &&
+             limit_ > 1) {
+    increases_frozen_ = true;
+    SetLimitLocked(limit_ - 1,
+                   "last increase didn't improve throughput (" + stats + ")");
+  } else if (!increases_frozen_ && io_stall < kIdleIoStall &&
+             limit_ < options_.max_workers) {
+    last_change_was_increase_ = true;
+    SetLimitLocked(limit_ + 1, "storage has headroom (" + stats + ")");
+  } else {
+    LOG(INFO) << "Activation concurrency: keeping " << limit_ << " workers ("
+              << stats << ")";
+  }
+
+  last_throughput_ = throughput;
+  window_start_ = now;
+  window_completions_ = 0;
+  window_latency_ = nanoseconds{0};
+}
+
+void ActivationConcurrencyController::SetLimitLocked(
+    size_t limit, const std::string& reason) {
+  LOG(INFO) << "Activation concurrency: " << limit_ << " -> " << limit
+            << " workers, " << reason;
+  limit_ = limit;
+  ATRACE_INT("apexd_activation_workers", limit_);
+  cv_.notify_all();
+}
+
+}  // namespace apex
+}  // namespace android
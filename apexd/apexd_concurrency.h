@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+struct CpuCapacity {
+  int cpu;
+  // Relative capacity as reported by the kernel, where the fastest CPU of the
+  // system has 1024.
+  uint32_t capacity;
+};
+
+// Parses a CPU list in the format of /sys/devices/system/cpu/online, e.g.
+// "0-3,6".
+android::base::Result<std::vector<int>> ParseCpuList(const std::string& list);
+
+// Returns online CPUs under |sysfs_cpu_dir| with their capacity. CPUs that
+// don't report a capacity are assumed to be as fast as the fastest one.
+android::base::Result<std::vector<CpuCapacity>> GetOnlineCpuCapacities(
+    const std::string& sysfs_cpu_dir = "/sys/devices/system/cpu");
+
+// Returns the CPUs with the highest capacity, or an empty list if all CPUs
+// have the same capacity.
+std::vector<int> GetPerformanceCpus(const std::vector<CpuCapacity>& cpus);
+
+// Returns number of workers to start activating |task_count| APEXes with: half
+// of the online capacity, counted in units of the fastest CPU, capped by
+// |task_count| and by |max_workers| if it's not 0.
+size_t ComputeInitialWorkerCount(const std::vector<CpuCapacity>& cpus,
+                                 size_t task_count, size_t max_workers);
+
+// Returns total time in microseconds during which all non-idle tasks were
+// stalled on I/O, as reported by /proc/pressure/io.
+android::base::Result<uint64_t> ReadIoFullStallUs();
+
+// Limits how many activation workers run concurrently and adjusts that limit
+// as APEXes get activated. Workers are started up to |max_workers|, and the
+// ones with an index above the current limit wait until it is raised or the
+// work is done.
+//
+// The limit goes down when storage is saturated, i.e. when all tasks spend a
+// large fraction of the time stalled on I/O, and goes up when there is no I/O
+// stall and the last increase improved throughput.
+class ActivationConcurrencyController {
+ public:
+  struct Options {
+    size_t initial_workers = 1;
+    size_t max_workers = 1;
+    // If not empty, workers are restricted to these CPUs.
+    std::vector<int> pin_cpus;
+    std::function<android::base::Result<uint64_t>()> read_io_stall_us =
+        ReadIoFullStallUs;
+  };
+
+  explicit ActivationConcurrencyController(Options options);
+
+  // Called on the worker thread before it takes any work.
+  void OnWorkerStart();
+
+  // Blocks until worker |index| is allowed to run. Returns false once Finish()
+  // has been called.
+  bool WaitForSlot(size_t index);
+
+  // Records that a worker spent |latency| activating one APEX, and adjusts the
+  // limit at the end of every window.
+  void ReportCompletion(std::chrono::nanoseconds latency);
+
+  // Releases all waiting workers.
+  void Finish();
+
+  size_t GetLimit() const;
+
+ private:
+  void AdjustLocked(std::chrono::steady_clock::time_point now);
+  void SetLimitLocked(size_t limit, const std::string& reason);
+
+  const Options options_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  size_t limit_;
+  bool finished_ = false;
+
+  // State of the current window.
+  std::chrono::steady_clock::time_point window_start_;
+  uint64_t window_start_stall_us_ = 0;
+  bool has_stall_us_ = false;
+  size_t window_completions_ = 0;
+  std::chrono::nanoseconds window_latency_{0};
+
+  // Throughput of the previous window, in APEXes per second.
+  double last_throughput_ = 0;
+  bool last_change_was_increase_ = false;
+  // Set once an increase didn't pay off, to avoid oscillating.
+  bool increases_frozen_ = false;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include "apexd_concurrency.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+TEST(ApexdConcurrencyTest, ParseCpuList) {
+  auto cpus = ParseCpuList("0-3,6\n");
+  ASSERT_TRUE(IsOk(cpus));
+  ASSERT_THAT(*cpus, ElementsAre(0, 1, 2, 3, 6));
+
+  ASSERT_FALSE(IsOk(ParseCpuList("3-1")));
+  ASSERT_FALSE(IsOk(ParseCpuList("a")));
+}
+
+TEST(ApexdConcurrencyTest, GetOnlineCpuCapacities) {
+  TemporaryDir td;
+  ASSERT_TRUE(WriteStringToFile("0-1,3", StringPrintf("%s/online", td.path)));
+  for (const auto& [cpu, capacity] :
+       {std::pair{0, "400"}, std::pair{1, "400"}, std::pair{3, "1024"}}) {
+    auto dir = StringPrintf("%s/cpu%d", td.path, cpu);
+    ASSERT_EQ(0, mkdir(dir.c_str(), 0755));
+    ASSERT_TRUE(WriteStringToFile(capacity, dir + "/cpu_capacity"));
+  }
+
+  auto cpus = GetOnlineCpuCapacities(td.path);
+  ASSERT_TRUE(IsOk(cpus));
+  ASSERT_EQ(3u, cpus->size());
+  ASSERT_EQ(3, (*cpus)[2].cpu);
+  ASSERT_EQ(1024u, (*cpus)[2].capacity);
+  ASSERT_THAT(GetPerformanceCpus(*cpus), ElementsAre(3));
+}
+
+TEST(ApexdConcurrencyTest, ComputeInitialWorkerCount) {
+  std::vector<CpuCapacity> symmetric;
+  for (int i = 0; i < 8; i++) {
+    symmetric.push_back({i, 1024});
+  }
+  ASSERT_EQ(4u, ComputeInitialWorkerCount(symmetric, 100, 0));
+  ASSERT_EQ(2u, ComputeInitialWorkerCount(symmetric, 2, 0));
+  ASSERT_EQ(3u, ComputeInitialWorkerCount(symmetric, 100, 3));
+  ASSERT_THAT(GetPerformanceCpus(symmetric), IsEmpty());
+
+  // Four little cores count as a bit more than one big core.
+  std::vector<CpuCapacity> big_little = {
+      {0, 300}, {1, 300}, {2, 300}, {3, 300}, {4, 1024}, {5, 1024}};
+  ASSERT_EQ(1u, ComputeInitialWorkerCount(big_little, 100, 0));
+}
+
+TEST(ApexdConcurrencyTest, ReducesConcurrencyWhenStorageSaturated) {
+  uint64_t stall_us = 0;
+  ActivationConcurrencyController::Options options;
+  options.initial_workers = 4;
+  options.max_workers = 4;
+  // Every sample reports an hour of stall, no matter how short the window.
+  options.read_io_stall_us = [&]() -> android::base::Result<uint64_t> {
+    stall_us += 3600'000'000;
+    return stall_us;
+  };
+  ActivationConcurrencyController controller(std::move(options));
+  ASSERT_EQ(4u, controller.GetLimit());
+
+  for (int i = 0; i < 4; i++) {
+    controller.ReportCompletion(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(3u, controller.GetLimit());
+}
+
+TEST(ApexdConcurrencyTest, FinishReleasesParkedWorkers) {
+  ActivationConcurrencyController::Options options;
+  options.initial_workers = 1;
+  options.max_workers = 2;
+  ActivationConcurrencyController controller(std::move(options));
+  ASSERT_TRUE(controller.WaitForSlot(0));
+  controller.Finish();
+  ASSERT_FALSE(controller.WaitForSlot(1));
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_dm.h"
+
+#include <android-base/logging.h>
+#include <libdm/dm.h>
+#include <utils/Trace.h>
+
+#include <atomic>
+#include <future>
+
+using android::base::Error;
+using android::base::Result;
+using android::dm::DeviceMapper;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Creating a device is a couple of short ioctls, so a few threads are enough
+// to hide their latency.
+static constexpr size_t kMaxCreateThreads = 4;
+
+}  // namespace
+
+size_t CreateEmptyDmDevices(const std::vector<std::string>& names) {
+  ATRACE_NAME("CreateEmptyDmDevices");
+  DeviceMapper& dm = DeviceMapper::Instance();
+  std::atomic_size_t next = 0;
+  std::atomic_size_t created = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < names.size(); i = next++) {
+      if (!dm.CreateEmptyDevice(names[i])) {
+        LOG(ERROR) << "Failed to create empty device " << names[i];
+        continue;
+      }
+      created++;
+    }
+  };
+  const size_t thread_num = std::min(names.size(), kMaxCreateThreads);
+  std::vector<std::future<void>> futures;
+  // The calling thread is one of the workers.
+  for (size_t i = 1; i < thread_num; i++) {
+    futures.push_back(std::async(std::launch::async, worker));
+  }
+  worker();
+  for (auto& future : futures) {
+    future.get();
+  }
+  return created;
+}
+
+Result<void> DeleteDmDevices(const std::vector<std::string>& names) {
+  ATRACE_NAME("DeleteDmDevices");
+  DeviceMapper& dm = DeviceMapper::Instance();
+  size_t failed = 0;
+  for (const auto& name : names) {
+    // Deferred removal doesn't wait for the uevent, and leaves a device that
+    // is still open in place until its last user closes it.
+    if (!dm.DeleteDeviceIfExistsDeferred(name)) {
+      LOG(ERROR) << "Failed to issue deferred delete of dm device " << name;
+      failed++;
+    }
+  }
+  if (failed > 0) {
+    return Error() << "Failed to delete " << failed << " of " << names.size()
+                   << " dm devices";
+  }
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// Creates an empty dm device for each of |names|, spreading the ioctls over a
+// few threads. Failures are logged; returns the number of devices created.
+size_t CreateEmptyDmDevices(const std::vector<std::string>& names);
+
+// Issues deferred removal of all dm devices in |names| that exist, without
+// waiting for any of them to go away.
+android::base::Result<void> DeleteDmDevices(
+    const std::vector<std::string>& names);
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,426 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_embedded_hashtree.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/scopeguard.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+using android::base::borrowed_fd;
+using android::base::Error;
+using android::base::ErrnoError;
+using android::base::ReadFileToString;
+using android::base::ReadFullyAtOffset;
+using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteFully;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+constexpr uint32_t kEocdSignature = 0x06054b50;
+constexpr size_t kEocdSize = 22;
+constexpr size_t kMaxZipCommentSize = 0xffff;
+constexpr size_t kEocdCdSizeOffset = 12;
+constexpr size_t kEocdCdOffsetOffset = 16;
+constexpr size_t kEocdCommentSizeOffset = 20;
+
+// The APK Signing Block is laid out as:
+//   uint64 size of the block, not counting this field
+//   ID-value pairs, each prefixed with its uint64 length
+//   uint64 size of the block, same as above
+//   16 bytes of magic
+constexpr char kSigningBlockMagic[] = "APK Sig Block 42";
+constexpr size_t kSigningBlockMagicSize = 16;
+constexpr size_t kSigningBlockFooterSize = 8 + kSigningBlockMagicSize;
+
+// ID of the pair holding the hashtree. Pairs with unknown IDs are ignored by
+// APK signature verification.
+constexpr uint32_t kHashTreePairId = 0x68617368;
+constexpr uint32_t kHashTreeFormatVersion = 1;
+constexpr uint64_t kHashTreeAlignment = 4096;
+// Upper bound of the pair header read at boot, the strings in it are short.
+constexpr size_t kMaxHashTreeHeaderSize = 1024;
+
+uint32_t ReadLe32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t ReadLe64(const uint8_t* p) {
+  return ReadLe32(p) | (static_cast<uint64_t>(ReadLe32(p + 4)) << 32);
+}
+
+void AppendLe32(std::string* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+void AppendLe64(std::string* out, uint64_t value) {
+  AppendLe32(out, static_cast<uint32_t>(value));
+  AppendLe32(out, static_cast<uint32_t>(value >> 32));
+}
+
+void AppendString(std::string* out, const std::string& value) {
+  AppendLe32(out, value.size());
+  out->append(value);
+}
+
+struct ZipLayout {
+  uint64_t file_size = 0;
+  uint64_t eocd_offset = 0;
+  uint64_t cd_offset = 0;
+  uint64_t cd_size = 0;
+  // Start of the APK Signing Block, or |cd_offset| if there is none.
+  uint64_t signing_block_offset = 0;
+};
+
+Result<ZipLayout> ReadZipLayout(borrowed_fd fd) {
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat";
+  }
+  ZipLayout layout;
+  layout.file_size = st.st_size;
+  if (layout.file_size < kEocdSize) {
+    return Error() << "Too small to be a zip file";
+  }
+  const size_t tail_size = std::min<uint64_t>(
+      layout.file_size, kEocdSize + kMaxZipCommentSize);
+  std::vector<uint8_t> tail(tail_size);
+  if (!ReadFullyAtOffset(fd, tail.data(), tail_size,
+                         layout.file_size - tail_size)) {
+    return ErrnoError() << "Failed to read end of central directory";
+  }
+  // The EOCD record is followed by a comment of the size it declares.
+  bool found = false;
+  for (size_t i = tail_size - kEocdSize + 1; i-- > 0;) {
+    const uint8_t* eocd = tail.data() + i;
+    if (ReadLe32(eocd) == kEocdSignature &&
+        i + kEocdSize +
+                (eocd[kEocdCommentSizeOffset] |
+                 (eocd[kEocdCommentSizeOffset + 1] << 8)) ==
+            tail_size) {
+      layout.eocd_offset = layout.file_size - tail_size + i;
+      layout.cd_size = ReadLe32(eocd + kEocdCdSizeOffset);
+      layout.cd_offset = ReadLe32(eocd + kEocdCdOffsetOffset);
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    return Error() << "No end of central directory record";
+  }
+  if (layout.cd_offset == 0xffffffff) {
+    return Error() << "Zip64 archives are not supported";
+  }
+  if (layout.cd_offset + layout.cd_size > layout.eocd_offset) {
+    return Error() << "Central directory overlaps its end record";
+  }
+
+  layout.signing_block_offset = layout.cd_offset;
+  if (layout.cd_offset < kSigningBlockFooterSize + 8) {
+    return layout;
+  }
+  uint8_t footer[kSigningBlockFooterSize];
+  if (!ReadFullyAtOffset(fd, footer, sizeof(footer),
+                         layout.cd_offset - sizeof(footer))) {
+    return ErrnoError() << "Failed to read APK Signing Block footer";
+  }
+  if (memcmp(footer + 8, kSigningBlockMagic, kSigningBlockMagicSize) != 0) {
+    return layout;
+  }
+  const uint64_t block_size = ReadLe64(footer);
+  if (block_size < kSigningBlockFooterSize ||
+      block_size > layout.cd_offset - 8) {
+    return Error() << "Malformed APK Signing Block size " << block_size;
+  }
+  layout.signing_block_offset = layout.cd_offset - block_size - 8;
+  return layout;
+}
+
+// Calls |fn| with the offset and length of the value of every pair of the APK
+// Signing Block, until it returns false.
+template <typename Fn>
+Result<void> ForEachSigningBlockPair(borrowed_fd fd, const ZipLayout& layout,
+                                     Fn fn) {
+  const uint64_t end = layout.cd_offset - kSigningBlockFooterSize;
+  uint64_t pos = layout.signing_block_offset + 8;
+  while (pos < end) {
+    uint8_t header[12];
+    if (end - pos < sizeof(header) ||
+        !ReadFullyAtOffset(fd, header, sizeof(header), pos)) {
+      return Error() << "Truncated APK Signing Block pair at " << pos;
+    }
+    const uint64_t pair_size = ReadLe64(header);
+    if (pair_size < 4 || pair_size > end - pos - 8) {
+      return Error() << "Malformed APK Signing Block pair at " << pos;
+    }
+    if (!fn(ReadLe32(header + 8), pos + sizeof(header), pair_size - 4)) {
+      break;
+    }
+    pos += 8 + pair_size;
+  }
+  return {};
+}
+
+Result<void> CopyRange(borrowed_fd src, borrowed_fd dst, uint64_t offset,
+                       uint64_t length) {
+  std::vector<uint8_t> buf(1 << 20);
+  while (length > 0) {
+    const size_t chunk = std::min<uint64_t>(length, buf.size());
+    if (!ReadFullyAtOffset(src, buf.data(), chunk, offset)) {
+      return ErrnoError() << "Failed to read " << chunk << " bytes at "
+                          << offset;
+    }
+    if (!WriteFully(dst, buf.data(), chunk)) {
+      return ErrnoError() << "Failed to write " << chunk << " bytes";
+    }
+    offset += chunk;
+    length -= chunk;
+  }
+  return {};
+}
+
+Result<EmbeddedHashTree> ParseHashTreeHeader(const uint8_t* data, size_t size,
+                                             uint64_t value_offset,
+                                             uint64_t value_size) {
+  size_t pos = 0;
+  auto read_u32 = [&](uint32_t* value) {
+    if (size - pos < 4) return false;
+    *value = ReadLe32(data + pos);
+    pos += 4;
+    return true;
+  };
+  auto read_u64 = [&](uint64_t* value) {
+    if (size - pos < 8) return false;
+    *value = ReadLe64(data + pos);
+    pos += 8;
+    return true;
+  };
+  auto read_string = [&](std::string* value) {
+    uint32_t length;
+    if (!read_u32(&length) || size - pos < length) return false;
+    value->assign(reinterpret_cast<const char*>(data + pos), length);
+    pos += length;
+    return true;
+  };
+  uint32_t version;
+  EmbeddedHashTree tree;
+  if (!read_u32(&version)) {
+    return Error() << "Truncated hashtree header";
+  }
+  if (version != kHashTreeFormatVersion) {
+    return Error() << "Unsupported hashtree format version " << version;
+  }
+  if (!read_u64(&tree.offset) || !read_u64(&tree.size) ||
+      !read_string(&tree.hash_algorithm) || !read_string(&tree.salt) ||
+      !read_string(&tree.root_digest)) {
+    return Error() << "Truncated hashtree header";
+  }
+  if (tree.offset % kHashTreeAlignment != 0 ||
+      tree.offset < value_offset + pos ||
+      tree.offset + tree.size > value_offset + value_size) {
+    return Error() << "Hashtree at " << tree.offset << " of size " << tree.size
+                   << " is outside of its pair";
+  }
+  return tree;
+}
+
+}  // namespace
+
+bool EmbeddedHashTree::Matches(const ApexVerityData& verity_data) const {
+  return root_digest == verity_data.root_digest && salt == verity_data.salt &&
+         hash_algorithm == verity_data.hash_algorithm;
+}
+
+Result<void> EmbedHashTree(const std::string& apex_path,
+                           const std::string& hashtree_file,
+                           const ApexVerityData& verity_data,
+                           const std::string& output_path) {
+  unique_fd src(
+      TEMP_FAILURE_RETRY(open(apex_path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (src.get() == -1) {
+    return ErrnoError() << "Failed to open " << apex_path;
+  }
+  auto layout = ReadZipLayout(src);
+  if (!layout.ok()) {
+    return Error() << "Failed to read layout of " << apex_path << ": "
+                   << layout.error();
+  }
+  std::string tree;
+  if (!ReadFileToString(hashtree_file, &tree)) {
+    return ErrnoError() << "Failed to read " << hashtree_file;
+  }
+
+  // Keep the pairs already in the block, except for a previous hashtree.
+  std::string other_pairs;
+  if (layout->signing_block_offset != layout->cd_offset) {
+    Result<void> read_status;
+    auto st = ForEachSigningBlockPair(
+        src, *layout, [&](uint32_t id, uint64_t offset, uint64_t size) {
+          if (id == kHashTreePairId) {
+            return true;
+          }
+          std::string pair(12 + size, '\0');
+          if (!ReadFullyAtOffset(src, pair.data(), pair.size(), offset - 12)) {
+            read_status = ErrnoError() << "Failed to read APK Signing Block";
+            return false;
+          }
+          other_pairs += pair;
+          return true;
+        });
+    if (!st.ok()) {
+      return st.error();
+    }
+    if (!read_status.ok()) {
+      return read_status.error();
+    }
+  }
+
+  std::string header;
+  AppendLe32(&header, kHashTreeFormatVersion);
+  // Tree offset and size are filled in below, once the padding is known.
+  const size_t tree_offset_pos = header.size();
+  AppendLe64(&header, 0);
+  AppendLe64(&header, tree.size());
+  AppendString(&header, verity_data.hash_algorithm);
+  AppendString(&header, verity_data.salt);
+  AppendString(&header, verity_data.root_digest);
+
+  // Block size field, then the pair's size and ID.
+  const uint64_t value_offset = layout->signing_block_offset + 8 + 8 + 4;
+  const uint64_t tree_offset =
+      (value_offset + header.size() + kHashTreeAlignment - 1) /
+      kHashTreeAlignment * kHashTreeAlignment;
+  for (int i = 0; i < 8; i++) {
+    header[tree_offset_pos + i] =
+        static_cast<char>((tree_offset >> (8 * i)) & 0xff);
+  }
+  const uint64_t value_size = tree_offset - value_offset + tree.size();
+  const uint64_t block_size =
+      8 + 4 + value_size + other_pairs.size() + kSigningBlockFooterSize;
+  const uint64_t new_cd_offset = layout->signing_block_offset + 8 + block_size;
+  if (new_cd_offset > 0xffffffff) {
+    return Error() << "Embedding the hashtree would need a Zip64 archive";
+  }
+
+  unique_fd dst(TEMP_FAILURE_RETRY(open(
+      output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)));
+  if (dst.get() == -1) {
+    return ErrnoError() << "Failed to create " << output_path;
+  }
+  auto scope_guard = android::base::make_scope_guard(
+      [&]() { unlink(output_path.c_str()); });
+
+  if (auto st = CopyRange(src, dst, 0, layout->signing_block_offset);
+      !st.ok()) {
+    return st.error();
+  }
+  std::string block;
+  AppendLe64(&block, block_size);
+  AppendLe64(&block, 4 + value_size);
+  AppendLe32(&block, kHashTreePairId);
+  block += header;
+  block.append(tree_offset - value_offset - header.size(), '\0');
+  block += tree;
+  block += other_pairs;
+  AppendLe64(&block, block_size);
+  block.append(kSigningBlockMagic, kSigningBlockMagicSize);
+  if (!WriteFully(dst, block.data(), block.size())) {
+    return ErrnoError() << "Failed to write APK Signing Block";
+  }
+  if (auto st = CopyRange(src, dst, layout->cd_offset,
+                          layout->eocd_offset - layout->cd_offset);
+      !st.ok()) {
+    return st.error();
+  }
+  std::string eocd(layout->file_size - layout->eocd_offset, '\0');
+  if (!ReadFullyAtOffset(src, eocd.data(), eocd.size(), layout->eocd_offset)) {
+    return ErrnoError() << "Failed to read end of central directory";
+  }
+  for (int i = 0; i < 4; i++) {
+    eocd[kEocdCdOffsetOffset + i] =
+        static_cast<char>((new_cd_offset >> (8 * i)) & 0xff);
+  }
+  if (!WriteFully(dst, eocd.data(), eocd.size())) {
+    return ErrnoError() << "Failed to write end of central directory";
+  }
+  if (fsync(dst.get()) != 0) {
+    return ErrnoError() << "Failed to sync " << output_path;
+  }
+  scope_guard.Disable();
+  return {};
+}
+
+Result<std::optional<EmbeddedHashTree>> FindEmbeddedHashTree(
+    const std::string& apex_path) {
+  unique_fd fd(
+      TEMP_FAILURE_RETRY(open(apex_path.c_str(), O_RDONLY | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << apex_path;
+  }
+  auto layout = ReadZipLayout(fd);
+  if (!layout.ok()) {
+    return Error() << "Failed to read layout of " << apex_path << ": "
+                   << layout.error();
+  }
+  if (layout->signing_block_offset == layout->cd_offset) {
+    return std::nullopt;
+  }
+  std::optional<uint64_t> value_offset;
+  uint64_t value_size = 0;
+  auto st = ForEachSigningBlockPair(
+      fd, *layout, [&](uint32_t id, uint64_t offset, uint64_t size) {
+        if (id != kHashTreePairId) {
+          return true;
+        }
+        value_offset = offset;
+        value_size = size;
+        return false;
+      });
+  if (!st.ok()) {
+    return Error() << apex_path << ": " << st.error();
+  }
+  if (!value_offset.has_value()) {
+    return std::nullopt;
+  }
+  std::vector<uint8_t> header(
+      std::min<uint64_t>(value_size, kMaxHashTreeHeaderSize));
+  if (!ReadFullyAtOffset(fd, header.data(), header.size(), *value_offset)) {
+    return ErrnoError() << "Failed to read hashtree header of " << apex_path;
+  }
+  auto tree = ParseHashTreeHeader(header.data(), header.size(), *value_offset,
+                                  value_size);
+  if (!tree.ok()) {
+    return Error() << apex_path << ": " << tree.error();
+  }
+  return *tree;
+}
+
+}  // namespace apex
+}  // namespace android
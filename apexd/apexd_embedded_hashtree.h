@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#include "apex_file.h"
+
+namespace android {
+namespace apex {
+
+// A dm-verity hashtree stored inside an APEX file by EmbedHashTree().
+//
+// The hashtree lives in a pair of the APK Signing Block, which sits between
+// the zip entries and the central directory. APK signatures don't cover the
+// content of that block, only what comes before and after it, so adding the
+// hashtree keeps the file's signature valid. The hashtree itself is checked
+// by dm-verity against the signed root digest, like a separate hashtree file.
+struct EmbeddedHashTree {
+  // Offset of the hashtree in the APEX file, aligned to 4096 bytes.
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  std::string hash_algorithm;
+  std::string salt;
+  std::string root_digest;
+
+  // Whether this is the hashtree of the payload described by |verity_data|.
+  bool Matches(const ApexVerityData& verity_data) const;
+};
+
+// Writes a copy of the APEX at |apex_path| to |output_path| with the content
+// of |hashtree_file| embedded. Any hashtree embedded in |apex_path| is
+// replaced.
+android::base::Result<void> EmbedHashTree(const std::string& apex_path,
+                                          const std::string& hashtree_file,
+                                          const ApexVerityData& verity_data,
+                                          const std::string& output_path);
+
+// Returns the hashtree embedded in |apex_path|, or std::nullopt if it has
+// none. Only reads the end of the file.
+android::base::Result<std::optional<EmbeddedHashTree>> FindEmbeddedHashTree(
+    const std::string& apex_path);
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "apex_file.h"
+#include "apexd_embedded_hashtree.h"
+#include "apexd_test_utils.h"
+#include "apexd_verity.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::GetExecutableDirectory;
+using android::base::ReadFileToString;
+using android::base::StringPrintf;
+
+static std::string GetTestFile(const std::string& name) {
+  return GetExecutableDirectory() + "/" + name;
+}
+
+TEST(ApexdEmbeddedHashTreeTest, EmbedsHashTreeAndKeepsPayload) {
+  TemporaryDir td;
+  const std::string original_path =
+      GetTestFile("apex.apexd_test_no_hashtree.apex");
+  auto original = ApexFile::Open(original_path);
+  ASSERT_TRUE(IsOk(original));
+  auto verity_data =
+      original->VerifyApexVerity(original->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+  auto hashtree_file = StringPrintf("%s/hashtree", td.path);
+  ASSERT_TRUE(IsOk(PrepareHashTree(*original, *verity_data, hashtree_file)));
+
+  auto none = FindEmbeddedHashTree(original_path);
+  ASSERT_TRUE(IsOk(none));
+  ASSERT_FALSE(none->has_value());
+
+  auto embedded_path = StringPrintf("%s/embedded.apex", td.path);
+  ASSERT_TRUE(IsOk(EmbedHashTree(original_path, hashtree_file, *verity_data,
+                                 embedded_path)));
+
+  // The copy is still a valid APEX with the same payload.
+  auto embedded = ApexFile::Open(embedded_path);
+  ASSERT_TRUE(IsOk(embedded));
+  ASSERT_EQ(original->GetImageOffset(), embedded->GetImageOffset());
+  ASSERT_EQ(original->GetImageSize(), embedded->GetImageSize());
+  ASSERT_TRUE(
+      IsOk(embedded->VerifyApexVerity(original->GetBundledPublicKey())));
+
+  auto tree = FindEmbeddedHashTree(embedded_path);
+  ASSERT_TRUE(IsOk(tree));
+  ASSERT_TRUE(tree->has_value());
+  ASSERT_TRUE((*tree)->Matches(*verity_data));
+  ASSERT_EQ(0u, (*tree)->offset % 4096);
+
+  std::string expected_tree;
+  ASSERT_TRUE(ReadFileToString(hashtree_file, &expected_tree));
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(embedded_path, &content));
+  ASSERT_EQ(expected_tree, content.substr((*tree)->offset, (*tree)->size));
+
+  // Embedding again replaces the hashtree instead of adding another one.
+  auto again_path = StringPrintf("%s/again.apex", td.path);
+  ASSERT_TRUE(IsOk(EmbedHashTree(embedded_path, hashtree_file, *verity_data,
+                                 again_path)));
+  std::string again;
+  ASSERT_TRUE(ReadFileToString(again_path, &again));
+  ASSERT_EQ(content, again);
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_hashtree_store.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <vector>
+
+#include "apexd_utils.h"
+
+using android::base::ErrnoError;
+using android::base::Result;
+using android::base::StringPrintf;
+
+namespace android {
+namespace apex {
+
+std::string HashTreeStore::GetKey(const ApexVerityData& verity_data) {
+  return StringPrintf("%s-%u-%s-%s", verity_data.hash_algorithm.c_str(),
+                      verity_data.desc->hash_block_size,
+                      verity_data.root_digest.c_str(),
+                      verity_data.salt.c_str());
+}
+
+std::string HashTreeStore::GetPath(const ApexVerityData& verity_data) const {
+  return dir_ + "/" + GetKey(verity_data);
+}
+
+Result<bool> HashTreeStore::LinkTo(const ApexVerityData& verity_data,
+                                   const std::string& hashtree_file) const {
+  const std::string path = GetPath(verity_data);
+  if (link(path.c_str(), hashtree_file.c_str()) != 0) {
+    if (errno == ENOENT && access(path.c_str(), F_OK) != 0) {
+      return false;
+    }
+    return ErrnoError() << "Failed to link " << path << " to "
+                        << hashtree_file;
+  }
+  return true;
+}
+
+Result<void> HashTreeStore::Add(const ApexVerityData& verity_data,
+                                const std::string& hashtree_file) const {
+  if (auto st = CreateDirIfNeeded(dir_, 0700); !st.ok()) {
+    return st.error();
+  }
+  const std::string path = GetPath(verity_data);
+  if (link(hashtree_file.c_str(), path.c_str()) != 0 && errno != EEXIST) {
+    return ErrnoError() << "Failed to link " << hashtree_file << " to " << path;
+  }
+  return {};
+}
+
+Result<void> HashTreeStore::Remove(const ApexVerityData& verity_data) const {
+  const std::string path = GetPath(verity_data);
+  if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+    return ErrnoError() << "Failed to unlink " << path;
+  }
+  return {};
+}
+
+Result<uint64_t> HashTreeStore::GarbageCollect(
+    uint64_t unreferenced_budget) const {
+  if (access(dir_.c_str(), F_OK) != 0) {
+    return 0;
+  }
+  auto files = ReadDir(dir_, [](const auto& entry) {
+    std::error_code ec;
+    return entry.is_regular_file(ec);
+  });
+  if (!files.ok()) {
+    return files.error();
+  }
+
+  struct Unreferenced {
+    std::string path;
+    // Unlinking the last hashtree file of an entry updates its ctime.
+    struct timespec released;
+    uint64_t bytes;
+  };
+  std::vector<Unreferenced> unreferenced;
+  for (const auto& file : *files) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) {
+      PLOG(ERROR) << "Failed to stat " << file;
+      continue;
+    }
+    if (st.st_nlink > 1) {
+      continue;
+    }
+    unreferenced.push_back({file, st.st_ctim,
+                            static_cast<uint64_t>(st.st_blocks) * 512});
+  }
+  std::sort(unreferenced.begin(), unreferenced.end(),
+            [](const auto& a, const auto& b) {
+              if (a.released.tv_sec != b.released.tv_sec) {
+                return a.released.tv_sec > b.released.tv_sec;
+              }
+              return a.released.tv_nsec > b.released.tv_nsec;
+            });
+
+  uint64_t kept = 0;
+  uint64_t reclaimed = 0;
+  for (const auto& entry : unreferenced) {
+    if (kept + entry.bytes <= unreferenced_budget) {
+      kept += entry.bytes;
+      continue;
+    }
+    LOG(INFO) << "Removing unreferenced hashtree " << entry.path;
+    if (unlink(entry.path.c_str()) != 0) {
+      PLOG(ERROR) << "Failed to unlink " << entry.path;
+      continue;
+    }
+    reclaimed += entry.bytes;
+  }
+  return reclaimed;
+}
+
+}  // namespace apex
+}  // namespace android
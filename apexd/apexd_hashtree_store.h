@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <cstdint>
+#include <string>
+
+#include "apex_file.h"
+
+namespace android {
+namespace apex {
+
+// A directory of dm-verity hashtrees named after what they are the hashtree
+// of: root digest, salt, hash algorithm and block size. Reinstalling an APEX,
+// or rolling back to a version seen before, finds its hashtree here instead
+// of generating it again.
+//
+// Hashtree files of packages are hard links to entries of the store, so the
+// link count of an entry is its reference count. Entries nobody links to are
+// kept while they fit in a budget, and garbage collected after that.
+class HashTreeStore {
+ public:
+  explicit HashTreeStore(std::string dir) : dir_(std::move(dir)) {}
+
+  static std::string GetKey(const ApexVerityData& verity_data);
+
+  const std::string& GetDir() const { return dir_; }
+  std::string GetPath(const ApexVerityData& verity_data) const;
+
+  // Links the hashtree stored for |verity_data| to |hashtree_file|. Returns
+  // false if there is none. Doesn't check the content of the hashtree.
+  android::base::Result<bool> LinkTo(const ApexVerityData& verity_data,
+                                     const std::string& hashtree_file) const;
+
+  // Adds |hashtree_file|, the hashtree of |verity_data|, to the store. Does
+  // nothing if the store already has one.
+  android::base::Result<void> Add(const ApexVerityData& verity_data,
+                                  const std::string& hashtree_file) const;
+
+  // Removes the entry for |verity_data|, e.g. because it turned out to be
+  // corrupted. Hashtree files linking to it are left alone.
+  android::base::Result<void> Remove(const ApexVerityData& verity_data) const;
+
+  // Removes entries that no hashtree file links to, least recently released
+  // first, until the remaining ones take at most |unreferenced_budget| bytes.
+  // Returns the number of bytes reclaimed.
+  android::base::Result<uint64_t> GarbageCollect(
+      uint64_t unreferenced_budget) const;
+
+ private:
+  std::string dir_;
+};
+
+}  // namespace apex
+}  // namespace android
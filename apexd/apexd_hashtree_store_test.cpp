@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+
+#include "apex_file.h"
+#include "apexd_hashtree_store.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+
+namespace {
+
+ApexVerityData MakeVerityData(AvbHashtreeDescriptor* desc,
+                              const std::string& root_digest) {
+  desc->hash_block_size = 4096;
+  ApexVerityData data;
+  data.desc.reset(desc);
+  data.hash_algorithm = "sha256";
+  data.salt = "abcd";
+  data.root_digest = root_digest;
+  return data;
+}
+
+}  // namespace
+
+TEST(ApexdHashTreeStoreTest, KeyDependsOnContent) {
+  auto a = MakeVerityData(new AvbHashtreeDescriptor(), "0011");
+  auto b = MakeVerityData(new AvbHashtreeDescriptor(), "0011");
+  ASSERT_EQ(HashTreeStore::GetKey(a), HashTreeStore::GetKey(b));
+  b.salt = "dcba";
+  ASSERT_NE(HashTreeStore::GetKey(a), HashTreeStore::GetKey(b));
+  b = MakeVerityData(new AvbHashtreeDescriptor(), "0011");
+  b.desc->hash_block_size = 512;
+  ASSERT_NE(HashTreeStore::GetKey(a), HashTreeStore::GetKey(b));
+}
+
+TEST(ApexdHashTreeStoreTest, GarbageCollectKeepsReferencedAndRecent) {
+  TemporaryDir td;
+  HashTreeStore store(StringPrintf("%s/store", td.path));
+
+  auto in_use = MakeVerityData(new AvbHashtreeDescriptor(), "01");
+  auto old = MakeVerityData(new AvbHashtreeDescriptor(), "02");
+  auto recent = MakeVerityData(new AvbHashtreeDescriptor(), "03");
+  for (const auto* data : {&in_use, &old, &recent}) {
+    auto file = StringPrintf("%s/%s", td.path, data->root_digest.c_str());
+    ASSERT_TRUE(WriteStringToFile(std::string(8192, 'a'), file));
+    ASSERT_TRUE(IsOk(store.Add(*data, file)));
+    if (data != &in_use) {
+      ASSERT_EQ(0, unlink(file.c_str()));
+    }
+    // Release order is based on ctime.
+    usleep(10000);
+  }
+
+  auto other = StringPrintf("%s/other", td.path);
+  auto linked = store.LinkTo(in_use, other);
+  ASSERT_TRUE(IsOk(linked));
+  ASSERT_TRUE(*linked);
+  auto unknown = MakeVerityData(new AvbHashtreeDescriptor(), "04");
+  linked = store.LinkTo(unknown, StringPrintf("%s/unknown", td.path));
+  ASSERT_TRUE(IsOk(linked));
+  ASSERT_FALSE(*linked);
+
+  // Room for one unreferenced hashtree.
+  auto reclaimed = store.GarbageCollect(8192);
+  ASSERT_TRUE(IsOk(reclaimed));
+  ASSERT_GT(*reclaimed, 0u);
+  ASSERT_EQ(0, access(store.GetPath(in_use).c_str(), F_OK));
+  ASSERT_EQ(0, access(store.GetPath(recent).c_str(), F_OK));
+  ASSERT_NE(0, access(store.GetPath(old).c_str(), F_OK));
+
+  reclaimed = store.GarbageCollect(0);
+  ASSERT_TRUE(IsOk(reclaimed));
+  ASSERT_EQ(0, access(store.GetPath(in_use).c_str(), F_OK));
+  ASSERT_NE(0, access(store.GetPath(recent).c_str(), F_OK));
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_io_stats.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+using android::base::boot_clock;
+using android::base::Error;
+using android::base::ErrnoError;
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Result;
+using android::base::Split;
+using android::base::StringAppendF;
+using android::base::Trim;
+
+namespace android {
+namespace apex {
+
+Result<BlockIoStats> ParseBlockStat(const std::string& content) {
+  std::vector<std::string> fields;
+  for (auto& field : Split(Trim(content), " ")) {
+    if (!field.empty()) {
+      fields.push_back(std::move(field));
+    }
+  }
+  BlockIoStats stats;
+  if (fields.size() < 4 || !ParseUint(fields[0], &stats.read_ios) ||
+      !ParseUint(fields[1], &stats.read_merges) ||
+      !ParseUint(fields[2], &stats.read_sectors) ||
+      !ParseUint(fields[3], &stats.read_ticks_ms)) {
+    return Error() << "Malformed block stat \"" << content << "\"";
+  }
+  return stats;
+}
+
+Result<BlockIoStats> ReadBlockIoStats(const std::string& block_device) {
+  const std::string path = "/sys/block/" + block_device + "/stat";
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  return ParseBlockStat(content);
+}
+
+ApexIoAccounting& ApexIoAccounting::GetInstance() {
+  static ApexIoAccounting instance;
+  return instance;
+}
+
+void ApexIoAccounting::AddCheckpoint(const std::string& label,
+                                     std::vector<ApexIoSample> samples) {
+  auto uptime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      boot_clock::now().time_since_epoch());
+  std::lock_guard lock(mutex_);
+  checkpoints_.push_back({label, uptime, std::move(samples)});
+}
+
+std::vector<ApexIoCheckpoint> ApexIoAccounting::GetCheckpoints() const {
+  std::lock_guard lock(mutex_);
+  return checkpoints_;
+}
+
+std::string FormatApexIoCheckpoints(
+    const std::vector<ApexIoCheckpoint>& checkpoints) {
+  std::string ret;
+  for (const auto& checkpoint : checkpoints) {
+    StringAppendF(&ret, "%s (uptime %lldms):\n", checkpoint.label.c_str(),
+                  static_cast<long long>(checkpoint.uptime.count()));
+    StringAppendF(&ret, "  %-48s %-8s %10s %10s %12s %10s\n", "APEX",
+                  "Device", "Read IOs", "Merges", "Sectors", "Time(ms)");
+    for (const auto& sample : checkpoint.samples) {
+      StringAppendF(
+          &ret, "  %-48s %-8s %10llu %10llu %12llu %10llu\n",
+          sample.apex_name.c_str(), sample.block_device.c_str(),
+          static_cast<unsigned long long>(sample.stats.read_ios),
+          static_cast<unsigned long long>(sample.stats.read_merges),
+          static_cast<unsigned long long>(sample.stats.read_sectors),
+          static_cast<unsigned long long>(sample.stats.read_ticks_ms));
+    }
+  }
+  return ret;
+}
+
+std::string FormatApexIoCheckpointsCsv(
+    const std::vector<ApexIoCheckpoint>& checkpoints) {
+  std::string ret =
+      "checkpoint,uptime_ms,apex,path,device,read_ios,read_merges,"
+      "read_sectors,read_ticks_ms\n";
+  for (const auto& checkpoint : checkpoints) {
+    for (const auto& sample : checkpoint.samples) {
+      StringAppendF(
+          &ret, "%s,%lld,%s,%s,%s,%llu,%llu,%llu,%llu\n",
+          checkpoint.label.c_str(),
+          static_cast<long long>(checkpoint.uptime.count()),
+          sample.apex_name.c_str(), sample.full_path.c_str(),
+          sample.block_device.c_str(),
+          static_cast<unsigned long long>(sample.stats.read_ios),
+          static_cast<unsigned long long>(sample.stats.read_merges),
+          static_cast<unsigned long long>(sample.stats.read_sectors),
+          static_cast<unsigned long long>(sample.stats.read_ticks_ms));
+    }
+  }
+  return ret;
+}
+
+}  // namespace apex
+}  // namespace android
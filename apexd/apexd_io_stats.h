@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// Read side of /sys/block/<dev>/stat. See Documentation/block/stat.rst.
+struct BlockIoStats {
+  uint64_t read_ios = 0;
+  uint64_t read_merges = 0;
+  uint64_t read_sectors = 0;
+  uint64_t read_ticks_ms = 0;
+};
+
+// I/O done through the top-most block device of a mounted APEX, i.e. the
+// dm-verity device if there is one, otherwise the loop device.
+struct ApexIoSample {
+  std::string apex_name;
+  std::string full_path;
+  std::string block_device;
+  BlockIoStats stats;
+};
+
+struct ApexIoCheckpoint {
+  std::string label;
+  std::chrono::milliseconds uptime;
+  std::vector<ApexIoSample> samples;
+};
+
+android::base::Result<BlockIoStats> ParseBlockStat(const std::string& content);
+
+// Reads stats of |block_device|, e.g. "dm-3" or "loop12".
+android::base::Result<BlockIoStats> ReadBlockIoStats(
+    const std::string& block_device);
+
+// Keeps samples taken at interesting points of the boot, so that they can be
+// compared with live numbers later.
+class ApexIoAccounting {
+ public:
+  static ApexIoAccounting& GetInstance();
+
+  void AddCheckpoint(const std::string& label,
+                     std::vector<ApexIoSample> samples);
+  std::vector<ApexIoCheckpoint> GetCheckpoints() const;
+
+ private:
+  ApexIoAccounting() = default;
+
+  mutable std::mutex mutex_;
+  std::vector<ApexIoCheckpoint> checkpoints_;
+};
+
+// Formats |checkpoints| as a table for humans.
+std::string FormatApexIoCheckpoints(
+    const std::vector<ApexIoCheckpoint>& checkpoints);
+
+// Formats |checkpoints| as CSV with a header line, one row per sample.
+std::string FormatApexIoCheckpointsCsv(
+    const std::vector<ApexIoCheckpoint>& checkpoints);
+
+}  // namespace apex
+}  // namespace android
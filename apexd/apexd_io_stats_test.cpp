@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "apexd_io_stats.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+
+TEST(ApexdIoStatsTest, ParseBlockStat) {
+  auto stats = ParseBlockStat(
+      "     372       12     8456      104        0        0        0        "
+      "0        0      148      104        0        0        0        0\n");
+  ASSERT_TRUE(IsOk(stats));
+  ASSERT_EQ(372u, stats->read_ios);
+  ASSERT_EQ(12u, stats->read_merges);
+  ASSERT_EQ(8456u, stats->read_sectors);
+  ASSERT_EQ(104u, stats->read_ticks_ms);
+
+  ASSERT_FALSE(IsOk(ParseBlockStat("1 2 3")));
+  ASSERT_FALSE(IsOk(ParseBlockStat("a b c d")));
+}
+
+TEST(ApexdIoStatsTest, FormatCsv) {
+  ApexIoCheckpoint checkpoint{"activation", std::chrono::milliseconds(1500),
+                              {{"com.android.foo", "/system/apex/foo.apex",
+                                "dm-3", {10, 1, 80, 5}}}};
+  ASSERT_EQ(
+      "checkpoint,uptime_ms,apex,path,device,read_ios,read_merges,"
+      "read_sectors,read_ticks_ms\n"
+      "activation,1500,com.android.foo,/system/apex/foo.apex,dm-3,10,1,80,5\n",
+      FormatApexIoCheckpointsCsv({checkpoint}));
+}
+
+}  // namespace apex
+}  // namespace android
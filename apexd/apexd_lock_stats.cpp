@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_lock_stats.h"
+
+#include <android-base/stringprintf.h>
+#include <utils/Trace.h>
+
+#include <map>
+#include <memory>
+
+using android::base::StringAppendF;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void UpdateMax(std::atomic<int64_t>& max, int64_t value) {
+  int64_t current = max.load(std::memory_order_relaxed);
+  while (value > current &&
+         !max.compare_exchange_weak(current, value,
+                                    std::memory_order_relaxed)) {
+  }
+}
+
+// Function-local, since locks of global objects register during static
+// initialization.
+struct Registry {
+  std::mutex mutex;
+  std::map<std::string, std::unique_ptr<LockCounters>> counters;
+};
+
+Registry& GetRegistry() {
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+}  // namespace
+
+LockCounters::LockCounters(const std::string& name)
+    : name_(name),
+      waiters_counter_("apexd_lock_waiters:" + name),
+      wait_counter_("apexd_lock_wait_us:" + name) {}
+
+LockCounters& LockCounters::Get(const std::string& name) {
+  auto& registry = GetRegistry();
+  std::lock_guard lock(registry.mutex);
+  auto& counters = registry.counters[name];
+  if (counters == nullptr) {
+    counters = std::make_unique<LockCounters>(name);
+  }
+  return *counters;
+}
+
+void LockCounters::RecordAcquisition(std::chrono::nanoseconds wait) {
+  acquisitions_.fetch_add(1, std::memory_order_relaxed);
+  if (wait.count() == 0) {
+    return;
+  }
+  contended_.fetch_add(1, std::memory_order_relaxed);
+  int64_t total = total_wait_ns_.fetch_add(wait.count(),
+                                           std::memory_order_relaxed) +
+                  wait.count();
+  UpdateMax(max_wait_ns_, wait.count());
+  ATRACE_INT64(wait_counter_.c_str(), total / 1000);
+}
+
+void LockCounters::RecordRelease(std::chrono::nanoseconds hold) {
+  total_hold_ns_.fetch_add(hold.count(), std::memory_order_relaxed);
+  UpdateMax(max_hold_ns_, hold.count());
+}
+
+LockStats LockCounters::GetStats() const {
+  LockStats stats;
+  stats.name = name_;
+  stats.acquisitions = acquisitions_.load(std::memory_order_relaxed);
+  stats.contended = contended_.load(std::memory_order_relaxed);
+  stats.total_wait = std::chrono::nanoseconds(
+      total_wait_ns_.load(std::memory_order_relaxed));
+  stats.max_wait =
+      std::chrono::nanoseconds(max_wait_ns_.load(std::memory_order_relaxed));
+  stats.total_hold = std::chrono::nanoseconds(
+      total_hold_ns_.load(std::memory_order_relaxed));
+  stats.max_hold =
+      std::chrono::nanoseconds(max_hold_ns_.load(std::memory_order_relaxed));
+  return stats;
+}
+
+void InstrumentedMutex::lock() {
+  // The uncontended case only costs a clock read on top of std::mutex.
+  if (!mutex_.try_lock()) {
+    const auto start = Clock::now();
+    ATRACE_INT(counters_.waiters_counter_.c_str(),
+               counters_.waiters_.fetch_add(1) + 1);
+    mutex_.lock();
+    acquired_at_ = Clock::now();
+    ATRACE_INT(counters_.waiters_counter_.c_str(),
+               counters_.waiters_.fetch_sub(1) - 1);
+    // Never record a contended wait as 0, which stands for uncontended.
+    counters_.RecordAcquisition(std::max(
+        acquired_at_ - start, Clock::duration(std::chrono::nanoseconds(1))));
+    return;
+  }
+  acquired_at_ = Clock::now();
+  counters_.RecordAcquisition(std::chrono::nanoseconds(0));
+}
+
+bool InstrumentedMutex::try_lock() {
+  if (!mutex_.try_lock()) {
+    return false;
+  }
+  acquired_at_ = Clock::now();
+  counters_.RecordAcquisition(std::chrono::nanoseconds(0));
+  return true;
+}
+
+void InstrumentedMutex::unlock() {
+  const auto hold = Clock::now() - acquired_at_;
+  mutex_.unlock();
+  counters_.RecordRelease(hold);
+}
+
+std::vector<LockStats> GetLockStats() {
+  auto& registry = GetRegistry();
+  std::lock_guard lock(registry.mutex);
+  std::vector<LockStats> ret;
+  for (const auto& [_, counters] : registry.counters) {
+    ret.push_back(counters->GetStats());
+  }
+  return ret;
+}
+
+std::string FormatLockStats(const std::vector<LockStats>& stats) {
+  auto us = [](std::chrono::nanoseconds ns) {
+    return static_cast<long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(ns).count());
+  };
+  std::string ret;
+  StringAppendF(&ret, "  %-24s %10s %10s %12s %10s %12s %10s\n", "Lock",
+                "Acquired", "Contended", "Wait(us)", "MaxWait", "Hold(us)",
+                "MaxHold");
+  for (const auto& s : stats) {
+    StringAppendF(&ret, "  %-24s %10llu %10llu %12lld %10lld %12lld %10lld\n",
+                  s.name.c_str(),
+                  static_cast<unsigned long long>(s.acquisitions),
+                  static_cast<unsigned long long>(s.contended),
+                  us(s.total_wait), us(s.max_wait), us(s.total_hold),
+                  us(s.max_hold));
+  }
+  return ret;
+}
+
+}  // namespace apex
+}  // namespace android
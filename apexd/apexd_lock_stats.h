@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/thread_annotations.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+struct LockStats {
+  std::string name;
+  uint64_t acquisitions = 0;
+  // Acquisitions that had to wait for another thread to release the lock.
+  uint64_t contended = 0;
+  std::chrono::nanoseconds total_wait{0};
+  std::chrono::nanoseconds max_wait{0};
+  std::chrono::nanoseconds total_hold{0};
+  std::chrono::nanoseconds max_hold{0};
+};
+
+// Counters shared by all InstrumentedMutexes with the same name. They live
+// until apexd exits, so locks that are created per call accumulate too.
+class LockCounters {
+ public:
+  explicit LockCounters(const std::string& name);
+
+  void RecordAcquisition(std::chrono::nanoseconds wait);
+  void RecordRelease(std::chrono::nanoseconds hold);
+  LockStats GetStats() const;
+  // Number of threads currently waiting for a lock with this name.
+  int32_t GetWaiters() const { return waiters_.load(); }
+
+  // Returns counters for |name|, creating them on first use.
+  static LockCounters& Get(const std::string& name);
+
+ private:
+  friend class InstrumentedMutex;
+
+  const std::string name_;
+  // Names of the ATRACE counters, kept so that they outlive tracing calls.
+  const std::string waiters_counter_;
+  const std::string wait_counter_;
+  std::atomic<int32_t> waiters_{0};
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  std::atomic<int64_t> total_wait_ns_{0};
+  std::atomic<int64_t> max_wait_ns_{0};
+  std::atomic<int64_t> total_hold_ns_{0};
+  std::atomic<int64_t> max_hold_ns_{0};
+};
+
+// A std::mutex that records how often it is taken, how long threads wait for
+// it and how long it is held, under a name. Works with std::lock_guard and
+// std::unique_lock as well as the thread-safety annotations, e.g.
+// GUARDED_BY(mutex_) and REQUIRES(!mutex_). When contended, the number of
+// waiters and total wait time are also published as ATRACE counters.
+class CAPABILITY("mutex") InstrumentedMutex {
+ public:
+  explicit InstrumentedMutex(const std::string& name)
+      : counters_(LockCounters::Get(name)) {}
+  InstrumentedMutex(const InstrumentedMutex&) = delete;
+  InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+  void lock() ACQUIRE();
+  bool try_lock() TRY_ACQUIRE(true);
+  void unlock() RELEASE();
+
+  // For negative capabilities.
+  const InstrumentedMutex& operator!() const { return *this; }
+
+ private:
+  std::mutex mutex_;
+  LockCounters& counters_;
+  std::chrono::steady_clock::time_point acquired_at_;
+};
+
+// Returns stats of all named locks, sorted by name.
+std::vector<LockStats> GetLockStats();
+
+// Formats |stats| as a table for humans.
+std::string FormatLockStats(const std::vector<LockStats>& stats);
+
+}  // namespace apex
+}  // namespace android
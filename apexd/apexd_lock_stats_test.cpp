@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "apexd_lock_stats.h"
+
+namespace android {
+namespace apex {
+
+namespace {
+
+LockStats FindStats(const std::string& name) {
+  for (const auto& stats : GetLockStats()) {
+    if (stats.name == name) {
+      return stats;
+    }
+  }
+  return {};
+}
+
+}  // namespace
+
+TEST(ApexdLockStatsTest, CountsUncontendedAcquisitions) {
+  InstrumentedMutex mutex("test_uncontended");
+  {
+    std::lock_guard lock(mutex);
+  }
+  ASSERT_TRUE(mutex.try_lock());
+  mutex.unlock();
+
+  auto stats = FindStats("test_uncontended");
+  ASSERT_EQ(2u, stats.acquisitions);
+  ASSERT_EQ(0u, stats.contended);
+  ASSERT_EQ(0, stats.total_wait.count());
+}
+
+TEST(ApexdLockStatsTest, RecordsWaitAndHoldTime) {
+  InstrumentedMutex mutex("test_contended");
+  const auto& counters = LockCounters::Get("test_contended");
+  mutex.lock();
+  std::thread waiter([&]() { std::lock_guard lock(mutex); });
+  while (counters.GetWaiters() == 0) {
+    std::this_thread::yield();
+  }
+  // The waiter is blocked now. Keep it waiting for a measurable time.
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  // Another thread can't take the lock while it is held.
+  std::thread([&]() { ASSERT_FALSE(mutex.try_lock()); }).join();
+  mutex.unlock();
+  waiter.join();
+
+  auto stats = FindStats("test_contended");
+  ASSERT_EQ(2u, stats.acquisitions);
+  ASSERT_EQ(1u, stats.contended);
+  ASSERT_GE(stats.max_wait, std::chrono::milliseconds(20));
+  ASSERT_EQ(stats.total_wait, stats.max_wait);
+  ASSERT_GE(stats.max_hold, std::chrono::milliseconds(20));
+  ASSERT_GE(stats.total_hold, stats.max_hold);
+  ASSERT_EQ(0, counters.GetWaiters());
+}
+
+TEST(ApexdLockStatsTest, LocksWithSameNameShareStats) {
+  {
+    InstrumentedMutex mutex("test_shared");
+    std::lock_guard lock(mutex);
+  }
+  {
+    InstrumentedMutex mutex("test_shared");
+    std::lock_guard lock(mutex);
+  }
+  ASSERT_EQ(2u, FindStats("test_shared").acquisitions);
+}
+
+}  // namespace apex
+}  // namespace android
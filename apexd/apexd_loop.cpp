@@ -39,10 +39,12 @@
 #include <utils/Trace.h>
 
 #include <array>
+#include <atomic>
 #include <filesystem>
 #include <mutex>
 #include <string_view>
 
+#include "apexd_lock_stats.h"
 #include "apexd_utils.h"
 
 using android::base::Basename;
@@ -314,9 +316,70 @@ Result<void> PreAllocateLoopDevices(size_t num) {
   return {};
 }
 
-Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
-                                 const uint32_t image_offset,
-                                 const size_t image_size) {
+namespace {
+
+std::atomic_size_t gBufferedIoFallbacks = 0;
+
+// Checks that the loop device behind |device_fd| ended up with the requested
+// configuration, and turns on direct I/O if |want_direct_io| but the kernel
+// didn't enable it. Returns the effective I/O mode.
+Result<LoopIoMode> VerifyLoopDevice(int device_fd, uint32_t image_offset,
+                                    size_t image_size, bool want_direct_io) {
+  struct loop_info64 li;
+  if (ioctl(device_fd, LOOP_GET_STATUS64, &li) == -1) {
+    return ErrnoError() << "Failed to LOOP_GET_STATUS64";
+  }
+  if (li.lo_offset != image_offset || li.lo_sizelimit != image_size) {
+    return Error() << "Loop device has offset " << li.lo_offset
+                   << " and size limit " << li.lo_sizelimit << ", expected "
+                   << image_offset << " and " << image_size;
+  }
+  int block_size = 0;
+  if (ioctl(device_fd, BLKSSZGET, &block_size) == -1) {
+    PLOG(WARNING) << "Failed to BLKSSZGET";
+  } else if (block_size != 4096) {
+    LOG(WARNING) << "Loop device has block size " << block_size;
+  }
+
+  LoopIoMode mode;
+  if (li.lo_flags & LO_FLAGS_DIRECT_IO) {
+    mode.direct_io = true;
+    return mode;
+  }
+  if (!want_direct_io) {
+    mode.buffered_reason = "backing file system doesn't support O_DIRECT";
+    return mode;
+  }
+  // The kernel silently keeps buffered I/O if it thinks direct I/O isn't
+  // possible, e.g. when the offset isn't aligned to the logical block size of
+  // the backing device. Ask explicitly to find out why.
+  if (ioctl(device_fd, LOOP_SET_DIRECT_IO, 1) == -1) {
+    mode.buffered_reason =
+        StringPrintf("LOOP_SET_DIRECT_IO failed: %s", strerror(errno));
+    return mode;
+  }
+  mode.direct_io = true;
+  return mode;
+}
+
+}  // namespace
+
+size_t GetBufferedIoFallbackCount() { return gBufferedIoFallbacks; }
+
+Result<bool> IsDirectIoEnabled(const std::string& loop_device_path) {
+  const std::string path = StringPrintf("/sys/block/%s/loop/dio",
+                                        Basename(loop_device_path).c_str());
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  return android::base::Trim(content) == "1";
+}
+
+Result<LoopIoMode> ConfigureLoopDevice(const int device_fd,
+                                       const std::string& target,
+                                       const uint32_t image_offset,
+                                       const size_t image_size) {
   static bool use_loop_configure;
   static std::once_flag once_flag;
   std::call_once(once_flag, [&]() {
@@ -375,17 +438,15 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
     struct loop_config config;
     memset(&config, 0, sizeof(config));
     config.fd = target_fd.get();
-    config.info = li;
-    config.block_size = 4096;
     if (!use_buffered_io) {
-        li.lo_flags |= LO_FLAGS_DIRECT_IO;
+      li.lo_flags |= LO_FLAGS_DIRECT_IO;
     }
+    config.info = li;
+    config.block_size = 4096;
 
     if (ioctl(device_fd, LOOP_CONFIGURE, &config) == -1) {
       return ErrnoError() << "Failed to LOOP_CONFIGURE";
     }
-
-    return {};
   } else {
     if (ioctl(device_fd, LOOP_SET_FD, target_fd.get()) == -1) {
       return ErrnoError() << "Failed to LOOP_SET_FD";
@@ -423,7 +484,22 @@ Result<void> ConfigureLoopDevice(const int device_fd, const std::string& target,
       PLOG(WARNING) << "Failed to LOOP_SET_BLOCK_SIZE";
     }
   }
-  return {};
+
+  auto mode = VerifyLoopDevice(device_fd, image_offset, image_size,
+                               !use_buffered_io);
+  if (!mode.ok()) {
+    return mode.error();
+  }
+  if (!mode->direct_io) {
+    // Devices whose backing file system can't do direct I/O are configured
+    // with buffered I/O on purpose; only a refused request is a fallback.
+    if (!use_buffered_io) {
+      gBufferedIoFallbacks++;
+    }
+    LOG(WARNING) << "Loop device for " << target
+                 << " uses buffered I/O: " << mode->buffered_reason;
+  }
+  return mode;
 }
 
 Result<LoopbackDeviceUniqueFd> WaitForDevice(int num) {
@@ -476,7 +552,7 @@ Result<LoopbackDeviceUniqueFd> CreateLoopDevice(const std::string& target,
     return ErrnoError() << "Failed to open loop-control";
   }
 
-  static std::mutex mtx;
+  static InstrumentedMutex mtx("create_loop_device");
   std::lock_guard lock(mtx);
   int num = ioctl(ctl_fd.get(), LOOP_CTL_GET_FREE);
   if (num == -1) {
@@ -489,11 +565,12 @@ Result<LoopbackDeviceUniqueFd> CreateLoopDevice(const std::string& target,
   }
   CHECK_NE(loop_device->device_fd.get(), -1);
 
-  Result<void> configure_status = ConfigureLoopDevice(
+  Result<LoopIoMode> io_mode = ConfigureLoopDevice(
       loop_device->device_fd.get(), target, image_offset, image_size);
-  if (!configure_status.ok()) {
-    return configure_status.error();
+  if (!io_mode.ok()) {
+    return io_mode.error();
   }
+  loop_device->io_mode = std::move(*io_mode);
 
   return loop_device;
 }
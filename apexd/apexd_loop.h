@@ -29,20 +29,31 @@ namespace loop {
 
 using android::base::unique_fd;
 
+// Effective I/O mode of a configured loop device.
+struct LoopIoMode {
+  bool direct_io = false;
+  // Why the device uses buffered I/O. Empty if it uses direct I/O.
+  std::string buffered_reason;
+};
+
 struct LoopbackDeviceUniqueFd {
   unique_fd device_fd;
   std::string name;
+  LoopIoMode io_mode;
 
   LoopbackDeviceUniqueFd() {}
   LoopbackDeviceUniqueFd(unique_fd&& fd, const std::string& name)
       : device_fd(std::move(fd)), name(name) {}
 
   LoopbackDeviceUniqueFd(LoopbackDeviceUniqueFd&& fd) noexcept
-      : device_fd(std::move(fd.device_fd)), name(std::move(fd.name)) {}
+      : device_fd(std::move(fd.device_fd)),
+        name(std::move(fd.name)),
+        io_mode(std::move(fd.io_mode)) {}
   LoopbackDeviceUniqueFd& operator=(LoopbackDeviceUniqueFd&& other) noexcept {
     MaybeCloseBad();
     device_fd = std::move(other.device_fd);
     name = std::move(other.name);
+    io_mode = std::move(other.io_mode);
     return *this;
   }
 
@@ -71,6 +82,14 @@ android::base::Result<void> PreAllocateLoopDevices(size_t num);
 android::base::Result<LoopbackDeviceUniqueFd> CreateAndConfigureLoopDevice(
     const std::string& target, uint32_t image_offset, size_t image_size);
 
+// Reads whether |loop_device_path| currently uses direct I/O from sysfs.
+android::base::Result<bool> IsDirectIoEnabled(
+    const std::string& loop_device_path);
+
+// Returns number of loop devices configured by this process that ended up
+// using buffered I/O even though direct I/O was requested.
+size_t GetBufferedIoFallbackCount();
+
 using DestroyLoopFn =
     std::function<void(const std::string&, const std::string&)>;
 void DestroyLoopDevice(const std::string& path, const DestroyLoopFn& extra);
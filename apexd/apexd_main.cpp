@@ -22,9 +22,12 @@
 #include <ApexProperties.sysprop.h>
 #include <android-base/logging.h>
 
+#include <iostream>
+
 #include "apexd.h"
 #include "apexd_checkpoint_vold.h"
 #include "apexd_lifecycle.h"
+#include "apexd_pin.h"
 #include "apexservice.h"
 
 #include <android-base/properties.h>
@@ -77,6 +80,18 @@ int HandleSubcommand(char** argv) {
     return result;
   }
 
+  if (strcmp("--plan", argv[1]) == 0) {
+    SetDefaultTag("apexd-plan");
+    auto plan = android::apex::PlanActivation();
+    if (!plan.ok()) {
+      LOG(ERROR) << "Failed to plan activation: " << plan.error();
+      std::cerr << "Failed to plan activation: " << plan.error() << std::endl;
+      return 1;
+    }
+    std::cout << android::apex::FormatActivationPlanEntries(*plan);
+    return 0;
+  }
+
   if (strcmp("--vm", argv[1]) == 0) {
     SetDefaultTag("apexd-vm");
     LOG(INFO) << "VM subcommand detected";
@@ -191,13 +206,25 @@ int main(int /*argc*/, char** argv) {
     // complete.
     android::apex::OnAllPackagesActivated(/*is_bootstrap=*/false);
     lifecycle.WaitForBootStatus(android::apex::RevertActiveSessionsAndReboot);
-    // Run cleanup routine on boot complete.
-    // This should run before AllowServiceShutdown() to prevent
-    // service_manager killing apexd in the middle of the cleanup.
+    // Run cleanup routine on boot complete. It runs in the background, and
+    // has to finish before AllowServiceShutdown() to prevent service_manager
+    // killing apexd in the middle of the cleanup.
     android::apex::BootCompletedCleanup();
   }
 
-  android::apex::binder::AllowServiceShutdown();
+  auto allow_service_shutdown = []() {
+    android::apex::WaitForBootCompletedCleanup();
+    // No more pins from here on, since nothing would keep apexd alive to hold
+    // them.
+    android::apex::ApexPinner::GetInstance().Shutdown();
+    android::apex::binder::AllowServiceShutdown();
+  };
+  // Pinned pages are only kept locked while apexd is alive, so don't let the
+  // service exit until the pins are released.
+  if (!booting ||
+      !android::apex::PinBootCriticalApexes(allow_service_shutdown)) {
+    allow_service_shutdown();
+  }
 
   android::apex::binder::JoinThreadPool();
   return 1;
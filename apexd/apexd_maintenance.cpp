@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_maintenance.h"
+
+#include <android-base/logging.h>
+#include <utils/Trace.h>
+
+#include <thread>
+
+#include "apexd_utils.h"
+
+namespace android {
+namespace apex {
+
+MaintenanceExecutor& MaintenanceExecutor::GetInstance() {
+  static MaintenanceExecutor instance;
+  return instance;
+}
+
+void MaintenanceExecutor::Post(const std::string& name, Task task) {
+  std::lock_guard lock(mutex_);
+  tasks_.emplace(name, std::move(task));
+  if (!started_) {
+    std::thread(&MaintenanceExecutor::Run, this).detach();
+    started_ = true;
+  }
+  cv_.notify_all();
+}
+
+void MaintenanceExecutor::WaitForIdle() {
+  std::unique_lock lock(mutex_);
+  cv_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+}
+
+std::vector<MaintenanceTaskStats> MaintenanceExecutor::GetStats() const {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+void MaintenanceExecutor::Run() {
+  if (auto st = SetCurrentThreadIdlePriority(); !st.ok()) {
+    LOG(WARNING) << st.error();
+  }
+  while (true) {
+    std::pair<std::string, Task> task;
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return !tasks_.empty(); });
+      task = std::move(tasks_.front());
+      tasks_.pop();
+      running_++;
+    }
+
+    MaintenanceTaskStats stats;
+    stats.name = task.first;
+    const auto start = std::chrono::steady_clock::now();
+    {
+      ATRACE_NAME(task.first.c_str());
+      auto reclaimed = task.second();
+      if (reclaimed.ok()) {
+        stats.reclaimed_bytes = *reclaimed;
+      } else {
+        stats.ok = false;
+        LOG(ERROR) << task.first << " failed : " << reclaimed.error();
+      }
+    }
+    stats.duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    LOG(INFO) << task.first << " reclaimed " << stats.reclaimed_bytes
+              << " bytes in " << stats.duration.count() << "ms";
+
+    {
+      std::lock_guard lock(mutex_);
+      stats_.push_back(std::move(stats));
+      running_--;
+    }
+    cv_.notify_all();
+  }
+}
+
+}  // namespace apex
+}  // namespace android
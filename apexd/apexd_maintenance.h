@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+struct MaintenanceTaskStats {
+  std::string name;
+  uint64_t reclaimed_bytes = 0;
+  std::chrono::milliseconds duration{0};
+  bool ok = true;
+};
+
+// Runs housekeeping work, such as cleanup after boot completes, one task at a
+// time on a thread with SCHED_IDLE and idle I/O priority, so that it doesn't
+// compete with app launches.
+class MaintenanceExecutor {
+ public:
+  // A task returns the number of bytes of storage it reclaimed.
+  using Task = std::function<android::base::Result<uint64_t>()>;
+
+  static MaintenanceExecutor& GetInstance();
+
+  void Post(const std::string& name, Task task);
+
+  // Blocks until all posted tasks have finished.
+  void WaitForIdle();
+
+  // Returns stats of all tasks that have finished, in the order they ran.
+  std::vector<MaintenanceTaskStats> GetStats() const;
+
+ private:
+  MaintenanceExecutor() = default;
+  void Run();
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::queue<std::pair<std::string, Task>> tasks_;
+  size_t running_ = 0;
+  bool started_ = false;
+  std::vector<MaintenanceTaskStats> stats_;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/result.h>
+#include <gtest/gtest.h>
+
+#include "apexd_maintenance.h"
+
+namespace android {
+namespace apex {
+
+using android::base::Error;
+using android::base::Result;
+
+TEST(ApexdMaintenanceTest, RunsTasksInOrderAndRecordsStats) {
+  auto& executor = MaintenanceExecutor::GetInstance();
+  const size_t stats_before = executor.GetStats().size();
+  std::string order;
+  executor.Post("first", [&]() -> Result<uint64_t> {
+    order += "1";
+    return 4096;
+  });
+  executor.Post("second", [&]() -> Result<uint64_t> {
+    order += "2";
+    return Error() << "failed";
+  });
+  executor.WaitForIdle();
+
+  ASSERT_EQ("12", order);
+  auto stats = executor.GetStats();
+  ASSERT_EQ(stats_before + 2, stats.size());
+  ASSERT_EQ("first", stats[stats_before].name);
+  ASSERT_EQ(4096u, stats[stats_before].reclaimed_bytes);
+  ASSERT_TRUE(stats[stats_before].ok);
+  ASSERT_EQ("second", stats[stats_before + 1].name);
+  ASSERT_FALSE(stats[stats_before + 1].ok);
+}
+
+}  // namespace apex
+}  // namespace android
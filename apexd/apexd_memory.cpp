@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "apexd_memory.h"
+
+#include <android-base/chrono_utils.h>
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <malloc.h>
+
+#include <utility>
+
+using android::base::boot_clock;
+using android::base::Error;
+using android::base::ErrnoError;
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Result;
+using android::base::Split;
+using android::base::StringAppendF;
+using android::base::Trim;
+
+namespace android {
+namespace apex {
+
+Result<MemoryUsage> ParseProcStatus(const std::string& content) {
+  MemoryUsage usage;
+  const std::pair<const char*, uint64_t*> fields[] = {
+      {"VmRSS", &usage.rss_kb},         {"RssAnon", &usage.rss_anon_kb},
+      {"RssFile", &usage.rss_file_kb},  {"RssShmem", &usage.rss_shmem_kb},
+      {"VmSwap", &usage.swap_kb},
+  };
+  bool found_rss = false;
+  for (const auto& line : Split(content, "\n")) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    const std::string key = line.substr(0, colon);
+    for (const auto& [name, out] : fields) {
+      if (key != name) {
+        continue;
+      }
+      std::string value = Trim(line.substr(colon + 1));
+      if (!android::base::EndsWith(value, " kB") ||
+          !ParseUint(Trim(value.substr(0, value.size() - 3)), out)) {
+        return Error() << "Malformed " << key << " \"" << line << "\"";
+      }
+      found_rss |= out == &usage.rss_kb;
+    }
+  }
+  if (!found_rss) {
+    return Error() << "No VmRSS in process status";
+  }
+  return usage;
+}
+
+Result<MemoryUsage> ReadMemoryUsage() {
+  const std::string path = "/proc/self/status";
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  auto usage = ParseProcStatus(content);
+  if (!usage.ok()) {
+    return usage.error();
+  }
+#if defined(__BIONIC__)
+  struct mallinfo info = mallinfo();
+#else
+  struct mallinfo2 info = mallinfo2();
+#endif
+  usage->heap_allocated_bytes = info.uordblks;
+  usage->heap_free_bytes = info.fordblks;
+  return usage;
+}
+
+void TrimHeap() {
+#if defined(__BIONIC__)
+  // Bionic has no malloc_trim(); M_PURGE is its equivalent for both scudo
+  // and jemalloc.
+  mallopt(M_PURGE, 0);
+#else
+  malloc_trim(0);
+#endif
+}
+
+MemoryAccounting& MemoryAccounting::GetInstance() {
+  static MemoryAccounting instance;
+  return instance;
+}
+
+void MemoryAccounting::AddCheckpoint(const std::string& label,
+                                     const MemoryUsage& usage) {
+  auto uptime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      boot_clock::now().time_since_epoch());
+  std::lock_guard lock(mutex_);
+  checkpoints_.push_back({label, uptime, usage});
+}
+
+std::vector<MemoryCheckpoint> MemoryAccounting::GetCheckpoints() const {
+  std::lock_guard lock(mutex_);
+  return checkpoints_;
+}
+
+std::string FormatMemoryCheckpoints(
+    const std::vector<MemoryCheckpoint>& checkpoints) {
+  std::string ret;
+  StringAppendF(&ret, "  %-24s %10s %9s %9s %9s %9s %9s %12s %12s\n",
+                "Checkpoint", "Uptime(ms)", "RSS(kB)", "Anon(kB)", "File(kB)",
+                "Shmem(kB)", "Swap(kB)", "HeapUsed(B)", "HeapFree(B)");
+  for (const auto& checkpoint : checkpoints) {
+    const auto& usage = checkpoint.usage;
+    StringAppendF(
+        &ret, "  %-24s %10lld %9llu %9llu %9llu %9llu %9llu %12llu %12llu\n",
+        checkpoint.label.c_str(),
+        static_cast<long long>(checkpoint.uptime.count()),
+        static_cast<unsigned long long>(usage.rss_kb),
+        static_cast<unsigned long long>(usage.rss_anon_kb),
+        static_cast<unsigned long long>(usage.rss_file_kb),
+        static_cast<unsigned long long>(usage.rss_shmem_kb),
+        static_cast<unsigned long long>(usage.swap_kb),
+        static_cast<unsigned long long>(usage.heap_allocated_bytes),
+        static_cast<unsigned long long>(usage.heap_free_bytes));
+  }
+  return ret;
+}
+
+}  // namespace apex
+}  // namespace android
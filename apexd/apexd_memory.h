@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// Resident memory of apexd, from /proc/self/status, and how much of its heap
+// is in use, from the allocator.
+struct MemoryUsage {
+  uint64_t rss_kb = 0;
+  uint64_t rss_anon_kb = 0;
+  uint64_t rss_file_kb = 0;
+  uint64_t rss_shmem_kb = 0;
+  uint64_t swap_kb = 0;
+  uint64_t heap_allocated_bytes = 0;
+  uint64_t heap_free_bytes = 0;
+};
+
+struct MemoryCheckpoint {
+  std::string label;
+  std::chrono::milliseconds uptime;
+  MemoryUsage usage;
+};
+
+// Fills the fields of MemoryUsage that come from |content| of
+// /proc/<pid>/status. The heap fields are left at zero.
+android::base::Result<MemoryUsage> ParseProcStatus(const std::string& content);
+
+android::base::Result<MemoryUsage> ReadMemoryUsage();
+
+// Returns free heap pages to the kernel.
+void TrimHeap();
+
+// Keeps samples taken at interesting points, e.g. before and after apexd
+// trims its memory once boot completes.
+class MemoryAccounting {
+ public:
+  static MemoryAccounting& GetInstance();
+
+  void AddCheckpoint(const std::string& label, const MemoryUsage& usage);
+  std::vector<MemoryCheckpoint> GetCheckpoints() const;
+
+ private:
+  MemoryAccounting() = default;
+
+  mutable std::mutex mutex_;
+  std::vector<MemoryCheckpoint> checkpoints_;
+};
+
+// Formats |checkpoints| as a table for humans.
+std::string FormatMemoryCheckpoints(
+    const std::vector<MemoryCheckpoint>& checkpoints);
+
+}  // namespace apex
+}  // namespace android
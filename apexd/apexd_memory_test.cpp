@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "apexd_memory.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+
+TEST(ApexdMemoryTest, ParseProcStatus) {
+  auto usage = ParseProcStatus(
+      "Name:\tapexd\n"
+      "VmHWM:\t    9876 kB\n"
+      "VmRSS:\t    5432 kB\n"
+      "RssAnon:\t    2100 kB\n"
+      "RssFile:\t    3300 kB\n"
+      "RssShmem:\t      32 kB\n"
+      "VmSwap:\t       8 kB\n"
+      "Threads:\t5\n");
+  ASSERT_TRUE(IsOk(usage));
+  ASSERT_EQ(5432u, usage->rss_kb);
+  ASSERT_EQ(2100u, usage->rss_anon_kb);
+  ASSERT_EQ(3300u, usage->rss_file_kb);
+  ASSERT_EQ(32u, usage->rss_shmem_kb);
+  ASSERT_EQ(8u, usage->swap_kb);
+
+  ASSERT_FALSE(IsOk(ParseProcStatus("Name:\tapexd\n")));
+  ASSERT_FALSE(IsOk(ParseProcStatus("VmRSS:\t   lots kB\n")));
+}
+
+TEST(ApexdMemoryTest, ReadMemoryUsageOfSelf) {
+  auto usage = ReadMemoryUsage();
+  ASSERT_TRUE(IsOk(usage));
+  ASSERT_GT(usage->rss_kb, 0u);
+  ASSERT_GT(usage->heap_allocated_bytes, 0u);
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_mount.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <fcntl.h>
+#include <linux/mount.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+
+using android::base::ErrnoError;
+using android::base::Result;
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+// Not every libc has wrappers for these yet.
+int FsOpen(const char* fs_type, unsigned int flags) {
+  return syscall(__NR_fsopen, fs_type, flags);
+}
+
+int FsConfig(int fd, unsigned int cmd, const char* key, const void* value) {
+  return syscall(__NR_fsconfig, fd, cmd, key, value, 0);
+}
+
+int FsMount(int fd, unsigned int flags, unsigned int attr_flags) {
+  return syscall(__NR_fsmount, fd, flags, attr_flags);
+}
+
+int OpenTree(const char* path, unsigned int flags) {
+  return syscall(__NR_open_tree, AT_FDCWD, path, flags);
+}
+
+int MoveMount(int from_fd, const char* to_path) {
+  return syscall(__NR_move_mount, from_fd, "", AT_FDCWD, to_path,
+                 MOVE_MOUNT_F_EMPTY_PATH);
+}
+
+// Returns the last message the file system left in the log of |fs_fd|, which
+// usually says more than errno about why the superblock couldn't be created.
+std::string ReadFsContextLog(int fs_fd) {
+  std::string last;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(fs_fd, buf, sizeof(buf) - 1)) > 0) {
+    last.assign(buf, n);
+  }
+  return last;
+}
+
+unsigned int ToMountAttrs(unsigned long mount_flags) {
+  unsigned int attrs = 0;
+  if (mount_flags & MS_RDONLY) attrs |= MOUNT_ATTR_RDONLY;
+  if (mount_flags & MS_NOSUID) attrs |= MOUNT_ATTR_NOSUID;
+  if (mount_flags & MS_NODEV) attrs |= MOUNT_ATTR_NODEV;
+  if (mount_flags & MS_NOEXEC) attrs |= MOUNT_ATTR_NOEXEC;
+  if (mount_flags & MS_NOATIME) attrs |= MOUNT_ATTR_NOATIME;
+  return attrs;
+}
+
+std::atomic<bool>& NewMountApiEnabled() {
+  static std::atomic<bool> enabled([]() {
+    unique_fd fd(FsOpen("tmpfs", FSOPEN_CLOEXEC));
+    if (fd.get() == -1 && errno == ENOSYS) {
+      LOG(INFO) << "Kernel doesn't support the new mount API";
+      return false;
+    }
+    return true;
+  }());
+  return enabled;
+}
+
+}  // namespace
+
+bool SupportsNewMountApi() { return NewMountApiEnabled().load(); }
+
+void DisableNewMountApi() {
+  if (NewMountApiEnabled().exchange(false)) {
+    LOG(WARNING) << "Falling back to mount(2) for the rest of this run";
+  }
+}
+
+Result<DetachedMount> DetachedMount::Create(const std::string& source,
+                                            const std::string& fs_type,
+                                            unsigned long mount_flags) {
+  unique_fd fs_fd(FsOpen(fs_type.c_str(), FSOPEN_CLOEXEC));
+  if (fs_fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << fs_type << " file system";
+  }
+  if (FsConfig(fs_fd.get(), FSCONFIG_SET_STRING, "source", source.c_str()) !=
+      0) {
+    return ErrnoError() << "Failed to set source " << source;
+  }
+  // Flags that apply to the superblock rather than to the mount.
+  if ((mount_flags & MS_RDONLY) &&
+      FsConfig(fs_fd.get(), FSCONFIG_SET_FLAG, "ro", nullptr) != 0) {
+    return ErrnoError() << "Failed to make " << source << " read-only";
+  }
+  if ((mount_flags & MS_DIRSYNC) &&
+      FsConfig(fs_fd.get(), FSCONFIG_SET_FLAG, "dirsync", nullptr) != 0) {
+    return ErrnoError() << "Failed to set dirsync on " << source;
+  }
+  if (FsConfig(fs_fd.get(), FSCONFIG_CMD_CREATE, nullptr, nullptr) != 0) {
+    int saved_errno = errno;
+    std::string log = ReadFsContextLog(fs_fd.get());
+    errno = saved_errno;
+    return ErrnoError() << "Failed to create " << fs_type << " superblock for "
+                        << source << (log.empty() ? "" : " (" + log + ")");
+  }
+  unique_fd mount_fd(
+      FsMount(fs_fd.get(), FSMOUNT_CLOEXEC, ToMountAttrs(mount_flags)));
+  if (mount_fd.get() == -1) {
+    return ErrnoError() << "Failed to mount " << source;
+  }
+  return DetachedMount(std::move(mount_fd));
+}
+
+std::string DetachedMount::GetPath() const {
+  return StringPrintf("/proc/self/fd/%d", fd_.get());
+}
+
+Result<void> DetachedMount::AttachTo(const std::string& target) {
+  if (MoveMount(fd_.get(), target.c_str()) != 0) {
+    return ErrnoError() << "Failed to attach mount to " << target;
+  }
+  // The mount now belongs to the tree, closing the fd won't unmount it.
+  fd_.reset();
+  return {};
+}
+
+Result<void> CloneMount(const std::string& source, const std::string& target) {
+  unique_fd tree_fd(
+      OpenTree(source.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC));
+  if (tree_fd.get() == -1) {
+    return ErrnoError() << "Failed to clone mount at " << source;
+  }
+  if (MoveMount(tree_fd.get(), target.c_str()) != 0) {
+    return ErrnoError() << "Failed to attach clone of " << source << " to "
+                        << target;
+  }
+  return {};
+}
+
+}  // namespace apex
+}  // namespace android
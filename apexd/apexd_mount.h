@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+#include <android-base/unique_fd.h>
+
+#include <string>
+
+namespace android {
+namespace apex {
+
+// Returns whether the kernel supports fsopen(2), fsmount(2), open_tree(2) and
+// move_mount(2), and they haven't been disabled. The result is cached after
+// the first call.
+bool SupportsNewMountApi();
+
+// Makes SupportsNewMountApi() return false from now on. Called when the new
+// API failed where mount(2) succeeded, e.g. because a security policy only
+// allows the latter, so that later mounts don't pay for the failed attempt.
+void DisableNewMountApi();
+
+// A mount created with the new mount API that is not attached anywhere in the
+// file system tree yet. Its content can already be accessed through
+// GetPath(), which allows checking it before anyone else can see it. Dropping
+// an unattached mount unmounts it.
+class DetachedMount {
+ public:
+  // Mounts |source| as |fs_type|. |mount_flags| are MS_* flags as passed to
+  // mount(2).
+  static android::base::Result<DetachedMount> Create(
+      const std::string& source, const std::string& fs_type,
+      unsigned long mount_flags);
+
+  // Path to the root of the mount, valid in this process while the object is
+  // alive.
+  std::string GetPath() const;
+
+  // Attaches the mount on |target|, which must be an existing directory.
+  android::base::Result<void> AttachTo(const std::string& target);
+
+ private:
+  explicit DetachedMount(android::base::unique_fd fd) : fd_(std::move(fd)) {}
+
+  android::base::unique_fd fd_;
+};
+
+// Attaches a clone of the mount at |source| on |target|. This is the same as
+// a MS_BIND mount, but doesn't resolve |source| again once it is opened.
+android::base::Result<void> CloneMount(const std::string& source,
+                                       const std::string& target);
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/mount.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "apexd_mount.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::ReadFileToString;
+using android::base::WriteStringToFile;
+
+TEST(ApexdMountApiTest, DetachedMountIsInvisibleUntilAttached) {
+  if (!SupportsNewMountApi()) {
+    GTEST_SKIP() << "Kernel doesn't support the new mount API";
+  }
+  TemporaryDir versioned;
+  TemporaryDir unversioned;
+
+  {
+    auto mount = DetachedMount::Create("none", "tmpfs", MS_NODEV | MS_NOEXEC);
+    ASSERT_TRUE(IsOk(mount));
+    ASSERT_TRUE(
+        WriteStringToFile("manifest", mount->GetPath() + "/apex_manifest.pb"));
+    ASSERT_NE(0, access((std::string(versioned.path) + "/apex_manifest.pb")
+                            .c_str(),
+                        F_OK));
+    ASSERT_TRUE(IsOk(mount->AttachTo(versioned.path)));
+  }
+  ASSERT_TRUE(IsOk(CloneMount(versioned.path, unversioned.path)));
+
+  std::string content;
+  ASSERT_TRUE(ReadFileToString(
+      std::string(unversioned.path) + "/apex_manifest.pb", &content));
+  ASSERT_EQ("manifest", content);
+
+  ASSERT_EQ(0, umount2(unversioned.path, UMOUNT_NOFOLLOW));
+  ASSERT_EQ(0, umount2(versioned.path, UMOUNT_NOFOLLOW));
+}
+
+TEST(ApexdMountApiTest, CreateFailsForMissingSource) {
+  if (!SupportsNewMountApi()) {
+    GTEST_SKIP() << "Kernel doesn't support the new mount API";
+  }
+  auto mount = DetachedMount::Create("/dev/block/apexd-does-not-exist", "ext4",
+                                     MS_RDONLY);
+  ASSERT_FALSE(IsOk(mount));
+}
+
+}  // namespace apex
+}  // namespace android
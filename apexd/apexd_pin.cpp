@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_pin.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "apexd_prefetch.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::Result;
+using android::base::unique_fd;
+using android::base::WriteStringToFd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+static constexpr const char* kMemoryPressureFile = "/proc/pressure/memory";
+// Release pins once tasks are fully stalled on memory for 100ms within a 1s
+// window. See Documentation/accounting/psi.rst.
+static constexpr const char* kMemoryPressureTrigger = "full 100000 1000000";
+
+}  // namespace
+
+ApexPinner& ApexPinner::GetInstance() {
+  static ApexPinner instance;
+  return instance;
+}
+
+ApexPinner::~ApexPinner() {
+  StopMemoryPressureMonitor();
+  ReleaseAll();
+}
+
+Result<void> ApexPinner::Pin(const std::vector<PinTarget>& targets,
+                             uint64_t budget_bytes) {
+  ATRACE_NAME("ApexPinner::Pin");
+  std::lock_guard lock(mutex_);
+  return PinLocked(targets, budget_bytes);
+}
+
+Result<void> ApexPinner::PinLocked(const std::vector<PinTarget>& targets,
+                                   uint64_t budget_bytes) {
+  if (shut_down_) {
+    return Error() << "apexd is shutting down";
+  }
+  ReleaseAllLocked();
+  targets_ = targets;
+  budget_bytes_ = budget_bytes;
+
+  for (const auto& target : targets) {
+    if (pinned_bytes_ >= budget_bytes_) {
+      break;
+    }
+    // The resident pages right after boot are the ones worth keeping.
+    auto hot = RecordPrefetchProfile(target.mount_point, /*root_digest=*/"");
+    if (!hot.ok()) {
+      LOG(WARNING) << "Failed to find hot extents of " << target.apex_name
+                   << " : " << hot.error();
+      continue;
+    }
+    PinnedApex pinned;
+    pinned.stats.apex_name = target.apex_name;
+    std::string open_path;
+    unique_fd fd;
+    for (const auto& extent : hot->extents) {
+      if (pinned_bytes_ >= budget_bytes_) {
+        break;
+      }
+      if (extent.path != open_path) {
+        open_path = extent.path;
+        const std::string path = target.mount_point + "/" + extent.path;
+        fd.reset(
+            TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (fd.get() == -1) {
+          PLOG(WARNING) << "Failed to open " << path;
+          continue;
+        }
+      }
+      if (fd.get() == -1) {
+        continue;
+      }
+      size_t length = std::min(extent.length, budget_bytes_ - pinned_bytes_);
+      length -= length % getpagesize();
+      if (length == 0) {
+        break;
+      }
+      void* addr =
+          mmap(nullptr, length, PROT_READ, MAP_SHARED, fd.get(), extent.offset);
+      if (addr == MAP_FAILED) {
+        PLOG(WARNING) << "Failed to mmap " << extent.path;
+        continue;
+      }
+      if (mlock(addr, length) != 0) {
+        PLOG(WARNING) << "Failed to mlock " << extent.path;
+        munmap(addr, length);
+        continue;
+      }
+      pinned.ranges.push_back({addr, length});
+      pinned.stats.pinned_bytes += length;
+      pinned.stats.pinned_extents++;
+      pinned_bytes_ += length;
+    }
+    if (!pinned.ranges.empty()) {
+      LOG(INFO) << "Pinned " << pinned.stats.pinned_bytes << " bytes of "
+                << target.apex_name;
+      pinned_.push_back(std::move(pinned));
+    }
+  }
+  return {};
+}
+
+Result<void> ApexPinner::SetBudget(uint64_t budget_bytes) {
+  std::lock_guard lock(mutex_);
+  // Pins are only safe to hold while something releases them under memory
+  // pressure.
+  if (!monitoring_) {
+    return Error() << "Memory pressure monitor is not running";
+  }
+  const std::vector<PinTarget> targets = targets_;
+  return PinLocked(targets, budget_bytes);
+}
+
+void ApexPinner::ReleaseAll() {
+  std::lock_guard lock(mutex_);
+  ReleaseAllLocked();
+}
+
+void ApexPinner::Shutdown() {
+  std::lock_guard lock(mutex_);
+  shut_down_ = true;
+  ReleaseAllLocked();
+}
+
+void ApexPinner::ReleaseAllLocked() {
+  for (const auto& apex : pinned_) {
+    for (const auto& range : apex.ranges) {
+      munmap(range.addr, range.length);
+    }
+  }
+  pinned_.clear();
+  pinned_bytes_ = 0;
+}
+
+Result<void> ApexPinner::StartMemoryPressureMonitor(
+    std::function<void()> on_release) {
+  StopMemoryPressureMonitor();
+  unique_fd fd(TEMP_FAILURE_RETRY(
+      open(kMemoryPressureFile, O_RDWR | O_NONBLOCK | O_CLOEXEC)));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open " << kMemoryPressureFile;
+  }
+  if (!WriteStringToFd(kMemoryPressureTrigger, fd.get())) {
+    return ErrnoError() << "Failed to register memory pressure trigger";
+  }
+  unique_fd stop_fd(eventfd(0, EFD_CLOEXEC));
+  if (stop_fd.get() == -1) {
+    return ErrnoError() << "Failed to create eventfd";
+  }
+  std::lock_guard lock(mutex_);
+  monitoring_ = true;
+  monitor_ = std::thread([this, fd = std::move(fd), stop_fd = stop_fd.get(),
+                          on_release]() {
+    pollfd pfds[] = {
+        {.fd = fd.get(), .events = POLLPRI, .revents = 0},
+        {.fd = stop_fd, .events = POLLIN, .revents = 0},
+    };
+    while (true) {
+      int ret = TEMP_FAILURE_RETRY(poll(pfds, 2, -1));
+      if (ret > 0 && (pfds[1].revents & POLLIN)) {
+        std::lock_guard lock(mutex_);
+        monitoring_ = false;
+        return;
+      }
+      if (ret < 0 || (pfds[0].revents & POLLERR)) {
+        PLOG(ERROR) << "Stopped monitoring memory pressure";
+        break;
+      }
+      if (pfds[0].revents & POLLPRI) {
+        LOG(INFO) << "Memory pressure detected";
+        break;
+      }
+    }
+    {
+      std::lock_guard lock(mutex_);
+      LOG(INFO) << "Releasing " << pinned_bytes_ << " pinned bytes";
+      monitoring_ = false;
+      ReleaseAllLocked();
+    }
+    if (on_release) {
+      on_release();
+    }
+  });
+  monitor_stop_fd_ = std::move(stop_fd);
+  return {};
+}
+
+void ApexPinner::StopMemoryPressureMonitor() {
+  std::thread monitor;
+  {
+    std::lock_guard lock(mutex_);
+    monitor = std::move(monitor_);
+    if (monitor_stop_fd_.get() != -1) {
+      const uint64_t one = 1;
+      if (TEMP_FAILURE_RETRY(
+              write(monitor_stop_fd_.get(), &one, sizeof(one))) == -1) {
+        PLOG(ERROR) << "Failed to stop the memory pressure monitor";
+      }
+    }
+  }
+  if (!monitor.joinable()) {
+    return;
+  }
+  // |on_release| may start a new monitor from the old one, which is about to
+  // exit anyway.
+  if (monitor.get_id() == std::this_thread::get_id()) {
+    monitor.detach();
+    return;
+  }
+  monitor.join();
+}
+
+uint64_t ApexPinner::GetBudget() const {
+  std::lock_guard lock(mutex_);
+  return budget_bytes_;
+}
+
+uint64_t ApexPinner::GetPinnedBytes() const {
+  std::lock_guard lock(mutex_);
+  return pinned_bytes_;
+}
+
+std::vector<PinnedApexStats> ApexPinner::GetStats() const {
+  std::lock_guard lock(mutex_);
+  std::vector<PinnedApexStats> ret;
+  for (const auto& apex : pinned_) {
+    ret.push_back(apex.stats);
+  }
+  return ret;
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+#include <android-base/unique_fd.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+struct PinnedApexStats {
+  std::string apex_name;
+  uint64_t pinned_bytes = 0;
+  size_t pinned_extents = 0;
+};
+
+// Keeps hot pages of selected APEXes locked in memory, so that they are not
+// evicted and refaulted through dm-verity under memory pressure. Pins only
+// live as long as the process holding them.
+class ApexPinner {
+ public:
+  struct PinTarget {
+    std::string apex_name;
+    std::string mount_point;
+  };
+
+  static ApexPinner& GetInstance();
+
+  // apexd pins through GetInstance(). Separate instances are for tests.
+  ApexPinner() = default;
+  ApexPinner(const ApexPinner&) = delete;
+  ApexPinner& operator=(const ApexPinner&) = delete;
+  // Stops the memory pressure monitor and releases all pins.
+  ~ApexPinner();
+
+  // Pins the pages of |targets| that are currently resident in the page
+  // cache, in the given order, until |budget_bytes| is used up. Releases any
+  // previously held pins first.
+  android::base::Result<void> Pin(const std::vector<PinTarget>& targets,
+                                  uint64_t budget_bytes);
+
+  // Changes the budget and re-pins the last set of targets with it. Fails if
+  // the memory pressure monitor isn't running, e.g. because it already
+  // released the pins, or after Shutdown().
+  android::base::Result<void> SetBudget(uint64_t budget_bytes);
+
+  void ReleaseAll();
+
+  // Releases all pins and refuses to pin again. Called once apexd may exit.
+  void Shutdown();
+
+  // Starts a thread that releases all pins once the kernel reports memory
+  // pressure through PSI, or if it can't monitor it anymore, then calls
+  // |on_release|. Replaces the monitor started before, if any.
+  android::base::Result<void> StartMemoryPressureMonitor(
+      std::function<void()> on_release);
+
+  uint64_t GetBudget() const;
+  uint64_t GetPinnedBytes() const;
+  std::vector<PinnedApexStats> GetStats() const;
+
+ private:
+  struct PinnedRange {
+    void* addr;
+    size_t length;
+  };
+  struct PinnedApex {
+    PinnedApexStats stats;
+    std::vector<PinnedRange> ranges;
+  };
+
+  android::base::Result<void> PinLocked(const std::vector<PinTarget>& targets,
+                                        uint64_t budget_bytes);
+  void ReleaseAllLocked();
+  void StopMemoryPressureMonitor();
+
+  mutable std::mutex mutex_;
+  std::vector<PinTarget> targets_;
+  std::vector<PinnedApex> pinned_;
+  uint64_t budget_bytes_ = 0;
+  uint64_t pinned_bytes_ = 0;
+  bool monitoring_ = false;
+  bool shut_down_ = false;
+  // Wakes up |monitor_| to make it exit without releasing anything.
+  android::base::unique_fd monitor_stop_fd_;
+  std::thread monitor_;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include "apexd_pin.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::WriteStringToFile;
+
+TEST(ApexdPinTest, PinsWithinBudget) {
+  TemporaryDir td;
+  const size_t page_size = getpagesize();
+  // Freshly written pages are resident in the page cache.
+  ASSERT_TRUE(WriteStringToFile(std::string(8 * page_size, 'a'),
+                                std::string(td.path) + "/file"));
+
+  ApexPinner pinner;
+  ASSERT_TRUE(IsOk(pinner.Pin({{"com.android.foo", td.path}}, 2 * page_size)));
+  ASSERT_EQ(2 * page_size, pinner.GetPinnedBytes());
+  auto stats = pinner.GetStats();
+  ASSERT_EQ(1u, stats.size());
+  ASSERT_EQ("com.android.foo", stats[0].apex_name);
+  ASSERT_EQ(2 * page_size, stats[0].pinned_bytes);
+
+  // Nothing would release more pins under memory pressure.
+  ASSERT_FALSE(IsOk(pinner.SetBudget(4 * page_size)));
+  ASSERT_EQ(2 * page_size, pinner.GetPinnedBytes());
+
+  if (IsOk(pinner.StartMemoryPressureMonitor(nullptr))) {
+    ASSERT_TRUE(IsOk(pinner.SetBudget(4 * page_size)));
+    ASSERT_EQ(4 * page_size, pinner.GetPinnedBytes());
+  }
+
+  pinner.ReleaseAll();
+  ASSERT_EQ(0u, pinner.GetPinnedBytes());
+  ASSERT_TRUE(pinner.GetStats().empty());
+}
+
+TEST(ApexdPinTest, RefusesToPinAfterShutdown) {
+  TemporaryDir td;
+  const size_t page_size = getpagesize();
+  ASSERT_TRUE(WriteStringToFile(std::string(4 * page_size, 'a'),
+                                std::string(td.path) + "/file"));
+
+  ApexPinner pinner;
+  ASSERT_TRUE(IsOk(pinner.Pin({{"com.android.foo", td.path}}, page_size)));
+  ASSERT_EQ(page_size, pinner.GetPinnedBytes());
+
+  pinner.Shutdown();
+  ASSERT_EQ(0u, pinner.GetPinnedBytes());
+  ASSERT_FALSE(IsOk(pinner.Pin({{"com.android.foo", td.path}}, page_size)));
+  ASSERT_FALSE(IsOk(pinner.SetBudget(page_size)));
+  ASSERT_EQ(0u, pinner.GetPinnedBytes());
+}
+
+}  // namespace apex
+}  // namespace android
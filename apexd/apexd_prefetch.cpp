@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+
+#include "apexd_prefetch.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/scopeguard.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utils/Trace.h>
+
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <thread>
+
+#include "apexd_utils.h"
+
+using android::base::ConsumePrefix;
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::ParseUint;
+using android::base::ReadFileToString;
+using android::base::Result;
+using android::base::Split;
+using android::base::unique_fd;
+using android::base::WriteStringToFile;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+static constexpr const char* kProfileSuffix = ".prefetch";
+static constexpr const char* kDigestPrefix = "digest ";
+// Upper bound on the number of extents kept per APEX, so that a pathological
+// boot can't produce a profile that costs more to replay than it saves.
+static constexpr size_t kMaxExtentsPerProfile = 4096;
+static constexpr int kPrefetchNiceLevel = 19;
+
+// Appends runs of resident pages of |fd| to |extents|.
+Result<void> CollectResidentExtents(int fd, uint64_t file_size,
+                                    const std::string& rel_path,
+                                    std::vector<PrefetchExtent>* extents) {
+  const uint64_t page_size = getpagesize();
+  void* addr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    return ErrnoError() << "Failed to mmap " << rel_path;
+  }
+  auto unmap = android::base::make_scope_guard(
+      [addr, file_size]() { munmap(addr, file_size); });
+
+  const uint64_t pages = (file_size + page_size - 1) / page_size;
+  std::vector<unsigned char> vec(pages);
+  if (mincore(addr, file_size, vec.data()) != 0) {
+    return ErrnoError() << "Failed to mincore " << rel_path;
+  }
+  uint64_t run_start = 0;
+  bool in_run = false;
+  for (uint64_t i = 0; i <= pages; i++) {
+    bool resident = i < pages && (vec[i] & 1);
+    if (resident && !in_run) {
+      run_start = i;
+      in_run = true;
+    } else if (!resident && in_run) {
+      extents->push_back({rel_path, run_start * page_size,
+                          (i - run_start) * page_size});
+      in_run = false;
+    }
+  }
+  return {};
+}
+
+class PrefetchWorker {
+ public:
+  static PrefetchWorker& GetInstance() {
+    static PrefetchWorker instance;
+    return instance;
+  }
+
+  void Post(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push(std::move(task));
+    if (!started_) {
+      std::thread(&PrefetchWorker::Run, this).detach();
+      started_ = true;
+    }
+    cv_.notify_one();
+  }
+
+ private:
+  void Run() {
+    if (auto st = SetCurrentThreadBackgroundPriority(kPrefetchNiceLevel);
+        !st.ok()) {
+      LOG(WARNING) << st.error();
+    }
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !tasks_.empty(); });
+        task = std::move(tasks_.front());
+        tasks_.pop();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::queue<std::function<void()>> tasks_;
+  bool started_ = false;
+};
+
+}  // namespace
+
+std::string GetPrefetchProfilePath(const std::string& profile_dir,
+                                   const std::string& package_id) {
+  return profile_dir + "/" + package_id + kProfileSuffix;
+}
+
+Result<void> WritePrefetchProfile(const std::string& path,
+                                  const PrefetchProfile& profile) {
+  std::stringstream out;
+  out << kDigestPrefix << profile.root_digest << "\n";
+  for (const auto& extent : profile.extents) {
+    // Path goes last so that it may contain spaces.
+    out << extent.offset << " " << extent.length << " " << extent.path << "\n";
+  }
+  const std::string tmp_path = path + ".tmp";
+  if (!WriteStringToFile(out.str(), tmp_path)) {
+    return ErrnoError() << "Failed to write " << tmp_path;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    return ErrnoError() << "Failed to rename " << tmp_path << " to " << path;
+  }
+  return {};
+}
+
+Result<PrefetchProfile> ReadPrefetchProfile(
+    const std::string& path, const std::string& expected_root_digest) {
+  std::string content;
+  if (!ReadFileToString(path, &content)) {
+    return ErrnoError() << "Failed to read " << path;
+  }
+  auto lines = Split(content, "\n");
+  PrefetchProfile profile;
+  if (lines.empty() || !ConsumePrefix(&lines[0], kDigestPrefix)) {
+    return Error() << path << " has no root digest";
+  }
+  profile.root_digest = lines[0];
+  if (profile.root_digest != expected_root_digest) {
+    return Error() << path << " was recorded for root digest "
+                   << profile.root_digest << " but payload has "
+                   << expected_root_digest;
+  }
+  for (size_t i = 1; i < lines.size(); i++) {
+    if (lines[i].empty()) {
+      continue;
+    }
+    auto fields = Split(lines[i], " ");
+    if (fields.size() < 3) {
+      return Error() << "Malformed line " << i << " in " << path;
+    }
+    PrefetchExtent extent;
+    if (!ParseUint(fields[0], &extent.offset) ||
+        !ParseUint(fields[1], &extent.length)) {
+      return Error() << "Malformed extent on line " << i << " in " << path;
+    }
+    extent.path = lines[i].substr(fields[0].size() + fields[1].size() + 2);
+    profile.extents.push_back(std::move(extent));
+  }
+  return profile;
+}
+
+Result<PrefetchProfile> RecordPrefetchProfile(const std::string& mount_point,
+                                              const std::string& root_digest) {
+  ATRACE_NAME("RecordPrefetchProfile");
+  namespace fs = std::filesystem;
+  PrefetchProfile profile;
+  profile.root_digest = root_digest;
+
+  std::error_code ec;
+  auto it = fs::recursive_directory_iterator(mount_point, ec);
+  auto end = fs::recursive_directory_iterator();
+  for (; !ec && it != end; it.increment(ec)) {
+    if (profile.extents.size() >= kMaxExtentsPerProfile) {
+      break;
+    }
+    if (!it->is_regular_file(ec) || ec) {
+      ec.clear();
+      continue;
+    }
+    const std::string path = it->path();
+    unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (fd.get() == -1) {
+      PLOG(WARNING) << "Failed to open " << path;
+      continue;
+    }
+    struct stat st;
+    if (fstat(fd.get(), &st) != 0 || st.st_size == 0) {
+      continue;
+    }
+    const std::string rel_path = path.substr(mount_point.size() + 1);
+    auto status = CollectResidentExtents(fd.get(), st.st_size, rel_path,
+                                         &profile.extents);
+    if (!status.ok()) {
+      LOG(WARNING) << status.error();
+    }
+  }
+  if (ec) {
+    return Error() << "Failed to walk " << mount_point << " : "
+                   << ec.message();
+  }
+  if (profile.extents.size() > kMaxExtentsPerProfile) {
+    profile.extents.resize(kMaxExtentsPerProfile);
+  }
+  return profile;
+}
+
+Result<uint64_t> ReplayPrefetchProfile(const std::string& mount_point,
+                                       const PrefetchProfile& profile) {
+  ATRACE_NAME("ReplayPrefetchProfile");
+  uint64_t requested = 0;
+  std::string open_path;
+  unique_fd fd;
+  for (const auto& extent : profile.extents) {
+    // Extents of the same file are stored next to each other.
+    if (extent.path != open_path) {
+      open_path = extent.path;
+      const std::string path = mount_point + "/" + extent.path;
+      fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+      if (fd.get() == -1) {
+        PLOG(VERBOSE) << "Skipping prefetch of " << path;
+        continue;
+      }
+    }
+    if (fd.get() == -1) {
+      continue;
+    }
+    int ret = posix_fadvise(fd.get(), extent.offset, extent.length,
+                            POSIX_FADV_WILLNEED);
+    if (ret != 0) {
+      return Error() << "posix_fadvise failed for " << extent.path << " : "
+                     << strerror(ret);
+    }
+    requested += extent.length;
+  }
+  return requested;
+}
+
+void SchedulePrefetch(const std::string& profile_dir,
+                      const std::string& package_id,
+                      const std::string& mount_point,
+                      const std::string& root_digest) {
+  const std::string path = GetPrefetchProfilePath(profile_dir, package_id);
+  if (access(path.c_str(), F_OK) != 0) {
+    return;
+  }
+  PrefetchWorker::GetInstance().Post([path, mount_point, root_digest]() {
+    auto profile = ReadPrefetchProfile(path, root_digest);
+    if (!profile.ok()) {
+      LOG(INFO) << "Discarding prefetch profile: " << profile.error();
+      if (unlink(path.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Failed to delete " << path;
+      }
+      return;
+    }
+    auto requested = ReplayPrefetchProfile(mount_point, *profile);
+    if (!requested.ok()) {
+      LOG(WARNING) << "Failed to prefetch " << mount_point << " : "
+                   << requested.error();
+      return;
+    }
+    LOG(VERBOSE) << "Prefetched " << *requested << " bytes of " << mount_point;
+  });
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace apex {
+
+// A range of a file inside a mounted APEX that was read during boot. |path| is
+// relative to the mount point of the APEX.
+struct PrefetchExtent {
+  std::string path;
+  uint64_t offset;
+  uint64_t length;
+};
+
+// Set of extents read from a single APEX version during a boot. A profile is
+// only valid for the payload it was recorded from, which is identified by its
+// dm-verity |root_digest|.
+struct PrefetchProfile {
+  std::string root_digest;
+  std::vector<PrefetchExtent> extents;
+};
+
+// Returns path of the profile for the APEX with the given |package_id| inside
+// |profile_dir|.
+std::string GetPrefetchProfilePath(const std::string& profile_dir,
+                                   const std::string& package_id);
+
+android::base::Result<void> WritePrefetchProfile(
+    const std::string& path, const PrefetchProfile& profile);
+
+// Reads the profile at |path|. Fails if the profile was recorded for a payload
+// with a root digest different from |expected_root_digest|.
+android::base::Result<PrefetchProfile> ReadPrefetchProfile(
+    const std::string& path, const std::string& expected_root_digest);
+
+// Builds a profile from the pages of files under |mount_point| that are
+// currently resident in the page cache.
+android::base::Result<PrefetchProfile> RecordPrefetchProfile(
+    const std::string& mount_point, const std::string& root_digest);
+
+// Issues POSIX_FADV_WILLNEED for every extent of |profile| under
+// |mount_point|. Returns the number of bytes requested.
+android::base::Result<uint64_t> ReplayPrefetchProfile(
+    const std::string& mount_point, const PrefetchProfile& profile);
+
+// Replays the profile for |package_id| mounted at |mount_point| on a
+// background thread with idle I/O priority. Profiles that do not match
+// |root_digest| are deleted.
+void SchedulePrefetch(const std::string& profile_dir,
+                      const std::string& package_id,
+                      const std::string& mount_point,
+                      const std::string& root_digest);
+
+}  // namespace apex
+}  // namespace android
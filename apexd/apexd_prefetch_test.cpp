@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+
+#include "apexd_prefetch.h"
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using android::base::StringPrintf;
+using android::base::WriteStringToFile;
+
+TEST(ApexdPrefetchTest, WriteAndReadProfile) {
+  TemporaryDir td;
+  auto path = GetPrefetchProfilePath(td.path, "com.android.foo@1");
+
+  PrefetchProfile profile;
+  profile.root_digest = "deadbeef";
+  profile.extents.push_back({"lib64/libfoo.so", 0, 8192});
+  profile.extents.push_back({"etc/with space.txt", 4096, 4096});
+  ASSERT_TRUE(IsOk(WritePrefetchProfile(path, profile)));
+
+  auto read = ReadPrefetchProfile(path, "deadbeef");
+  ASSERT_TRUE(IsOk(read));
+  ASSERT_EQ(2u, read->extents.size());
+  ASSERT_EQ("lib64/libfoo.so", read->extents[0].path);
+  ASSERT_EQ(0u, read->extents[0].offset);
+  ASSERT_EQ(8192u, read->extents[0].length);
+  ASSERT_EQ("etc/with space.txt", read->extents[1].path);
+  ASSERT_EQ(4096u, read->extents[1].offset);
+}
+
+TEST(ApexdPrefetchTest, ProfileInvalidatedByRootDigest) {
+  TemporaryDir td;
+  auto path = GetPrefetchProfilePath(td.path, "com.android.foo@1");
+
+  PrefetchProfile profile;
+  profile.root_digest = "deadbeef";
+  ASSERT_TRUE(IsOk(WritePrefetchProfile(path, profile)));
+
+  ASSERT_FALSE(IsOk(ReadPrefetchProfile(path, "cafebabe")));
+}
+
+TEST(ApexdPrefetchTest, RecordAndReplayProfile) {
+  TemporaryDir td;
+  auto sub_dir = StringPrintf("%s/etc", td.path);
+  ASSERT_EQ(0, mkdir(sub_dir.c_str(), 0755));
+  // Freshly written pages are resident in the page cache.
+  ASSERT_TRUE(WriteStringToFile(std::string(16384, 'a'), sub_dir + "/file"));
+
+  auto profile = RecordPrefetchProfile(td.path, "deadbeef");
+  ASSERT_TRUE(IsOk(profile));
+  ASSERT_EQ("deadbeef", profile->root_digest);
+  ASSERT_FALSE(profile->extents.empty());
+  ASSERT_EQ("etc/file", profile->extents[0].path);
+
+  auto requested = ReplayPrefetchProfile(td.path, *profile);
+  ASSERT_TRUE(IsOk(requested));
+  ASSERT_GT(*requested, 0u);
+}
+
+}  // namespace apex
+}  // namespace android
@@ -22,6 +22,7 @@
 #include <android-base/logging.h>
 #include <android-base/macros.h>
 
+#include "apexd_mount.h"
 #include "string_log.h"
 
 using android::base::ErrnoError;
@@ -82,7 +83,19 @@ Result<void> BindMount(const std::string& target, const std::string& source) {
   }
 
   LOG(VERBOSE) << "Bind-mounting " << source << " to " << target;
+  bool new_mount_api_failed = false;
+  if (SupportsNewMountApi()) {
+    auto cloned = CloneMount(source, target);
+    if (cloned.ok()) {
+      return {};
+    }
+    LOG(WARNING) << "Retrying with mount(2): " << cloned.error();
+    new_mount_api_failed = true;
+  }
   if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) == 0) {
+    if (new_mount_api_failed) {
+      DisableNewMountApi();
+    }
     return {};
   }
   return ErrnoError() << "Could not bind-mount " << source << " to " << target;
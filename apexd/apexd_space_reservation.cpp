@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_space_reservation.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+
+#include "apexd_utils.h"
+
+using android::base::ErrnoError;
+using android::base::Error;
+using android::base::RemoveFileIfExists;
+using android::base::Result;
+using android::base::unique_fd;
+
+namespace android {
+namespace apex {
+
+namespace {
+
+constexpr const char* kReservationSuffix = ".tmp";
+
+// Module names come from the caller of the service and end up as file names,
+// so anything that could escape |dir_| or clash with another file is rejected.
+Result<void> CheckModuleName(const std::string& module_name) {
+  if (module_name.empty() || module_name[0] == '.') {
+    return Error() << "Invalid module name \"" << module_name << "\"";
+  }
+  for (char c : module_name) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '_' &&
+        c != '-') {
+      return Error() << "Invalid module name \"" << module_name << "\"";
+    }
+  }
+  return {};
+}
+
+Result<void> Allocate(const std::string& path, int64_t size) {
+  unique_fd fd(open(path.c_str(), O_WRONLY | O_CLOEXEC | O_CREAT, 0644));
+  if (fd.get() == -1) {
+    return ErrnoError() << "Failed to open file for reservation " << path;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0) {
+    return ErrnoError() << "Failed to stat " << path;
+  }
+  if (st.st_size > size && ftruncate(fd.get(), size) != 0) {
+    return ErrnoError() << "Failed to shrink " << path;
+  }
+  // Unlike resizing, which leaves a sparse file, this allocates the blocks.
+  if (fallocate(fd.get(), 0, 0, size) != 0) {
+    if (errno != EOPNOTSUPP) {
+      return ErrnoError() << "Failed to allocate " << size << " bytes for "
+                          << path;
+    }
+    PLOG(WARNING) << "Can't allocate " << path << ", reserving sparsely";
+    if (ftruncate(fd.get(), size) != 0) {
+      return ErrnoError() << "Failed to resize " << path;
+    }
+  }
+  return {};
+}
+
+}  // namespace
+
+std::string SpaceReservation::GetPath(const std::string& module_name) const {
+  return dir_ + "/" + module_name + kReservationSuffix;
+}
+
+Result<void> SpaceReservation::Reserve(
+    const std::map<std::string, int64_t>& sizes) const {
+  for (const auto& [module_name, size] : sizes) {
+    if (auto st = CheckModuleName(module_name); !st.ok()) {
+      return st.error();
+    }
+    if (size < 0) {
+      return Error() << "Cannot reserve negative byte of space for "
+                     << module_name;
+    }
+  }
+
+  // Release what is no longer needed first, so that it can be reused.
+  auto ledger = GetLedger();
+  if (!ledger.ok()) {
+    return ledger.error();
+  }
+  for (const auto& [module_name, size] : *ledger) {
+    auto it = sizes.find(module_name);
+    if (it == sizes.end() || it->second == 0) {
+      RemoveFileIfExists(GetPath(module_name));
+    }
+  }
+
+  for (const auto& [module_name, size] : sizes) {
+    if (size == 0) {
+      continue;
+    }
+    LOG(INFO) << "Reserving " << size << " bytes for " << module_name;
+    if (auto st = Allocate(GetPath(module_name), size); !st.ok()) {
+      if (auto release = ReleaseAll(); !release.ok()) {
+        LOG(ERROR) << release.error();
+      }
+      return st.error();
+    }
+  }
+  return {};
+}
+
+Result<int64_t> SpaceReservation::Release(
+    const std::string& module_name) const {
+  if (auto st = CheckModuleName(module_name); !st.ok()) {
+    return st.error();
+  }
+  for (const auto& name : {module_name, std::string(kUnattributed)}) {
+    const std::string path = GetPath(name);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return ErrnoError() << "Failed to stat " << path;
+    }
+    if (unlink(path.c_str()) != 0) {
+      return ErrnoError() << "Failed to unlink " << path;
+    }
+    LOG(INFO) << "Released " << st.st_size << " bytes reserved for " << name;
+    return st.st_size;
+  }
+  return 0;
+}
+
+Result<void> SpaceReservation::ReleaseAll() const {
+  return DeleteDirContent(dir_);
+}
+
+Result<std::map<std::string, int64_t>> SpaceReservation::GetLedger() const {
+  auto files = ReadDir(dir_, [](const auto& entry) {
+    std::error_code ec;
+    return entry.is_regular_file(ec);
+  });
+  if (!files.ok()) {
+    return files.error();
+  }
+  std::map<std::string, int64_t> ledger;
+  for (const auto& file : *files) {
+    std::string name = std::filesystem::path(file).filename();
+    if (!android::base::EndsWith(name, kReservationSuffix)) {
+      continue;
+    }
+    name.resize(name.size() - strlen(kReservationSuffix));
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0) {
+      return ErrnoError() << "Failed to stat " << file;
+    }
+    ledger.emplace(std::move(name), st.st_size);
+  }
+  return ledger;
+}
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <android-base/result.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace android {
+namespace apex {
+
+// Disk space set aside, per module, for decompressing CAPEXes after an OTA.
+//
+// Each reservation is a file in |dir| named after the module, with its blocks
+// allocated up front so that they can't be taken by anything else before the
+// module is decompressed. The directory is the ledger: it survives the reboot
+// into the new build, where each module gives back its own reservation right
+// before it is decompressed.
+class SpaceReservation {
+ public:
+  // Key of space reserved without knowing which module it is for.
+  static constexpr const char* kUnattributed = "full";
+
+  explicit SpaceReservation(std::string dir) : dir_(std::move(dir)) {}
+
+  std::string GetPath(const std::string& module_name) const;
+
+  // Makes the ledger hold exactly |sizes|, allocating and releasing space as
+  // needed. Entries of size 0 are released. Fails without changing anything if
+  // a module name isn't a valid file name. If space for all of them can't be
+  // allocated, everything is released and an error returned.
+  android::base::Result<void> Reserve(
+      const std::map<std::string, int64_t>& sizes) const;
+
+  // Releases the space reserved for |module_name|, or if there is none, the
+  // unattributed space. Returns the number of bytes released.
+  android::base::Result<int64_t> Release(const std::string& module_name) const;
+
+  android::base::Result<void> ReleaseAll() const;
+
+  // Returns the size reserved for each module.
+  android::base::Result<std::map<std::string, int64_t>> GetLedger() const;
+
+ private:
+  std::string dir_;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_space_reservation.h"
+
+#include <android-base/file.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apexd_test_utils.h"
+
+namespace android {
+namespace apex {
+
+using android::apex::testing::IsOk;
+using ::testing::Pair;
+using ::testing::UnorderedElementsAre;
+
+TEST(SpaceReservationTest, ReserveAllocatesBlocksPerModule) {
+  TemporaryDir dir;
+  SpaceReservation reservation(dir.path);
+
+  ASSERT_TRUE(IsOk(reservation.Reserve(
+      {{"com.android.foo", 64 * 1024}, {"com.android.bar", 16 * 1024}})));
+
+  auto ledger = reservation.GetLedger();
+  ASSERT_TRUE(IsOk(ledger));
+  ASSERT_THAT(*ledger,
+              UnorderedElementsAre(Pair("com.android.foo", 64 * 1024),
+                                   Pair("com.android.bar", 16 * 1024)));
+  struct stat st;
+  ASSERT_EQ(0, stat(reservation.GetPath("com.android.foo").c_str(), &st));
+  // Not a sparse file.
+  ASSERT_GE(st.st_blocks * 512, 64 * 1024);
+}
+
+TEST(SpaceReservationTest, ReserveReplacesLedger) {
+  TemporaryDir dir;
+  SpaceReservation reservation(dir.path);
+
+  ASSERT_TRUE(IsOk(reservation.Reserve(
+      {{"com.android.foo", 100}, {"com.android.bar", 100}})));
+  ASSERT_TRUE(IsOk(reservation.Reserve(
+      {{"com.android.foo", 10}, {"com.android.baz", 1000}})));
+
+  auto ledger = reservation.GetLedger();
+  ASSERT_TRUE(IsOk(ledger));
+  ASSERT_THAT(*ledger, UnorderedElementsAre(Pair("com.android.foo", 10),
+                                            Pair("com.android.baz", 1000)));
+}
+
+TEST(SpaceReservationTest, ReleaseOnlyGivesBackThatModule) {
+  TemporaryDir dir;
+  SpaceReservation reservation(dir.path);
+  ASSERT_TRUE(IsOk(reservation.Reserve(
+      {{"com.android.foo", 100}, {"com.android.bar", 200}})));
+
+  auto released = reservation.Release("com.android.foo");
+  ASSERT_TRUE(IsOk(released));
+  ASSERT_EQ(100, *released);
+  released = reservation.Release("com.android.foo");
+  ASSERT_TRUE(IsOk(released));
+  ASSERT_EQ(0, *released);
+
+  auto ledger = reservation.GetLedger();
+  ASSERT_TRUE(IsOk(ledger));
+  ASSERT_THAT(*ledger, UnorderedElementsAre(Pair("com.android.bar", 200)));
+}
+
+TEST(SpaceReservationTest, ReleaseFallsBackToUnattributed) {
+  TemporaryDir dir;
+  SpaceReservation reservation(dir.path);
+  ASSERT_TRUE(
+      IsOk(reservation.Reserve({{SpaceReservation::kUnattributed, 100}})));
+
+  auto released = reservation.Release("com.android.foo");
+  ASSERT_TRUE(IsOk(released));
+  ASSERT_EQ(100, *released);
+
+  auto ledger = reservation.GetLedger();
+  ASSERT_TRUE(IsOk(ledger));
+  ASSERT_TRUE(ledger->empty());
+}
+
+TEST(SpaceReservationTest, ReserveFailsForNegativeSize) {
+  TemporaryDir dir;
+  SpaceReservation reservation(dir.path);
+  ASSERT_FALSE(IsOk(reservation.Reserve({{"com.android.foo", -1}})));
+}
+
+TEST(SpaceReservationTest, RejectsInvalidModuleNames) {
+  TemporaryDir dir;
+  const std::string sub_dir = std::string(dir.path) + "/sub";
+  ASSERT_EQ(0, mkdir(sub_dir.c_str(), 0755));
+  SpaceReservation reservation(sub_dir);
+  ASSERT_TRUE(IsOk(reservation.Reserve({{"com.android.foo", 100}})));
+
+  for (const std::string name : {"", ".", "..", "../foo", "foo/bar", ".foo"}) {
+    ASSERT_FALSE(IsOk(reservation.Reserve({{name, 10}}))) << name;
+    ASSERT_FALSE(IsOk(reservation.Release(name))) << name;
+  }
+  // Nothing was changed, and nothing was written outside the ledger.
+  auto ledger = reservation.GetLedger();
+  ASSERT_TRUE(IsOk(ledger));
+  ASSERT_THAT(*ledger, UnorderedElementsAre(Pair("com.android.foo", 100)));
+  ASSERT_NE(0, access((std::string(dir.path) + "/foo.tmp").c_str(), F_OK));
+}
+
+}  // namespace apex
+}  // namespace android
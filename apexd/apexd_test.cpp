@@ -41,8 +41,11 @@
 #include "apex_file_repository.h"
 #include "apex_manifest.pb.h"
 #include "apexd_checkpoint.h"
+#include "apexd_dm.h"
+#include "apexd_embedded_hashtree.h"
 #include "apexd_loop.h"
 #include "apexd_session.h"
+#include "apexd_space_reservation.h"
 #include "apexd_test_utils.h"
 #include "apexd_utils.h"
 #include "com_android_apex.h"
@@ -63,6 +66,7 @@ using android::base::make_scope_guard;
 using android::base::ParseUint;
 using android::base::ReadFileToString;
 using android::base::ReadFully;
+using android::base::ReadFullyAtOffset;
 using android::base::RemoveFileIfExists;
 using android::base::Result;
 using android::base::Split;
@@ -81,6 +85,7 @@ using ::testing::Contains;
 using ::testing::HasSubstr;
 using ::testing::IsEmpty;
 using ::testing::Not;
+using ::testing::Pair;
 using ::testing::StartsWith;
 using ::testing::UnorderedElementsAre;
 using ::testing::UnorderedElementsAreArray;
@@ -147,6 +152,8 @@ class ApexdUnitTest : public ::testing::Test {
         StringPrintf("%s/metadata-sepolicy-staged-dir", td_.path);
 
     vm_payload_disk_ = StringPrintf("%s/vm-payload", td_.path);
+    activation_plan_file_ = StringPrintf("%s/activation-plan", td_.path);
+    ota_source_build_file_ = StringPrintf("%s/ota-source-build", td_.path);
 
     config_ = {kTestApexdStatusSysprop,
                {built_in_dir_},
@@ -157,13 +164,16 @@ class ApexdUnitTest : public ::testing::Test {
                staged_session_dir_.c_str(),
                metadata_sepolicy_staged_dir_.c_str(),
                kTestVmPayloadMetadataPartitionProp,
-               kTestActiveApexSelinuxCtx};
+               kTestActiveApexSelinuxCtx,
+               activation_plan_file_.c_str(),
+               ota_source_build_file_.c_str()};
   }
 
   const std::string& GetBuiltInDir() { return built_in_dir_; }
   const std::string& GetDataDir() { return data_dir_; }
   const std::string& GetDecompressionDir() { return decompression_dir_; }
   const std::string& GetOtaReservedDir() { return ota_reserved_dir_; }
+  const std::string& GetOtaSourceBuildFile() { return ota_source_build_file_; }
   const std::string& GetHashTreeDir() { return hash_tree_dir_; }
   const std::string GetStagedDir(int session_id) {
     return StringPrintf("%s/session_%d", staged_session_dir_.c_str(),
@@ -307,6 +317,8 @@ class ApexdUnitTest : public ::testing::Test {
   std::string vm_payload_metadata_path_;
   std::string staged_session_dir_;
   std::string metadata_sepolicy_staged_dir_;
+  std::string activation_plan_file_;
+  std::string ota_source_build_file_;
   ApexdConfig config_;
   std::vector<loop::LoopbackDeviceUniqueFd> loop_devices_;  // to be cleaned up
   int block_device_index_ = 2;  // "1" is reserved for metadata;
@@ -410,6 +422,80 @@ TEST_F(ApexdUnitTest, SharedLibsCanHaveBothVersionSelected) {
                                            ApexFileEq(ByRef(*shared_lib_v2))));
 }
 
+TEST_F(ApexdUnitTest, ActivationPlanInvalidatedByNewDataApex) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  AddPreInstalledApex("com.android.apex.cts.shim.apex");
+  auto& instance = ApexFileRepository::GetInstance();
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  auto identity = GetActivationInputsIdentity(instance);
+  ASSERT_THAT(identity, Ok());
+  auto all_apex = instance.AllApexFilesByName();
+  auto activation_list = SelectApexForActivation(all_apex, instance);
+  ASSERT_THAT(WriteActivationPlan(*identity, activation_list), Ok());
+
+  auto plan = ReadActivationPlan(*identity);
+  ASSERT_THAT(plan, Ok());
+  ASSERT_THAT(*plan, UnorderedElementsAre(
+                         GetBuiltInDir() + "/apex.apexd_test.apex",
+                         GetBuiltInDir() + "/com.android.apex.cts.shim.apex"));
+
+  AddDataApex("apex.apexd_test_v2.apex");
+  auto new_identity = GetActivationInputsIdentity(instance);
+  ASSERT_THAT(new_identity, Ok());
+  ASSERT_NE(*identity, *new_identity);
+  ASSERT_THAT(ReadActivationPlan(*new_identity), Not(Ok()));
+}
+
+TEST_F(ApexdUnitTest, PlanActivationPredictsWorkWithoutDoingIt) {
+  AddPreInstalledApex("com.android.apex.compressed.v1.capex");
+  AddPreInstalledApex("apex.apexd_test.apex");
+  AddDataApex("apex.apexd_test_no_hashtree.apex");
+
+  auto plan = PlanActivation();
+  ASSERT_THAT(plan, Ok());
+  ASSERT_EQ(2u, plan->size());
+
+  const auto& capex = (*plan)[0];
+  ASSERT_EQ("com.android.apex.compressed", capex.name);
+  ASSERT_TRUE(capex.is_pre_installed);
+  ASSERT_TRUE(capex.needs_decompression);
+  ASSERT_GT(capex.bytes_to_decompress, 0u);
+
+  const auto& data_apex = (*plan)[1];
+  ASSERT_EQ(GetDataDir() + "/apex.apexd_test_no_hashtree.apex",
+            data_apex.path);
+  ASSERT_FALSE(data_apex.is_pre_installed);
+  ASSERT_FALSE(data_apex.reason.empty());
+  ASSERT_TRUE(data_apex.needs_hashtree);
+  ASSERT_GT(data_apex.bytes_to_hash, 0u);
+
+  // Planning must not touch anything the next boot depends on.
+  ASSERT_FALSE(fs::exists(GetDecompressionDir() +
+                          "/com.android.apex.compressed@1" +
+                          kDecompressedApexPackageSuffix));
+  ASSERT_FALSE(
+      fs::exists(GetHashTreeDir() + "/com.android.apex.test_package@1"));
+  ASSERT_TRUE(ApexFileRepository::GetInstance().AllApexFilesByName().empty());
+}
+
+// A staged rollback replaces the newer data APEX on the next boot, so the plan
+// must pick the staged APEX even though its version is lower.
+TEST_F(ApexdUnitTest, PlanActivationPicksStagedRollback) {
+  AddPreInstalledApex("apex.apexd_test.apex");
+  AddDataApex("apex.apexd_test_v2.apex");
+  auto apex_session = CreateStagedSession("apex.apexd_test.apex", 123);
+  ASSERT_THAT(apex_session, Ok());
+  ASSERT_THAT(apex_session->UpdateStateAndCommit(SessionState::STAGED), Ok());
+
+  auto plan = PlanActivation();
+  ASSERT_THAT(plan, Ok());
+  ASSERT_EQ(1u, plan->size());
+  ASSERT_EQ(GetStagedDir(123) + "/apex.apexd_test.apex", (*plan)[0].path);
+  ASSERT_EQ(1, (*plan)[0].version);
+  ASSERT_FALSE((*plan)[0].is_pre_installed);
+}
+
 // Data version of shared libs should not be selected if lower than
 // preinstalled version
 TEST_F(ApexdUnitTest, SharedLibsDataVersionDeletedIfLower) {
@@ -475,6 +561,57 @@ TEST_F(ApexdUnitTest, ProcessCompressedApexRunsVerification) {
   ASSERT_EQ(return_value.size(), 0u);
 }
 
+TEST_F(ApexdUnitTest, ProcessCompressedApexReusesIdenticalDataApex) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  // Same payload as the CAPEX, but not where a decompressed APEX would be.
+  std::string data_apex_path =
+      AddDataApex("com.android.apex.compressed.v1_original.apex",
+                  "com.android.apex.compressed@1.apex");
+  // Different payload, not reused.
+  AddDataApex("com.android.apex.compressed.v1_different_digest_original.apex");
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  auto decompressed_apex_path = StringPrintf(
+      "%s/com.android.apex.compressed@1%s", GetDecompressionDir().c_str(),
+      kDecompressedApexPackageSuffix);
+  ASSERT_EQ(return_value[0].GetPath(), decompressed_apex_path);
+  // It's the data APEX, rather than a new decompressed copy.
+  struct stat data_st, decompressed_st;
+  ASSERT_EQ(0, stat(data_apex_path.c_str(), &data_st));
+  ASSERT_EQ(0, stat(decompressed_apex_path.c_str(), &decompressed_st));
+  ASSERT_EQ(data_st.st_ino, decompressed_st.st_ino);
+}
+
+// .ota.apex files may still be being decompressed into, so they are never
+// reused under another name.
+TEST_F(ApexdUnitTest, ProcessCompressedApexDoesNotReuseOtaApex) {
+  auto compressed_apex = ApexFile::Open(
+      AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
+  // Same payload as the CAPEX, left by an OTA of another version.
+  auto ota_apex_path =
+      StringPrintf("%s/com.android.apex.compressed@2%s",
+                   GetDecompressionDir().c_str(), kOtaApexPackageSuffix);
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_original.apex"),
+           ota_apex_path);
+
+  std::vector<ApexFileRef> compressed_apex_list;
+  compressed_apex_list.emplace_back(std::cref(*compressed_apex));
+  auto return_value =
+      ProcessCompressedApex(compressed_apex_list, /* is_ota_chroot= */ false);
+  ASSERT_EQ(return_value.size(), 1u);
+
+  struct stat ota_st, decompressed_st;
+  ASSERT_EQ(0, stat(ota_apex_path.c_str(), &ota_st));
+  ASSERT_EQ(0, stat(return_value[0].GetPath().c_str(), &decompressed_st));
+  ASSERT_NE(ota_st.st_ino, decompressed_st.st_ino);
+}
+
 TEST_F(ApexdUnitTest, ValidateDecompressedApex) {
   auto capex = ApexFile::Open(
       AddPreInstalledApex("com.android.apex.compressed.v1.capex"));
@@ -576,6 +713,18 @@ TEST_F(ApexdUnitTest, DISABLED_ProcessCompressedApexOnOtaChroot) {
   auto apex_file = ApexFile::Open(decompressed_file_path);
   ASSERT_THAT(return_value,
               UnorderedElementsAre(ApexFileEq(ByRef(*apex_file))));
+
+  // Progress is published for the OTA client, and no checkpoint is left
+  const std::string size =
+      std::to_string(*compressed_apex->GetDecompressedSize());
+  std::string progress;
+  ASSERT_TRUE(ReadFileToString(GetDecompressionDir() + "/" +
+                                   kOtaDecompressionProgressFilename,
+                               &progress));
+  ASSERT_EQ(size + " " + size, progress);
+  ASSERT_THAT(
+      PathExists(GetDecompressionCheckpointPath(decompressed_file_path)),
+      HasValue(false));
 }
 
 // When decompressing APEX, reuse existing OTA APEX
@@ -737,11 +886,42 @@ TEST_F(ApexdUnitTest, CalculateSizeForCompressedApex) {
       std::make_tuple("new_apex_2", 1, 2),
       std::make_tuple("com.android.apex.compressed", 1, 4),  // will be ignored
       std::make_tuple("com.android.apex.compressed", 2, 8),
+      // Natively compressed, will be ignored
+      std::make_tuple("new_apex_3", 1, 0),
   };
   int64_t result = CalculateSizeForCompressedApex(input, instance);
   ASSERT_EQ(1 + 2 + 8LL, result);
 }
 
+TEST_F(ApexdUnitTest, CalculateReservationsForCompressedApex) {
+  ApexFileRepository instance;
+  AddPreInstalledApex("com.android.apex.compressed.v1.capex");
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  std::vector<std::tuple<std::string, int64_t, int64_t>> input = {
+      std::make_tuple("new_apex", 1, 1),
+      std::make_tuple("com.android.apex.compressed", 1, 4),  // will be ignored
+      std::make_tuple("com.android.apex.compressed", 2, 8),
+  };
+  ASSERT_THAT(CalculateReservationsForCompressedApex(input, instance),
+              UnorderedElementsAre(Pair("new_apex", 1),
+                                   Pair("com.android.apex.compressed", 8)));
+}
+
+TEST_F(ApexdUnitTest,
+       ShouldAllocateSpaceForDecompressionNativelyCompressedBefore) {
+  AddPreInstalledApex("apex.apexd_test_erofs_native.capex");
+  auto& instance = ApexFileRepository::GetInstance();
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  // Same APEX as the pre-installed one, which is mounted as is: not selected
+  ASSERT_FALSE(ShouldAllocateSpaceForDecompression(
+      "com.android.apex.test_package", 1, instance));
+  // A different version may need decompression: selected
+  ASSERT_TRUE(ShouldAllocateSpaceForDecompression(
+      "com.android.apex.test_package", 2, instance));
+}
+
 TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexCreatesSingleFile) {
   TemporaryDir dest_dir;
   // Reserving space should create a single file in dest_dir with exact size
@@ -829,6 +1009,84 @@ TEST_F(ApexdUnitTest, ReserveSpaceForCapexCleansOtaApex) {
   ASSERT_THAT(PathExists(ota_apex_path), HasValue(false));
 }
 
+TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexPerModule) {
+  TemporaryDir dest_dir;
+  // A leftover reservation made without a per-module breakdown
+  ASSERT_THAT(ReserveSpaceForCompressedApex(100, dest_dir.path), Ok());
+
+  ASSERT_THAT(ReserveSpaceForCompressedApex(
+                  {{"com.android.foo", 10}, {"com.android.bar", 20}},
+                  dest_dir.path),
+              Ok());
+  auto ledger = SpaceReservation(dest_dir.path).GetLedger();
+  ASSERT_THAT(ledger, Ok());
+  ASSERT_THAT(*ledger, UnorderedElementsAre(Pair("com.android.foo", 10),
+                                            Pair("com.android.bar", 20)));
+
+  // Passing no modules releases everything
+  ASSERT_THAT(ReserveSpaceForCompressedApex(std::map<std::string, int64_t>{},
+                                            dest_dir.path),
+              Ok());
+  auto files = ReadDir(dest_dir.path, [](auto _) { return true; });
+  ASSERT_THAT(files, Ok());
+  ASSERT_EQ(files->size(), 0u);
+}
+
+// .ota.apex files are kept across reboots before the OTA is applied, so that
+// their decompression can resume, and removed once it is.
+TEST_F(ApexdUnitTest, RemoveStaleOtaApexKeepsOtaApexUntilOtaIsApplied) {
+  ASSERT_THAT(ReserveSpaceForCompressedApex({{"com.android.foo", 10}},
+                                            GetOtaReservedDir()),
+              Ok());
+  auto ota_apex_path = StringPrintf(
+      "%s/ota_apex%s", GetDecompressionDir().c_str(), kOtaApexPackageSuffix);
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_original.apex"),
+           ota_apex_path);
+
+  ASSERT_THAT(RemoveStaleOtaApex(), HasValue(0u));
+  ASSERT_THAT(PathExists(ota_apex_path), HasValue(true));
+
+  // Booted into the build the OTA was applied to.
+  ASSERT_TRUE(WriteStringToFile("some/other/build", GetOtaSourceBuildFile()));
+  auto reclaimed = RemoveStaleOtaApex();
+  ASSERT_THAT(reclaimed, Ok());
+  ASSERT_GT(*reclaimed, 0u);
+  ASSERT_THAT(PathExists(ota_apex_path), HasValue(false));
+}
+
+// Reservations are kept across reboots before the OTA is applied, and released
+// once it is.
+TEST_F(ApexdUnitTest, ReleaseLeftoverReservedSpaceOnceOtaIsApplied) {
+  ASSERT_THAT(ReserveSpaceForCompressedApex(
+                  {{"com.android.foo", 10}, {"com.android.bar", 20}},
+                  GetOtaReservedDir()),
+              Ok());
+
+  ASSERT_THAT(ReleaseLeftoverReservedSpace(), HasValue(0u));
+  auto ledger = SpaceReservation(GetOtaReservedDir()).GetLedger();
+  ASSERT_THAT(ledger, Ok());
+  ASSERT_EQ(ledger->size(), 2u);
+
+  // Booted into the build the OTA was applied to.
+  ASSERT_TRUE(WriteStringToFile("some/other/build", GetOtaSourceBuildFile()));
+  ASSERT_THAT(ReleaseLeftoverReservedSpace(), HasValue(30u));
+  ledger = SpaceReservation(GetOtaReservedDir()).GetLedger();
+  ASSERT_THAT(ledger, Ok());
+  ASSERT_TRUE(ledger->empty());
+  ASSERT_THAT(PathExists(GetOtaSourceBuildFile()), HasValue(false));
+}
+
+// Without a record of an OTA being prepared, .ota.apex files are left alone.
+TEST_F(ApexdUnitTest, RemoveStaleOtaApexNeedsPreparedOta) {
+  auto ota_apex_path = StringPrintf(
+      "%s/ota_apex%s", GetDecompressionDir().c_str(), kOtaApexPackageSuffix);
+  fs::copy(GetTestFile("com.android.apex.compressed.v1_original.apex"),
+           ota_apex_path);
+
+  ASSERT_THAT(RemoveStaleOtaApex(), HasValue(0u));
+  ASSERT_THAT(PathExists(ota_apex_path), HasValue(true));
+}
+
 TEST_F(ApexdUnitTest, ReserveSpaceForCompressedApexErrorForNegativeValue) {
   TemporaryDir dest_dir;
   // Should return error if negative value is passed
@@ -1710,7 +1968,7 @@ TEST_F(ApexdMountTest, NoHashtreeApexNewSessionDoesNotImpactActivePackage) {
   ASSERT_THAT(ReadDevice(*block_device), Ok());
 }
 
-TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesMovesHashtree) {
+TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesEmbedsHashtree) {
   MockCheckpointInterface checkpoint_interface;
   checkpoint_interface.SetSupportsCheckpoint(true);
   InitializeVold(&checkpoint_interface);
@@ -1752,19 +2010,38 @@ TEST_F(ApexdMountTest, NoHashtreeApexStagePackagesMovesHashtree) {
   }
 
   ASSERT_THAT(StagePackages({staged_apex.GetPath()}), Ok());
-  // Check that hashtree file was moved.
-  {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1.new";
-    ASSERT_THAT(PathExists(hashtree_path), HasValue(false));
+  // Check that the hashtree went into the active APEX instead of a file.
+  for (const auto& suffix : {"", ".new", ".new.apex"}) {
+    std::string path =
+        GetHashTreeDir() + "/com.android.apex.test_package@1" + suffix;
+    ASSERT_THAT(PathExists(path), HasValue(false)) << path << " still exists";
   }
+  std::string active_path =
+      GetDataDir() + "/com.android.apex.test_package@1.apex";
+  auto embedded = FindEmbeddedHashTree(active_path);
+  ASSERT_THAT(embedded, Ok());
+  ASSERT_TRUE(embedded->has_value());
   {
-    std::string hashtree_path =
-        GetHashTreeDir() + "/com.android.apex.test_package@1";
-    ASSERT_THAT(PathExists(hashtree_path), HasValue(true));
-    std::vector<uint8_t> moved_hashtree_data = read_fn(hashtree_path);
-    ASSERT_EQ(moved_hashtree_data, original_hashtree_data);
+    unique_fd fd(
+        TEMP_FAILURE_RETRY(open(active_path.c_str(), O_RDONLY | O_CLOEXEC)));
+    ASSERT_NE(-1, fd.get());
+    std::vector<uint8_t> embedded_hashtree_data(original_hashtree_data.size());
+    ASSERT_TRUE(ReadFullyAtOffset(fd.get(), embedded_hashtree_data.data(),
+                                  embedded_hashtree_data.size(),
+                                  (*embedded)->offset));
+    ASSERT_EQ(embedded_hashtree_data, original_hashtree_data);
   }
+
+  // The embedded hashtree is read through the loop device of the payload.
+  ASSERT_THAT(ActivatePackage(active_path), Ok());
+  UnmountOnTearDown(active_path);
+  auto children = ListChildLoopDevices("com.android.apex.test_package@1");
+  ASSERT_THAT(children, Ok());
+  ASSERT_EQ(1u, children->size())
+      << "Unexpected number of children: " << Join(*children, ",");
+  auto block_device = GetBlockDeviceForApex("com.android.apex.test_package@1");
+  ASSERT_THAT(block_device, Ok());
+  ASSERT_THAT(ReadDevice(*block_device), Ok());
 }
 
 TEST_F(ApexdMountTest, DeactivePackageTearsDownVerityDevice) {
@@ -2351,6 +2628,10 @@ TEST_F(ApexdMountTest, OnOtaChrootBootstrapOnlyCompressedApexes) {
       StringPrintf("%s/com.android.apex.compressed@1%s",
                    GetDecompressionDir().c_str(), kOtaApexPackageSuffix);
   UnmountOnTearDown(decompressed_apex);
+  // Progress is not left behind once decompression is done.
+  ASSERT_THAT(PathExists(GetDecompressionDir() + "/" +
+                         kOtaDecompressionProgressFilename),
+              HasValue(false));
 
   auto apex_mounts = GetApexMounts();
   ASSERT_THAT(apex_mounts,
@@ -3117,6 +3398,86 @@ TEST_F(ApexdMountTest, OnStartOnlyPreInstalledApexes) {
                                    "/apex/com.android.apex.test_package_2@1"));
 }
 
+TEST_F(ApexdMountTest, OnStartMountsNativelyCompressedApexAsIs) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path =
+      AddPreInstalledApex("apex.apexd_test_erofs_native.capex");
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path);
+
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.test_package",
+                                   "/apex/com.android.apex.test_package@1"));
+  // Nothing was decompressed.
+  ASSERT_THAT(PathExists(GetDecompressionDir() +
+                         "/com.android.apex.test_package@1" +
+                         kDecompressedApexPackageSuffix),
+              HasValue(false));
+  // But it's still mounted on top of dm-verity device.
+  auto& db = GetApexDatabaseForTesting();
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& data, bool latest) {
+                           ASSERT_TRUE(latest);
+                           ASSERT_EQ(data.full_path, apex_path);
+                           ASSERT_NE(data.device_name, "");
+                         });
+}
+
+TEST_F(ApexdMountTest, OnStartPublishesPerApexStatus) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
+  std::string apex_path_2 =
+      AddPreInstalledApex("apex.apexd_test_different_app.apex");
+
+  ASSERT_THAT(
+      ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()}),
+      Ok());
+
+  OnStart();
+
+  UnmountOnTearDown(apex_path_1);
+  UnmountOnTearDown(apex_path_2);
+
+  // Global status is not affected by per-APEX status.
+  ASSERT_EQ(GetProperty(kTestApexdStatusSysprop, ""), "starting");
+  ASSERT_EQ(GetProperty(std::string(kTestApexdStatusSysprop) +
+                            ".apex.com.android.apex.test_package",
+                        ""),
+            "activated");
+  ASSERT_EQ(GetProperty(std::string(kTestApexdStatusSysprop) +
+                            ".apex.com.android.apex.test_package_2",
+                        ""),
+            "activated");
+}
+
+TEST_F(ApexdMountTest, RecordsLoopIoModeOfMountedApex) {
+  std::string file_path = AddPreInstalledApex("apex.apexd_test.apex");
+  ApexFileRepository::GetInstance().AddPreInstalledApex({GetBuiltInDir()});
+
+  ASSERT_THAT(ActivatePackage(file_path), Ok());
+  UnmountOnTearDown(file_path);
+
+  auto modes = GetMountedApexLoopIoModes();
+  ASSERT_EQ(1u, modes.size());
+  auto dio = loop::IsDirectIoEnabled(modes[0].loop_name);
+  ASSERT_THAT(dio, Ok());
+  ASSERT_EQ(*dio, modes[0].loop_direct_io);
+  // A buffered device always comes with an explanation.
+  ASSERT_EQ(modes[0].loop_direct_io, modes[0].loop_buffered_reason.empty());
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasHigherVersion) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -3167,6 +3528,89 @@ TEST_F(ApexdMountTest, OnStartDataHasWrongSHA) {
                                    "/apex/com.android.apex.cts.shim@1"));
 }
 
+// A cached plan that fails to activate is replaced by a fresh selection, not
+// just patched up with pre-installed APEXes.
+TEST_F(ApexdMountTest, OnStartSelectsAgainIfCachedPlanFailsToActivate) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path = AddPreInstalledApex("com.android.apex.cts.shim.apex");
+  auto& instance = ApexFileRepository::GetInstance();
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  TemporaryDir stale_dir;
+  const std::string stale_apex = StringPrintf(
+      "%s/com.android.apex.cts.shim.v2_wrong_sha.apex", stale_dir.path);
+  fs::copy(GetTestFile("com.android.apex.cts.shim.v2_wrong_sha.apex"),
+           stale_apex);
+  auto stale = ApexFile::Open(stale_apex);
+  ASSERT_THAT(stale, Ok());
+  auto identity = GetActivationInputsIdentity(instance);
+  ASSERT_THAT(identity, Ok());
+  ASSERT_THAT(WriteActivationPlan(*identity, {std::cref(*stale)}), Ok());
+
+  UnmountOnTearDown(apex_path);
+  OnStart();
+
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.cts.shim",
+                                   "/apex/com.android.apex.cts.shim@1"));
+  auto plan = ReadActivationPlan(*identity);
+  ASSERT_THAT(plan, Ok());
+  ASSERT_THAT(*plan, UnorderedElementsAre(apex_path));
+}
+
+// APEXes that did get activated from a failed cached plan don't stay mounted
+// next to the ones selected afterwards.
+TEST_F(ApexdMountTest, OnStartUnmountsCachedPlanBeforeSelectingAgain) {
+  MockCheckpointInterface checkpoint_interface;
+  // Need to call InitializeVold before calling OnStart
+  InitializeVold(&checkpoint_interface);
+
+  std::string apex_path_1 = AddPreInstalledApex("apex.apexd_test.apex");
+  std::string apex_path_2 =
+      AddPreInstalledApex("com.android.apex.cts.shim.apex");
+  auto& instance = ApexFileRepository::GetInstance();
+  ASSERT_THAT(instance.AddPreInstalledApex({GetBuiltInDir()}), Ok());
+
+  TemporaryDir stale_dir;
+  const std::string stale_apex_1 =
+      StringPrintf("%s/apex.apexd_test_v2.apex", stale_dir.path);
+  fs::copy(GetTestFile("apex.apexd_test_v2.apex"), stale_apex_1);
+  const std::string stale_apex_2 = StringPrintf(
+      "%s/com.android.apex.cts.shim.v2_wrong_sha.apex", stale_dir.path);
+  fs::copy(GetTestFile("com.android.apex.cts.shim.v2_wrong_sha.apex"),
+           stale_apex_2);
+  auto stale_1 = ApexFile::Open(stale_apex_1);
+  ASSERT_THAT(stale_1, Ok());
+  auto stale_2 = ApexFile::Open(stale_apex_2);
+  ASSERT_THAT(stale_2, Ok());
+  auto identity = GetActivationInputsIdentity(instance);
+  ASSERT_THAT(identity, Ok());
+  ASSERT_THAT(WriteActivationPlan(*identity,
+                                  {std::cref(*stale_1), std::cref(*stale_2)}),
+              Ok());
+
+  UnmountOnTearDown(apex_path_1);
+  UnmountOnTearDown(apex_path_2);
+  OnStart();
+
+  auto apex_mounts = GetApexMounts();
+  ASSERT_THAT(apex_mounts,
+              UnorderedElementsAre("/apex/com.android.apex.test_package",
+                                   "/apex/com.android.apex.test_package@1",
+                                   "/apex/com.android.apex.cts.shim",
+                                   "/apex/com.android.apex.cts.shim@1"));
+  auto& db = GetApexDatabaseForTesting();
+  db.ForallMountedApexes("com.android.apex.test_package",
+                         [&](const MountedApexData& data, bool latest) {
+                           ASSERT_TRUE(latest);
+                           ASSERT_EQ(data.full_path, apex_path_1);
+                         });
+}
+
 TEST_F(ApexdMountTest, OnStartDataHasSameVersion) {
   MockCheckpointInterface checkpoint_interface;
   // Need to call InitializeVold before calling OnStart
@@ -4535,6 +4979,27 @@ TEST_F(ApexdMountTest, OnBootstrapCreatesEmptyDmDevices) {
             dm.GetState("com.android.apex.compressed"));
 }
 
+TEST_F(ApexdMountTest, DeleteDmDevicesRemovesAllDevices) {
+  DeviceMapper& dm = DeviceMapper::Instance();
+  const std::vector<std::string> names = {"apexd-test-dm-batch-1",
+                                          "apexd-test-dm-batch-2"};
+  auto cleaner = make_scope_guard([&]() {
+    for (const auto& name : names) {
+      dm.DeleteDeviceIfExists(name, 1s);
+    }
+  });
+
+  ASSERT_EQ(names.size(), CreateEmptyDmDevices(names));
+  for (const auto& name : names) {
+    ASSERT_EQ(dm::DmDeviceState::SUSPENDED, dm.GetState(name));
+  }
+
+  ASSERT_THAT(DeleteDmDevices(names), Ok());
+  for (const auto& name : names) {
+    ASSERT_EQ(dm::DmDeviceState::INVALID, dm.GetState(name));
+  }
+}
+
 TEST_F(ApexdUnitTest, StagePackagesFailKey) {
   auto status =
       StagePackages({GetTestFile("apex.apexd_test_no_inst_key.apex")});
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Copyright (C) 2022 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Generates raw payload images covering on-disk layouts that the images of the
+# test APEXes don't use, for apex_payload_reader_test.
+#
+# usage: gen_payload_images.sh <mke2fs> <e2fsck> <mkfs.erofs> <out dir>
+
+set -e
+
+MKE2FS=$1
+E2FSCK=$2
+MKFS_EROFS=$3
+OUT=$4
+
+ROOT="${OUT}/root"
+rm -rf "${ROOT}"
+mkdir "${ROOT}"
+
+# A file with data in every other 4K block and a trailing hole. Its 32 data
+# runs don't fit in the inode, so ext4 needs an extent tree of depth 1.
+for i in $(seq 0 2 62); do
+  printf 'block %d\n' "${i}" |
+      dd of="${ROOT}/sparse" bs=4096 seek="${i}" conv=notrunc 2>/dev/null
+done
+truncate -s $((64 * 4096)) "${ROOT}/sparse"
+
+# Large enough to need double indirect blocks with 1K blocks.
+seq 1 60000 > "${ROOT}/seq"
+
+# Spans several directory blocks, and is indexed after e2fsck -D.
+mkdir "${ROOT}/dir"
+for i in $(seq 0 999); do
+  : > "${ROOT}/dir/entry_$(printf '%03d' "${i}")"
+done
+
+# Keeps the output independent of the build host.
+export E2FSPROGS_FAKE_TIME=1
+MKE2FS_OPTS="-q -F -N 2048 -U 00000000-0000-0000-0000-000000000000 \
+-E hash_seed=00000000-0000-0000-0000-000000000000 -d ${ROOT}"
+
+"${MKE2FS}" ${MKE2FS_OPTS} -t ext4 -b 4096 "${OUT}/payload_ext4.img" 4M
+
+cp "${OUT}/payload_ext4.img" "${OUT}/payload_ext4_htree.img"
+# Exits with 1 when it optimized directories.
+"${E2FSCK}" -fyD "${OUT}/payload_ext4_htree.img" >/dev/null || [ $? -eq 1 ]
+
+"${MKE2FS}" ${MKE2FS_OPTS} -t ext4 -O ^extent,^64bit,^flex_bg -b 1024 \
+    "${OUT}/payload_ext4_1k_blockmap.img" 4M
+
+"${MKFS_EROFS}" --quiet --chunksize=4096 -T 0 \
+    -U 00000000-0000-0000-0000-000000000000 \
+    "${OUT}/payload_erofs_chunked.img" "${ROOT}"
+
+rm -rf "${ROOT}"
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_throttle.h"
+
+#include <thread>
+
+namespace android {
+namespace apex {
+
+BandwidthLimiter::BandwidthLimiter(uint64_t bytes_per_sec)
+    : BandwidthLimiter(
+          bytes_per_sec, [] { return std::chrono::steady_clock::now(); },
+          [](std::chrono::nanoseconds duration) {
+            std::this_thread::sleep_for(duration);
+          }) {}
+
+BandwidthLimiter::BandwidthLimiter(uint64_t bytes_per_sec, Clock clock,
+                                   Sleep sleep)
+    : bytes_per_sec_(bytes_per_sec),
+      clock_(std::move(clock)),
+      sleep_(std::move(sleep)) {}
+
+void BandwidthLimiter::Acquire(uint64_t bytes) {
+  if (bytes_per_sec_ == 0) {
+    return;
+  }
+  if (!started_) {
+    started_ = true;
+    start_ = clock_();
+  }
+  total_bytes_ += bytes;
+  // When the bytes seen so far would be due at the allowed rate.
+  const auto due =
+      start_ + std::chrono::nanoseconds(static_cast<int64_t>(
+                   static_cast<double>(total_bytes_) * 1e9 / bytes_per_sec_));
+  const auto now = clock_();
+  if (due > now) {
+    sleep_(due - now);
+  }
+}
+
+}  // namespace apex
+}  // namespace android
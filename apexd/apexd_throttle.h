@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+namespace android {
+namespace apex {
+
+// Paces a producer to at most |bytes_per_sec| on average, by sleeping in
+// Acquire() once it gets ahead. Used to keep background work, such as
+// decompressing CAPEXes for an OTA, from saturating storage bandwidth.
+class BandwidthLimiter {
+ public:
+  using Clock = std::function<std::chrono::steady_clock::time_point()>;
+  using Sleep = std::function<void(std::chrono::nanoseconds)>;
+
+  // A |bytes_per_sec| of 0 means unlimited.
+  explicit BandwidthLimiter(uint64_t bytes_per_sec);
+  BandwidthLimiter(uint64_t bytes_per_sec, Clock clock, Sleep sleep);
+
+  // Accounts for |bytes| more bytes, sleeping if they arrived faster than
+  // allowed since the first call.
+  void Acquire(uint64_t bytes);
+
+ private:
+  uint64_t bytes_per_sec_;
+  Clock clock_;
+  Sleep sleep_;
+  bool started_ = false;
+  std::chrono::steady_clock::time_point start_;
+  uint64_t total_bytes_ = 0;
+};
+
+}  // namespace apex
+}  // namespace android
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2022 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "apexd_throttle.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+namespace android {
+namespace apex {
+
+using namespace std::chrono_literals;
+
+TEST(BandwidthLimiterTest, SleepsWhenAheadOfRate) {
+  std::chrono::steady_clock::time_point now;
+  std::chrono::nanoseconds slept{0};
+  BandwidthLimiter limiter(
+      1024, [&] { return now; },
+      [&](std::chrono::nanoseconds duration) {
+        slept += duration;
+        now += duration;
+      });
+
+  limiter.Acquire(512);
+  ASSERT_EQ(500ms, slept);
+  limiter.Acquire(512);
+  ASSERT_EQ(1s, slept);
+
+  // Time spent producing counts towards the budget.
+  now += 2s;
+  limiter.Acquire(1024);
+  ASSERT_EQ(1s, slept);
+}
+
+TEST(BandwidthLimiterTest, ZeroIsUnlimited) {
+  bool slept = false;
+  BandwidthLimiter limiter(
+      0, [] { return std::chrono::steady_clock::time_point(); },
+      [&](std::chrono::nanoseconds) { slept = true; });
+  limiter.Acquire(1ull << 40);
+  ASSERT_FALSE(slept);
+}
+
+}  // namespace apex
+}  // namespace android
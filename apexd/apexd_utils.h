@@ -26,7 +26,10 @@
 #include <vector>
 
 #include <dirent.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -306,6 +309,24 @@ inline android::base::Result<uintmax_t> GetFileSize(
   return value;
 }
 
+// Unlinks |path| and returns the number of bytes it occupied on disk, which
+// can be less than its size for sparse files.
+inline android::base::Result<uint64_t> UnlinkAndGetReclaimedBytes(
+    const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return android::base::ErrnoError() << "Failed to stat " << path;
+  }
+  if (unlink(path.c_str()) != 0) {
+    return android::base::ErrnoError() << "Failed to unlink " << path;
+  }
+  // Other links keep the blocks in use.
+  if (st.st_nlink > 1) {
+    return 0;
+  }
+  return static_cast<uint64_t>(st.st_blocks) * 512;
+}
+
 inline android::base::Result<void> RestoreconPath(const std::string& path) {
   unsigned int seflags = SELINUX_ANDROID_RESTORECON_RECURSE;
   if (selinux_android_restorecon(path.c_str(), seflags) < 0) {
@@ -325,6 +346,39 @@ inline android::base::Result<std::string> GetfileconPath(
   return ret;
 }
 
+// Moves the calling thread into the idle I/O scheduling class and lowers its
+// CPU priority to |nice_level|. Used for background work that must not compete
+// with the boot critical path.
+inline android::base::Result<void> SetCurrentThreadBackgroundPriority(
+    int nice_level) {
+  // From linux/ioprio.h, which is not available in all sysroots.
+  static constexpr int kIoprioWhoProcess = 1;
+  static constexpr int kIoprioClassIdle = 3;
+  static constexpr int kIoprioClassShift = 13;
+  if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+              kIoprioClassIdle << kIoprioClassShift) != 0) {
+    return android::base::ErrnoError() << "Failed to set idle I/O priority";
+  }
+  if (setpriority(PRIO_PROCESS, 0, nice_level) != 0) {
+    return android::base::ErrnoError()
+           << "Failed to set nice level to " << nice_level;
+  }
+  return {};
+}
+
+// Like SetCurrentThreadBackgroundPriority, but also moves the calling thread to
+// SCHED_IDLE, so that it only runs when nothing else wants the CPU.
+inline android::base::Result<void> SetCurrentThreadIdlePriority() {
+  if (auto st = SetCurrentThreadBackgroundPriority(19); !st.ok()) {
+    return st;
+  }
+  struct sched_param param = {.sched_priority = 0};
+  if (sched_setscheduler(0, SCHED_IDLE, &param) != 0) {
+    return android::base::ErrnoError() << "Failed to set SCHED_IDLE";
+  }
+  return {};
+}
+
 }  // namespace apex
 }  // namespace android
 
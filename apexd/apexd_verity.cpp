@@ -17,10 +17,12 @@
 #include "apexd_verity.h"
 
 #include <android-base/file.h>
+#include <android-base/logging.h>
 #include <android-base/result.h>
 #include <android-base/unique_fd.h>
 #include <verity/hash_tree_builder.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <iomanip>
 #include <sstream>
@@ -152,11 +154,41 @@ Result<std::string> CalculateRootDigest(const std::string& hashtree_file,
   return result;
 }
 
+// Links the hashtree in |store| to |hashtree_file| if its root digest is the
+// expected one. Entries that turn out to be corrupted are removed.
+Result<bool> ReuseFromStore(const HashTreeStore& store,
+                            const ApexVerityData& verity_data,
+                            const std::string& hashtree_file) {
+  const std::string path = store.GetPath(verity_data);
+  if (access(path.c_str(), F_OK) != 0) {
+    return false;
+  }
+  auto digest = CalculateRootDigest(path, verity_data);
+  if (!digest.ok() || *digest != verity_data.root_digest) {
+    LOG(ERROR) << "Removing corrupted hashtree " << path;
+    if (auto st = store.Remove(verity_data); !st.ok()) {
+      return st.error();
+    }
+    return false;
+  }
+  return store.LinkTo(verity_data, hashtree_file);
+}
+
+void AddToStore(const HashTreeStore* store, const ApexVerityData& verity_data,
+                const std::string& hashtree_file) {
+  if (store == nullptr) {
+    return;
+  }
+  if (auto st = store->Add(verity_data, hashtree_file); !st.ok()) {
+    LOG(WARNING) << "Failed to store hashtree: " << st.error();
+  }
+}
+
 }  // namespace
 
 Result<PrepareHashTreeResult> PrepareHashTree(
     const ApexFile& apex, const ApexVerityData& verity_data,
-    const std::string& hashtree_file) {
+    const std::string& hashtree_file, const HashTreeStore* store) {
   if (apex.IsCompressed()) {
     return Error() << "Cannot prepare HashTree of compressed APEX";
   }
@@ -164,7 +196,6 @@ Result<PrepareHashTreeResult> PrepareHashTree(
   if (auto st = CreateDirIfNeeded(Dirname(hashtree_file), 0700); !st.ok()) {
     return st.error();
   }
-  bool should_regenerate_hashtree = false;
   auto exists = PathExists(hashtree_file);
   if (!exists.ok()) {
     return exists.error();
@@ -174,31 +205,66 @@ Result<PrepareHashTreeResult> PrepareHashTree(
     if (!digest.ok()) {
       return digest.error();
     }
-    if (*digest != verity_data.root_digest) {
-      LOG(ERROR) << "Regenerating hashtree! Digest of " << hashtree_file
-                 << " does not match digest of " << apex.GetPath() << " : "
-                 << *digest << "\nvs\n"
-                 << verity_data.root_digest;
-      should_regenerate_hashtree = true;
+    if (*digest == verity_data.root_digest) {
+      LOG(INFO) << "hashtree: reuse " << hashtree_file;
+      // Hashtrees generated before the store existed join it here.
+      AddToStore(store, verity_data, hashtree_file);
+      return kReuse;
+    }
+    LOG(ERROR) << "Regenerating hashtree! Digest of " << hashtree_file
+               << " does not match digest of " << apex.GetPath() << " : "
+               << *digest << "\nvs\n"
+               << verity_data.root_digest;
+    // The file may be linked to the store, or back a loop device. Writing a
+    // new file instead of truncating this one leaves both of them intact.
+    if (unlink(hashtree_file.c_str()) != 0) {
+      return ErrnoError() << "Failed to unlink " << hashtree_file;
     }
-  } else {
-    should_regenerate_hashtree = true;
   }
 
-  if (should_regenerate_hashtree) {
-    if (auto st = GenerateHashTree(apex, verity_data, hashtree_file);
+  if (store != nullptr) {
+    if (auto st = ReuseFromStore(*store, verity_data, hashtree_file);
         !st.ok()) {
-      return st.error();
+      LOG(WARNING) << st.error();
+    } else if (*st) {
+      LOG(INFO) << "hashtree: reuse " << store->GetPath(verity_data) << " for "
+                << hashtree_file;
+      return kReuse;
     }
-    LOG(INFO) << "hashtree: generated to " << hashtree_file;
-    return KRegenerate;
   }
-  LOG(INFO) << "hashtree: reuse " << hashtree_file;
-  return kReuse;
+
+  if (auto st = GenerateHashTree(apex, verity_data, hashtree_file); !st.ok()) {
+    return st.error();
+  }
+  LOG(INFO) << "hashtree: generated to " << hashtree_file;
+  AddToStore(store, verity_data, hashtree_file);
+  return KRegenerate;
 }
 
-void RemoveObsoleteHashTrees() {
-  // TODO(b/120058143): on boot complete, remove unused hashtree files
+Result<uint64_t> RemoveObsoleteHashTrees(
+    const std::string& hashtree_dir, const std::vector<std::string>& in_use) {
+  auto files = ReadDir(hashtree_dir, [](const auto& entry) {
+    std::error_code ec;
+    return entry.is_regular_file(ec);
+  });
+  if (!files.ok()) {
+    return files.error();
+  }
+  uint64_t reclaimed = 0;
+  for (const auto& file : *files) {
+    const std::string name = std::filesystem::path(file).filename();
+    if (std::find(in_use.begin(), in_use.end(), name) != in_use.end()) {
+      continue;
+    }
+    LOG(INFO) << "Removing obsolete hashtree " << file;
+    auto bytes = UnlinkAndGetReclaimedBytes(file);
+    if (!bytes.ok()) {
+      LOG(ERROR) << bytes.error();
+      continue;
+    }
+    reclaimed += *bytes;
+  }
+  return reclaimed;
 }
 
 std::string BytesToHex(const uint8_t* bytes, size_t bytes_len) {
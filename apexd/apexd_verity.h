@@ -17,8 +17,10 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "apex_file.h"
+#include "apexd_hashtree_store.h"
 
 namespace android {
 namespace apex {
@@ -33,11 +35,17 @@ enum PrepareHashTreeResult {
 // Generates a dm-verity hashtree of a given |apex| if |hashtree_file| doesn't
 // exist or it's root_digest doesn't match |verity_data.root_digest|. Otherwise
 // does nothing.
+//
+// If |store| is given, a hashtree found there is linked to |hashtree_file|
+// instead of generating it, and generated hashtrees are added to it.
 android::base::Result<PrepareHashTreeResult> PrepareHashTree(
     const ApexFile& apex, const ApexVerityData& verity_data,
-    const std::string& hashtree_file);
+    const std::string& hashtree_file, const HashTreeStore* store = nullptr);
 
-void RemoveObsoleteHashTrees();
+// Removes files from |hashtree_dir| that are not named after one of |in_use|.
+// Returns the number of bytes reclaimed.
+android::base::Result<uint64_t> RemoveObsoleteHashTrees(
+    const std::string& hashtree_dir, const std::vector<std::string>& in_use);
 
 }  // namespace apex
 }  // namespace android
@@ -112,6 +112,45 @@ TEST(ApexdVerityTest, RegenerateHashree) {
   ASSERT_NE(first_hashtree, second_hashtree) << hashtree_file << " was reused";
 }
 
+TEST(ApexdVerityTest, ReusesHashtreeFromStore) {
+  TemporaryDir td;
+  HashTreeStore store(StringPrintf("%s/store", td.path));
+
+  auto apex = ApexFile::Open(GetTestFile("apex.apexd_test_no_hashtree.apex"));
+  ASSERT_TRUE(IsOk(apex));
+  auto verity_data = apex->VerifyApexVerity(apex->GetBundledPublicKey());
+  ASSERT_TRUE(IsOk(verity_data));
+
+  auto first_file = StringPrintf("%s/com.android.apex.test_package@1", td.path);
+  auto status = PrepareHashTree(*apex, *verity_data, first_file, &store);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+
+  // Same payload under another name, e.g. staged again after being removed.
+  auto second_file =
+      StringPrintf("%s/com.android.apex.test_package@1.new", td.path);
+  status = PrepareHashTree(*apex, *verity_data, second_file, &store);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(kReuse, *status);
+
+  struct stat first_st, second_st;
+  ASSERT_EQ(0, stat(first_file.c_str(), &first_st));
+  ASSERT_EQ(0, stat(second_file.c_str(), &second_st));
+  ASSERT_EQ(first_st.st_ino, second_st.st_ino);
+  ASSERT_EQ(3u, second_st.st_nlink);
+
+  // A corrupted hashtree in the store is dropped and generated again.
+  ASSERT_EQ(0, unlink(first_file.c_str()));
+  ASSERT_EQ(0, unlink(second_file.c_str()));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      std::string(4096, 'a'), store.GetPath(*verity_data)));
+  status = PrepareHashTree(*apex, *verity_data, first_file, &store);
+  ASSERT_TRUE(IsOk(status));
+  ASSERT_EQ(KRegenerate, *status);
+  ASSERT_EQ(0, stat(first_file.c_str(), &first_st));
+  ASSERT_EQ(2u, first_st.st_nlink);
+}
+
 TEST(ApexdVerityTest, CannotPrepareHashTreeForCompressedApex) {
   TemporaryDir td;
 
@@ -127,5 +166,26 @@ TEST(ApexdVerityTest, CannotPrepareHashTreeForCompressedApex) {
       ::testing::HasSubstr("Cannot prepare HashTree of compressed APEX"));
 }
 
+TEST(ApexdVerityTest, RemoveObsoleteHashTrees) {
+  TemporaryDir td;
+  for (const auto& name : {"com.android.foo@1", "com.android.foo@2.new",
+                           "com.android.bar@1"}) {
+    ASSERT_TRUE(android::base::WriteStringToFile(
+        std::string(4096, 'a'), StringPrintf("%s/%s", td.path, name)));
+  }
+
+  auto reclaimed = RemoveObsoleteHashTrees(
+      td.path, {"com.android.foo@1", "com.android.foo@2.new"});
+  ASSERT_TRUE(IsOk(reclaimed));
+  ASSERT_GT(*reclaimed, 0u);
+
+  ASSERT_EQ(0, access(StringPrintf("%s/com.android.foo@1", td.path).c_str(),
+                      F_OK));
+  ASSERT_EQ(0, access(StringPrintf("%s/com.android.foo@2.new", td.path).c_str(),
+                      F_OK));
+  ASSERT_NE(0, access(StringPrintf("%s/com.android.bar@1", td.path).c_str(),
+                      F_OK));
+}
+
 }  // namespace apex
 }  // namespace android
@@ -17,11 +17,14 @@
 #include "apexservice.h"
 
 #include <dirent.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <android-base/chrono_utils.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/result.h>
 #include <android-base/stringprintf.h>
@@ -38,6 +41,12 @@
 #include "apex_file.h"
 #include "apex_file_repository.h"
 #include "apexd.h"
+#include "apexd_io_stats.h"
+#include "apexd_lock_stats.h"
+#include "apexd_loop.h"
+#include "apexd_maintenance.h"
+#include "apexd_memory.h"
+#include "apexd_pin.h"
 #include "apexd_session.h"
 #include "string_log.h"
 
@@ -261,15 +270,22 @@ BinderStatus ApexService::markBootCompleted() {
   return BinderStatus::ok();
 }
 
-BinderStatus ApexService::calculateSizeForCompressedApex(
-    const CompressedApexInfoList& compressed_apex_info_list,
-    int64_t* required_size) {
+static std::vector<std::tuple<std::string, int64_t, int64_t>>
+ToCompressedApexTuples(
+    const CompressedApexInfoList& compressed_apex_info_list) {
   std::vector<std::tuple<std::string, int64_t, int64_t>> compressed_apexes;
   compressed_apexes.reserve(compressed_apex_info_list.apexInfos.size());
   for (const auto& apex_info : compressed_apex_info_list.apexInfos) {
     compressed_apexes.emplace_back(apex_info.moduleName, apex_info.versionCode,
                                    apex_info.decompressedSize);
   }
+  return compressed_apexes;
+}
+
+BinderStatus ApexService::calculateSizeForCompressedApex(
+    const CompressedApexInfoList& compressed_apex_info_list,
+    int64_t* required_size) {
+  auto compressed_apexes = ToCompressedApexTuples(compressed_apex_info_list);
   const auto& instance = ApexFileRepository::GetInstance();
   *required_size = ::android::apex::CalculateSizeForCompressedApex(
       compressed_apexes, instance);
@@ -278,13 +294,11 @@ BinderStatus ApexService::calculateSizeForCompressedApex(
 
 BinderStatus ApexService::reserveSpaceForCompressedApex(
     const CompressedApexInfoList& compressed_apex_info_list) {
-  int64_t required_size;
-  if (auto res = calculateSizeForCompressedApex(compressed_apex_info_list,
-                                                &required_size);
-      !res.isOk()) {
-    return res;
-  }
-  if (auto res = ReserveSpaceForCompressedApex(required_size, kOtaReservedDir);
+  auto compressed_apexes = ToCompressedApexTuples(compressed_apex_info_list);
+  const auto& instance = ApexFileRepository::GetInstance();
+  auto reservations = ::android::apex::CalculateReservationsForCompressedApex(
+      compressed_apexes, instance);
+  if (auto res = ReserveSpaceForCompressedApex(reservations, kOtaReservedDir);
       !res.ok()) {
     return BinderStatus::fromExceptionCode(
         BinderStatus::EX_SERVICE_SPECIFIC,
@@ -762,7 +776,23 @@ status_t ApexService::onTransact(uint32_t _aidl_code, const Parcel& _aidl_data,
   return BnApexService::onTransact(_aidl_code, _aidl_data, _aidl_reply,
                                    _aidl_flags);
 }
-status_t ApexService::dump(int fd, const Vector<String16>& /*args*/) {
+status_t ApexService::dump(int fd, const Vector<String16>& args) {
+  // dumpsys apexservice --io [--csv]: per-APEX read I/O at boot checkpoints
+  // and right now.
+  if (args.size() >= 1 && args[0] == String16("--io")) {
+    auto checkpoints = ApexIoAccounting::GetInstance().GetCheckpoints();
+    checkpoints.push_back(
+        {"now",
+         std::chrono::duration_cast<std::chrono::milliseconds>(
+             android::base::boot_clock::now().time_since_epoch()),
+         ::android::apex::SampleApexIoStats()});
+    const bool csv = args.size() >= 2 && args[1] == String16("--csv");
+    std::string msg = csv ? FormatApexIoCheckpointsCsv(checkpoints)
+                          : FormatApexIoCheckpoints(checkpoints);
+    dprintf(fd, "%s", msg.c_str());
+    return OK;
+  }
+
   std::vector<ApexInfo> list;
   BinderStatus status = getActivePackages(&list);
   dprintf(fd, "ACTIVE PACKAGES:\n");
@@ -807,6 +837,67 @@ status_t ApexService::dump(int fd, const Vector<String16>& /*args*/) {
     dprintf(fd, "%s", msg.c_str());
   }
 
+  auto& pinner = ApexPinner::GetInstance();
+  dprintf(fd, "PINNED PACKAGES: %" PRIu64 " of %" PRIu64 " bytes\n",
+          pinner.GetPinnedBytes(), pinner.GetBudget());
+  for (const auto& stats : pinner.GetStats()) {
+    std::string msg = StringLog()
+                      << "Package: " << stats.apex_name
+                      << " Pinned bytes: " << stats.pinned_bytes
+                      << " Extents: " << stats.pinned_extents << std::endl;
+    dprintf(fd, "%s", msg.c_str());
+  }
+
+  dprintf(fd, "LOOP DEVICES: %zu fell back to buffered I/O\n",
+          loop::GetBufferedIoFallbackCount());
+  for (const auto& data : ::android::apex::GetMountedApexLoopIoModes()) {
+    std::string msg = StringLog()
+                      << "Path: " << data.full_path
+                      << " Loop: " << data.loop_name << " I/O: "
+                      << (data.loop_direct_io ? "direct" : "buffered");
+    if (!data.loop_direct_io && !data.loop_buffered_reason.empty()) {
+      msg += " (" + data.loop_buffered_reason + ")";
+    }
+    dprintf(fd, "%s\n", msg.c_str());
+  }
+
+  uint64_t total_reclaimed = 0;
+  std::chrono::milliseconds total_duration{0};
+  auto maintenance_stats = MaintenanceExecutor::GetInstance().GetStats();
+  for (const auto& stats : maintenance_stats) {
+    total_reclaimed += stats.reclaimed_bytes;
+    total_duration += stats.duration;
+  }
+  dprintf(fd, "MAINTENANCE: %" PRIu64 " bytes reclaimed in %lld ms\n",
+          total_reclaimed, static_cast<long long>(total_duration.count()));
+  for (const auto& stats : maintenance_stats) {
+    std::string msg = StringLog()
+                      << "Task: " << stats.name
+                      << " Reclaimed bytes: " << stats.reclaimed_bytes
+                      << " Duration: " << stats.duration.count() << "ms"
+                      << (stats.ok ? "" : " (failed)") << std::endl;
+    dprintf(fd, "%s", msg.c_str());
+  }
+
+  dprintf(fd, "LOCKS:\n");
+  std::string locks = FormatLockStats(GetLockStats());
+  dprintf(fd, "%s", locks.c_str());
+
+  auto memory_checkpoints = MemoryAccounting::GetInstance().GetCheckpoints();
+  if (auto usage = ReadMemoryUsage(); usage.ok()) {
+    memory_checkpoints.push_back(
+        {"now",
+         std::chrono::duration_cast<std::chrono::milliseconds>(
+             android::base::boot_clock::now().time_since_epoch()),
+         *usage});
+  } else {
+    LOG(WARNING) << usage.error();
+  }
+  dprintf(fd, "MEMORY: %zu bytes saved by sharing strings\n",
+          ApexFileRepository::GetInstance().GetInternedBytes());
+  std::string memory = FormatMemoryCheckpoints(memory_checkpoints);
+  dprintf(fd, "%s", memory.c_str());
+
   return OK;
 }
 
@@ -853,6 +944,12 @@ status_t ApexService::shellCommand(int in, int out, int err,
            "\n"
            "Note: APEX package will be successfully remounted only if there "
            "are no alive processes holding a reference to it"
+        << std::endl
+        << "  setPinBudget [budget_kb] - re-pin hot extents of the pinned "
+           "packages within the given budget; 0 releases all pins"
+        << std::endl
+        << "  plan - print which packages the next boot would activate, why, "
+           "and what it would cost, without activating anything"
         << std::endl;
     dprintf(fd, "%s", log.operator std::string().c_str());
   };
@@ -1059,6 +1156,61 @@ status_t ApexService::shellCommand(int in, int out, int err,
     return BAD_VALUE;
   }
 
+  if (cmd == String16("setPinBudget")) {
+    if (args.size() != 2) {
+      print_help(err, "setPinBudget requires one budget in KiB");
+      return BAD_VALUE;
+    }
+    if (auto debug = CheckDebuggable("setPinBudget"); !debug.isOk()) {
+      dprintf(err, "%s\n", debug.toString8().string());
+      return BAD_VALUE;
+    }
+    if (auto root = CheckCallerIsRoot("setPinBudget"); !root.isOk()) {
+      dprintf(err, "%s\n", root.toString8().string());
+      return BAD_VALUE;
+    }
+    uint64_t budget_kb;
+    if (!android::base::ParseUint(String8(args[1]).c_str(), &budget_kb)) {
+      std::string msg = StringLog() << "Failed to parse budget. Must be a "
+                                       "non-negative integer."
+                                    << std::endl;
+      dprintf(err, "%s", msg.c_str());
+      return BAD_VALUE;
+    }
+    auto status = ApexPinner::GetInstance().SetBudget(budget_kb << 10);
+    if (status.ok()) {
+      return OK;
+    }
+    std::string msg = StringLog() << "Failed to set pin budget: "
+                                  << status.error().message() << std::endl;
+    dprintf(err, "%s", msg.c_str());
+    return BAD_VALUE;
+  }
+
+  if (cmd == String16("plan")) {
+    if (args.size() != 1) {
+      print_help(err, "plan has no options");
+      return BAD_VALUE;
+    }
+    if (auto debug = CheckDebuggable("plan"); !debug.isOk()) {
+      dprintf(err, "%s\n", debug.toString8().string());
+      return BAD_VALUE;
+    }
+    if (auto root = CheckCallerIsRoot("plan"); !root.isOk()) {
+      dprintf(err, "%s\n", root.toString8().string());
+      return BAD_VALUE;
+    }
+    auto plan = PlanActivation();
+    if (!plan.ok()) {
+      std::string msg = StringLog() << "Failed to plan activation: "
+                                    << plan.error().message() << std::endl;
+      dprintf(err, "%s", msg.c_str());
+      return BAD_VALUE;
+    }
+    dprintf(out, "%s", FormatActivationPlanEntries(*plan).c_str());
+    return OK;
+  }
+
   if (cmd == String16("help")) {
     if (args.size() != 1) {
       print_help(err, "Help has no options");
@@ -1088,6 +1240,23 @@ void CreateAndRegisterService() {
   sp<ApexService> apex_service = sp<ApexService>::make();
   auto lazy_registrar = LazyServiceRegistrar::getInstance();
   lazy_registrar.forcePersist(true);
+  // Once shutdown is allowed, servicemanager tells us when the last client is
+  // gone. Persist state before exiting rather than leaving that to the default
+  // handler, which exits right away.
+  lazy_registrar.setActiveServicesCallback([](bool has_clients) -> bool {
+    if (has_clients) {
+      return false;
+    }
+    ::android::apex::PrepareForShutdown();
+    auto registrar = LazyServiceRegistrar::getInstance();
+    if (!registrar.tryUnregister()) {
+      // A client showed up in the meantime.
+      registrar.reRegister();
+      return false;
+    }
+    LOG(INFO) << "apexservice has no clients, exiting";
+    exit(EXIT_SUCCESS);
+  });
   lazy_registrar.registerService(apex_service, kApexServiceName);
 }
 
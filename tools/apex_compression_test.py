@@ -319,5 +319,22 @@ class ApexCompressionTest(unittest.TestCase):
         if i in content_in_uncompressed_apex:
           self.assertEqual(zip_obj.getinfo(i).compress_type, ZIP_STORED)
 
+  def test_native_compression_requires_compressed_erofs_payload(self):
+    # The test APEX has an ext4 payload.
+    uncompressed_apex_fp = os.path.join(get_current_dir(), TEST_APEX + '.apex')
+    compressed_apex_fp = tempfile.NamedTemporaryFile(
+        prefix=self._testMethodName + '_compressed_', suffix='.capex').name
+
+    with self.assertRaises(RuntimeError) as error:
+      self._run_apex_compression_tool([
+          'compress', '--native',
+          '--input', uncompressed_apex_fp,
+          '--output', compressed_apex_fp
+      ])
+
+    self.assertIn('doesn\'t have an erofs payload with compressed files',
+                  str(error.exception))
+    self.assertFalse(os.path.exists(compressed_apex_fp))
+
 if __name__ == '__main__':
   unittest.main(verbosity=2)
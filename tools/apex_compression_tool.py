@@ -18,6 +18,7 @@
 
 Example:
   apex_compression_tool compress --input /apex/to/compress --output output/path
+  apex_compression_tool compress --native --input /erofs/apex --output output/path
   apex_compression_tool decompress --input /apex/to/decompress --output dir/
   apex_compression_tool verify-compressed --input /file/to/check
 """
@@ -85,6 +86,9 @@ def RunCompress(args, work_dir):
   global tool_path_list
   tool_path_list = args.apex_compression_tool_path
 
+  if args.native:
+    return RunCompressNative(args)
+
   cmd = ['soong_zip']
   cmd.extend(['-o', args.output])
 
@@ -128,6 +132,39 @@ def RunCompress(args, work_dir):
   return True
 
 
+# Offset of the erofs superblock in the image, and the fields of it that tell
+# whether mkfs.erofs compressed the files.
+EROFS_SUPERBLOCK_OFFSET = 1024
+EROFS_MAGIC = b'\xe2\xe1\xf5\xe0'
+EROFS_FEATURE_INCOMPAT_OFFSET = 80
+EROFS_FEATURE_INCOMPAT_COMPRESSION = 0x1 | 0x2
+
+
+def HasCompressedErofsPayload(apex_path):
+  with ZipFile(apex_path, 'r') as zip_obj:
+    with zip_obj.open('apex_payload.img') as image:
+      image.read(EROFS_SUPERBLOCK_OFFSET)
+      superblock = image.read(EROFS_FEATURE_INCOMPAT_OFFSET + 4)
+  if superblock[:4] != EROFS_MAGIC:
+    return False
+  features = int.from_bytes(superblock[EROFS_FEATURE_INCOMPAT_OFFSET:],
+                            'little')
+  return (features & EROFS_FEATURE_INCOMPAT_COMPRESSION) != 0
+
+
+def RunCompressNative(args):
+  """Turns an APEX with a compressed erofs payload into a compressed APEX
+
+  apexd mounts such a compressed APEX as is, so it's the input APEX unchanged,
+  keeping its signature.
+  """
+  if not HasCompressedErofsPayload(args.input):
+    print(args.input + ' doesn\'t have an erofs payload with compressed files')
+    return False
+  shutil.copyfile(args.input, args.output)
+  return True
+
+
 def AddOriginalApexDigestToManifest(capex_manifest_path, apex_image_path, verbose=False):
   # Retrieve the root digest of the image
   avbtool_cmd = [
@@ -164,6 +201,10 @@ def ParseArgs(argv):
                                     'compressed')
   parser_compress.add_argument('--output', type=str, required=True,
                                help='output path to compressed APEX file')
+  parser_compress.add_argument('--native', action='store_true',
+                               help='the input APEX has an erofs payload '
+                                    'with compressed files, which is mounted '
+                                    'without decompressing it')
   apex_compression_tool_path_in_environ = \
     'APEX_COMPRESSION_TOOL_PATH' in os.environ
   parser_compress.add_argument(
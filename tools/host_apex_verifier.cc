@@ -23,6 +23,8 @@
 #include <android-base/result.h>
 #include <android-base/strings.h>
 #include <apex_file.h>
+#include <apex_payload_reader.h>
+#include <apex_perf_lint.h>
 #include <builtins.h>
 #include <getopt.h>
 #include <parser.h>
@@ -31,9 +33,18 @@
 #include <service_parser.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
+using android::base::Error;
+using android::base::Result;
 using ::apex::proto::ApexManifest;
 
 // Fake getpwnam for host execution, used by the init::ServiceParser.
@@ -62,10 +73,15 @@ void PrintUsage() {
 Tests APEX file(s) for correctness.
 
 Options:
-  --deapexer=PATH             Use the deapexer binary at this path when extracting APEXes.
-  --debugfs=PATH              Use the debugfs binary at this path when extracting APEXes.
+  --deapexer=PATH             Use the deapexer binary at this path to extract APEXes whose
+                              payload can't be read in-process.
+  --debugfs=PATH              Use the debugfs binary at this path when running deapexer.
   --sdk_version=INT           The active system SDK version used when filtering versioned
                               init.rc files.
+  --jobs=INT                  Number of APEXes to check in parallel. Defaults to the
+                              number of CPUs.
+  --perf-lint                 Also report build choices that make APEXes slower to
+                              activate, with a rough estimate of their boot time cost.
   --out_system=DIR            Path to the factory APEX directory for the system partition.
   --out_system_ext=DIR        Path to the factory APEX directory for the system_ext partition.
   --out_product=DIR           Path to the factory APEX directory for the product partition.
@@ -82,15 +98,30 @@ const android::init::BuiltinFunctionMap& ApexInitRcSupportedActionMap() {
   return functions;
 }
 
+// Diagnostics and timings of checking a single APEX.
+struct ApexScanResult {
+  std::string apex_path;
+  std::string apex_name;
+  std::vector<std::string> errors;
+  std::vector<PerfFinding> perf_findings;
+  std::chrono::milliseconds extract_time{0};
+  std::chrono::milliseconds check_time{0};
+};
+
+// libinit_host keeps global state and isn't meant to be used from several
+// threads, so init rc files are parsed one APEX at a time.
+std::mutex init_parser_mutex;
+
 // Validate any init rc files inside the APEX.
-void CheckInitRc(const std::string& apex_dir, const ApexManifest& manifest,
-                 int sdk_version) {
+std::vector<std::string> CheckInitRc(const std::string& apex_dir,
+                                     const ApexManifest& manifest,
+                                     int sdk_version) {
+  std::lock_guard lock(init_parser_mutex);
+  std::vector<std::string> errors;
   init::Parser parser;
   init::ServiceList service_list = init::ServiceList();
   parser.AddSectionParser("service", std::make_unique<init::ServiceParser>(
                                          &service_list, nullptr, std::nullopt));
-  const init::BuiltinFunctionMap& function_map = ApexInitRcSupportedActionMap();
-  init::Action::set_function_map(&function_map);
   init::ActionManager action_manager = init::ActionManager();
   parser.AddSectionParser(
       "on", std::make_unique<init::ActionParser>(&action_manager, nullptr));
@@ -106,6 +137,7 @@ void CheckInitRc(const std::string& apex_dir, const ApexManifest& manifest,
       }
     }
   }
+  std::sort(init_configs.begin(), init_configs.end());
   // TODO(b/225380016): Extend this tool to check all init.rc files
   // in the APEX, possibly including different requirements depending
   // on the SDK version.
@@ -118,41 +150,134 @@ void CheckInitRc(const std::string& apex_dir, const ApexManifest& manifest,
     // Ensure the service path points inside this APEX.
     auto service_path = service->args()[0];
     if (!base::StartsWith(service_path, "/apex/" + manifest.name())) {
-      LOG(FATAL) << "Service " << service->name()
-                 << " has path outside of the APEX: " << service_path;
+      errors.push_back("Service " + service->name() +
+                       " has path outside of the APEX: " + service_path);
     }
     LOG(INFO) << service->name() << ": " << service_path;
   }
 
   // The parser will fail if there are any unsupported actions.
   if (parser.parse_error_count() > 0) {
-    LOG(FATAL) << "Failed to parse APEX init rc file(s)";
+    errors.push_back("Failed to parse APEX init rc file(s)");
   }
+  return errors;
+}
+
+// Extracts only the init rc files of |apex| to |dest_dir|/etc, which is all
+// CheckInitRc looks at. They are read straight out of the payload, without
+// extracting anything else.
+Result<void> ExtractInitRcFilesInProcess(const ApexFile& apex,
+                                         const std::string& dest_dir) {
+  auto reader = ApexPayloadReader::Open(apex);
+  if (!reader.ok()) {
+    return reader.error();
+  }
+  if (mkdir((dest_dir + "/etc").c_str(), 0755) != 0) {
+    return base::ErrnoError() << "Failed to create " << dest_dir << "/etc";
+  }
+  auto entries = reader->List("/etc");
+  if (!entries.ok()) {
+    // An APEX without /etc has no init rc files.
+    return {};
+  }
+  for (const auto& entry : *entries) {
+    if (!S_ISREG(entry.mode) || !base::EndsWith(entry.name, "rc")) {
+      continue;
+    }
+    auto content = reader->ReadFileToString("/etc/" + entry.name);
+    if (!content.ok()) {
+      return content.error();
+    }
+    const std::string path = dest_dir + "/etc/" + entry.name;
+    if (!base::WriteStringToFile(*content, path)) {
+      return base::ErrnoError() << "Failed to write " << path;
+    }
+  }
+  return {};
+}
+
+// Extracts the init rc files of |apex| to |dest_dir|/etc. Payloads the
+// in-process reader can't handle, such as other file systems or files it
+// can't read, are extracted in full with deapexer if it was given.
+Result<void> ExtractInitRcFiles(const std::string& deapexer,
+                                const std::string& debugfs,
+                                const ApexFile& apex,
+                                const std::string& dest_dir) {
+  auto st = ExtractInitRcFilesInProcess(apex, dest_dir);
+  if (st.ok()) {
+    return {};
+  }
+  if (deapexer.empty() || debugfs.empty()) {
+    return Error() << st.error() << " (pass --deapexer and --debugfs to "
+                   << "extract it with deapexer instead)";
+  }
+  LOG(INFO) << "Extracting " << apex.GetPath() << " with deapexer: "
+            << st.error();
+  std::error_code ec;
+  std::filesystem::remove_all(dest_dir + "/etc", ec);
+  std::string deapexer_command = deapexer + " --debugfs_path " + debugfs +
+                                 " extract " + apex.GetPath() + " " + dest_dir;
+  auto code = system(deapexer_command.c_str());
+  if (code != 0) {
+    return Error() << "Error running deapexer command \"" << deapexer_command
+                   << "\": " << code;
+  }
+  return {};
 }
 
 // Extract and validate a single APEX.
-void ScanApex(const std::string& deapexer, const std::string& debugfs,
-              int sdk_version, const std::string& apex_path) {
+ApexScanResult ScanApex(const std::string& deapexer,
+                        const std::string& debugfs, int sdk_version,
+                        bool perf_lint, const std::string& apex_path) {
   LOG(INFO) << "Checking APEX " << apex_path;
+  ApexScanResult result{.apex_path = apex_path};
+  auto start = std::chrono::steady_clock::now();
 
-  auto apex = OR_FATAL(ApexFile::Open(apex_path));
-  ApexManifest manifest = apex.GetManifest();
+  auto apex = ApexFile::Open(apex_path);
+  if (!apex.ok()) {
+    result.errors.push_back(apex.error().message());
+    return result;
+  }
+  ApexManifest manifest = apex->GetManifest();
+  result.apex_name = manifest.name();
+  const bool is_compressed =
+      apex->IsCompressed() || apex->IsNativelyCompressed();
 
+  auto work_dir = TemporaryDir();
   auto extracted_apex = TemporaryDir();
   std::string extracted_apex_dir = extracted_apex.path;
-  std::string deapexer_command = deapexer + " --debugfs_path " + debugfs +
-                                 " extract " + apex_path + " " +
-                                 extracted_apex_dir;
-  auto code = system(deapexer_command.c_str());
-  if (code != 0) {
-    LOG(FATAL) << "Error running deapexer command \"" << deapexer_command
-               << "\": " << code;
+  if (apex->IsCompressed()) {
+    std::string decompressed = std::string(work_dir.path) + "/original.apex";
+    if (auto st = apex->Decompress(decompressed); !st.ok()) {
+      result.errors.push_back(st.error().message());
+      return result;
+    }
+    apex = ApexFile::Open(decompressed);
+    if (!apex.ok()) {
+      result.errors.push_back(apex.error().message());
+      return result;
+    }
   }
+  if (auto st =
+          ExtractInitRcFiles(deapexer, debugfs, *apex, extracted_apex_dir);
+      !st.ok()) {
+    result.errors.push_back(st.error().message());
+    return result;
+  }
+  auto extracted = std::chrono::steady_clock::now();
+  result.extract_time =
+      std::chrono::duration_cast<std::chrono::milliseconds>(extracted - start);
 
-  CheckInitRc(extracted_apex_dir, manifest, sdk_version);
+  result.errors = CheckInitRc(extracted_apex_dir, manifest, sdk_version);
+  if (perf_lint) {
+    result.perf_findings = LintApex(apex_path, is_compressed, *apex);
+  }
+  result.check_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - extracted);
+  return result;
 }
 
-// Scan the factory APEX files in the partition apex dir.
+// List the factory APEX files in the partition apex dir, sorted by name.
 // Scans APEX files directly, rather than flattened ${PRODUCT_OUT}/apex/
 // directories. This allows us to check:
 //   - Prebuilt APEXes which do not flatten to that path.
@@ -160,26 +285,122 @@ void ScanApex(const std::string& deapexer, const std::string& debugfs,
 //     APEX may flatten to that path.
 //   - Extracted target_files archives which may not contain
 //     flattened <PARTITON>/apex/ directories.
-void ScanPartitionApexes(const std::string& deapexer,
-                         const std::string& debugfs, int sdk_version,
-                         const std::string& partition_dir) {
+std::vector<std::string> ListPartitionApexes(const std::string& partition_dir) {
   LOG(INFO) << "Scanning partition factory APEX dir " << partition_dir;
 
+  std::vector<std::string> apex_paths;
   std::unique_ptr<DIR, decltype(&closedir)> apex_dir(
       opendir(partition_dir.c_str()), closedir);
   if (!apex_dir) {
     LOG(WARNING) << "Unable to open dir " << partition_dir;
-    return;
+    return apex_paths;
   }
 
   dirent* entry;
   while ((entry = readdir(apex_dir.get()))) {
     if (base::EndsWith(entry->d_name, ".apex") ||
         base::EndsWith(entry->d_name, ".capex")) {
-      ScanApex(deapexer, debugfs, sdk_version,
-               partition_dir + "/" + entry->d_name);
+      apex_paths.push_back(partition_dir + "/" + entry->d_name);
     }
   }
+  std::sort(apex_paths.begin(), apex_paths.end());
+  return apex_paths;
+}
+
+// Checks |apex_paths| on |jobs| threads. Results are in the order of
+// |apex_paths|, whichever order they finish in.
+std::vector<ApexScanResult> ScanApexes(
+    const std::string& deapexer, const std::string& debugfs, int sdk_version,
+    bool perf_lint, const std::vector<std::string>& apex_paths, size_t jobs) {
+  std::vector<ApexScanResult> results(apex_paths.size());
+  std::atomic<size_t> next = 0;
+  auto worker = [&]() {
+    for (size_t i = next++; i < apex_paths.size(); i = next++) {
+      results[i] =
+          ScanApex(deapexer, debugfs, sdk_version, perf_lint, apex_paths[i]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < std::min(jobs, apex_paths.size()); i++) {
+    threads.emplace_back(worker);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+// Prints the perf findings of each APEX, most expensive APEXes first.
+void PrintPerfReport(const std::vector<ApexScanResult>& results) {
+  auto cost = [](const ApexScanResult& r) {
+    std::chrono::milliseconds total{0};
+    for (const auto& finding : r.perf_findings) {
+      total += finding.boot_cost;
+    }
+    return total;
+  };
+  std::vector<const ApexScanResult*> flagged;
+  for (const auto& result : results) {
+    if (!result.perf_findings.empty()) {
+      flagged.push_back(&result);
+    }
+  }
+  std::stable_sort(flagged.begin(), flagged.end(),
+                   [&](const auto* a, const auto* b) {
+                     return cost(*a) > cost(*b);
+                   });
+
+  std::chrono::milliseconds total{0};
+  for (const auto* result : flagged) {
+    total += cost(*result);
+    printf("%s (%s): ~%lld ms estimated boot impact\n",
+           result->apex_name.c_str(), result->apex_path.c_str(),
+           static_cast<long long>(cost(*result).count()));
+    for (const auto& finding : result->perf_findings) {
+      printf("  [%s] %s", finding.id.c_str(), finding.message.c_str());
+      if (finding.boot_cost.count() > 0) {
+        printf(" (~%lld ms)",
+               static_cast<long long>(finding.boot_cost.count()));
+      }
+      printf("\n");
+    }
+  }
+  printf("Perf lint: %zu of %zu APEXes flagged, ~%lld ms estimated boot "
+         "impact\n",
+         flagged.size(), results.size(), static_cast<long long>(total.count()));
+}
+
+void PrintTimingSummary(const std::vector<ApexScanResult>& results,
+                        std::chrono::milliseconds wall_time, size_t jobs) {
+  std::chrono::milliseconds extract_time{0};
+  std::chrono::milliseconds check_time{0};
+  for (const auto& result : results) {
+    extract_time += result.extract_time;
+    check_time += result.check_time;
+  }
+  printf("Checked %zu APEXes in %lld ms using %zu jobs (extract: %lld ms, "
+         "check: %lld ms)\n",
+         results.size(), static_cast<long long>(wall_time.count()), jobs,
+         static_cast<long long>(extract_time.count()),
+         static_cast<long long>(check_time.count()));
+
+  std::vector<const ApexScanResult*> slowest;
+  for (const auto& result : results) {
+    slowest.push_back(&result);
+  }
+  auto total = [](const ApexScanResult* r) {
+    return r->extract_time + r->check_time;
+  };
+  std::stable_sort(slowest.begin(), slowest.end(),
+                   [&](const auto* a, const auto* b) {
+                     return total(a) > total(b);
+                   });
+  constexpr size_t kSlowestToShow = 5;
+  for (size_t i = 0; i < std::min(kSlowestToShow, slowest.size()); i++) {
+    printf("  %6lld ms  %s\n",
+           static_cast<long long>(total(slowest[i]).count()),
+           slowest[i]->apex_path.c_str());
+  }
 }
 
 }  // namespace
@@ -187,8 +408,10 @@ void ScanPartitionApexes(const std::string& deapexer,
 int main(int argc, char** argv) {
   android::base::InitLogging(argv, &android::base::StdioLogger);
 
-  std::string deapexer, debugfs;
   int sdk_version = INT_MAX;
+  size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+  bool perf_lint = false;
+  std::string deapexer, debugfs;
   std::map<std::string, std::string> partition_map;
 
   while (true) {
@@ -197,6 +420,8 @@ int main(int argc, char** argv) {
         {"deapexer", required_argument, nullptr, 0},
         {"debugfs", required_argument, nullptr, 0},
         {"sdk_version", required_argument, nullptr, 0},
+        {"jobs", required_argument, nullptr, 0},
+        {"perf-lint", no_argument, nullptr, 0},
         {"out_system", required_argument, nullptr, 0},
         {"out_system_ext", required_argument, nullptr, 0},
         {"out_product", required_argument, nullptr, 0},
@@ -226,6 +451,15 @@ int main(int argc, char** argv) {
             return EXIT_FAILURE;
           }
         }
+        if (long_options[option_index].name == "perf-lint") {
+          perf_lint = true;
+        }
+        if (long_options[option_index].name == "jobs") {
+          if (!base::ParseUint(optarg, &jobs) || jobs == 0) {
+            PrintUsage();
+            return EXIT_FAILURE;
+          }
+        }
         for (const auto& p : partitions) {
           if (long_options[option_index].name == "out_" + p) {
             partition_map[p] = optarg;
@@ -244,15 +478,42 @@ int main(int argc, char** argv) {
   argc -= optind;
   argv += optind;
 
-  if (argc != 0 || deapexer.empty() || debugfs.empty()) {
+  if (argc != 0) {
     PrintUsage();
     return EXIT_FAILURE;
   }
 
+  const init::BuiltinFunctionMap& function_map = ApexInitRcSupportedActionMap();
+  init::Action::set_function_map(&function_map);
+
+  std::vector<std::string> apex_paths;
   for (const auto& p : partition_map) {
-    ScanPartitionApexes(deapexer, debugfs, sdk_version, p.second);
+    auto partition_apexes = ListPartitionApexes(p.second);
+    apex_paths.insert(apex_paths.end(), partition_apexes.begin(),
+                      partition_apexes.end());
   }
 
+  auto start = std::chrono::steady_clock::now();
+  auto results =
+      ScanApexes(deapexer, debugfs, sdk_version, perf_lint, apex_paths, jobs);
+  auto wall_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  size_t error_count = 0;
+  for (const auto& result : results) {
+    for (const auto& error : result.errors) {
+      LOG(ERROR) << result.apex_path << ": " << error;
+      error_count++;
+    }
+  }
+  if (perf_lint) {
+    PrintPerfReport(results);
+  }
+  PrintTimingSummary(results, wall_time, jobs);
+  if (error_count > 0) {
+    LOG(ERROR) << "Found " << error_count << " error(s)";
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 